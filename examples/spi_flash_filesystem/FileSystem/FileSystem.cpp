@@ -1,4 +1,6 @@
 #include "FileSystem.h"
+#include "S25FL128.h"
+#include "S25FL512.h"
 #include <algorithm>
 #include <assert.h>
 
@@ -6,7 +8,81 @@ extern "C" {
 #include <string.h>
 }
 
-#define FLASH(device) reinterpret_cast<SpiFlash *>(device)
+/* Device calls bound to the Flash implementation, bypassing the vtable */
+template <class Flash>
+struct FlashOps
+{
+    static unsigned int get_capacity(Flash &flash)
+    {
+        return flash.Flash::get_capacity();
+    }
+
+    static int read(Flash &flash, uint32_t addr, uint8_t *data, unsigned int sz)
+    {
+        return flash.Flash::read(addr, data, sz);
+    }
+
+    static int write(Flash &flash, uint32_t addr, const uint8_t *data, unsigned int sz)
+    {
+        return flash.Flash::write(addr, data, sz);
+    }
+
+    static int erase_block(Flash &flash, uint32_t addr)
+    {
+        return flash.Flash::erase_block(addr);
+    }
+
+    static int write_barrier(Flash &flash)
+    {
+        return flash.Flash::write_barrier();
+    }
+};
+
+/* Through the base class the device is only known at run time */
+template <>
+struct FlashOps<SpiFlash>
+{
+    static unsigned int get_capacity(SpiFlash &flash)
+    {
+        return flash.get_capacity();
+    }
+
+    static int read(SpiFlash &flash, uint32_t addr, uint8_t *data, unsigned int sz)
+    {
+        return flash.read(addr, data, sz);
+    }
+
+    static int write(SpiFlash &flash, uint32_t addr, const uint8_t *data, unsigned int sz)
+    {
+        return flash.write(addr, data, sz);
+    }
+
+    static int erase_block(SpiFlash &flash, uint32_t addr)
+    {
+        return flash.erase_block(addr);
+    }
+
+    static int write_barrier(SpiFlash &flash)
+    {
+        return flash.write_barrier();
+    }
+};
+
+/* Devices with a FlashGeometry must match the file system layout */
+template <class Flash>
+static void check_geometry(typename Flash::Geometry *)
+{
+    typedef typename Flash::Geometry Geometry;
+    static_assert(FS_PRIV_SECTOR_SIZE == Geometry::block_size,
+            "FS_PRIV_SECTOR_SIZE must match the device block size");
+    static_assert((Geometry::block_size % FS_PRIV_PAGE_SIZE) == 0,
+            "FS_PRIV_PAGE_SIZE must divide the device block size");
+}
+
+template <class Flash>
+static void check_geometry(...)
+{
+}
 
 
 static inline uint8_t get_user_flags(fs_priv_t *fs_priv, uint8_t sector)
@@ -29,32 +105,208 @@ static inline uint32_t get_alloc_counter(fs_priv_t *fs_priv, uint8_t sector)
     return fs_priv->alloc_unit_list[sector].alloc_counter;
 }
 
+/* Looking up a file or following its chain goes through these, so counting
+ * them measures that work where the clock only counts the bus.
+ */
 static inline uint8_t get_file_id(fs_priv_t *fs_priv, uint8_t sector)
 {
+    fs_priv->header_lookups++;
     return fs_priv->alloc_unit_list[sector].file_info.file_id;
 }
 
 static inline bool is_last_allocation_unit(fs_priv_t *fs_priv, uint8_t sector)
 {
+    fs_priv->header_lookups++;
     return (fs_priv->alloc_unit_list[sector].file_info.next_allocation_unit ==
             (uint8_t)FS_PRIV_NOT_ALLOCATED);
 }
 
 static inline uint8_t next_allocation_unit(fs_priv_t *fs_priv, uint8_t sector)
 {
+    fs_priv->header_lookups++;
     return fs_priv->alloc_unit_list[sector].file_info.next_allocation_unit;
 }
 
-static int init_fs_priv(fs_priv_t *fs_priv, void *device)
+static void build_file_index(fs_priv_t *fs_priv)
+{
+    uint8_t parent[FS_PRIV_MAX_SECTORS];
+
+    for (unsigned int file_id = 0; file_id < FS_PRIV_MAX_FILES; file_id++)
+    {
+        fs_priv->file_index[file_id].root = (uint8_t)FS_PRIV_NOT_ALLOCATED;
+        fs_priv->file_index[file_id].tail = (uint8_t)FS_PRIV_NOT_ALLOCATED;
+        fs_priv->file_index[file_id].num_sectors = 0;
+    }
+
+    /* Reset parent list to known values */
+    memset(parent, (uint8_t)FS_PRIV_NOT_ALLOCATED, sizeof(parent));
+
+    /* Count the sectors of each file and note the parent of each sector
+     * in a file chain.
+     */
+    for (uint8_t sector = 0; sector < fs_priv->num_sectors; sector++)
+    {
+        uint8_t file_id = get_file_id(fs_priv, sector);
+        uint8_t next = next_allocation_unit(fs_priv, sector);
+
+        if ((uint8_t)FS_PRIV_NOT_ALLOCATED == file_id)
+            continue;
+
+        fs_priv->file_index[file_id].num_sectors++;
+        if (next < FS_PRIV_MAX_SECTORS)
+            parent[next] = sector;
+    }
+
+    /* The root of a file is the sector with no parent and the tail is the
+     * sector with no successor.
+     */
+    for (uint8_t sector = 0; sector < fs_priv->num_sectors; sector++)
+    {
+        uint8_t file_id = get_file_id(fs_priv, sector);
+
+        if ((uint8_t)FS_PRIV_NOT_ALLOCATED == file_id)
+            continue;
+
+        if (parent[sector] == (uint8_t)FS_PRIV_NOT_ALLOCATED &&
+            fs_priv->file_index[file_id].root == (uint8_t)FS_PRIV_NOT_ALLOCATED)
+            fs_priv->file_index[file_id].root = sector;
+        if (is_last_allocation_unit(fs_priv, sector))
+            fs_priv->file_index[file_id].tail = sector;
+    }
+}
+
+static inline uint8_t find_file_root(fs_priv_t *fs_priv, uint8_t file_id)
+{
+    /* Do not allow FS_PRIV_NOT_ALLOCATED as file_id */
+    if ((uint8_t)FS_PRIV_NOT_ALLOCATED == file_id)
+        return FS_PRIV_NOT_ALLOCATED;
+
+    return fs_priv->file_index[file_id].root;
+}
+
+static void add_to_file_index(fs_priv_t *fs_priv, uint8_t file_id, uint8_t sector)
+{
+    fs_priv_file_index_t *entry = &fs_priv->file_index[file_id];
+
+    /* Sectors are only ever appended to the end of a file chain */
+    if (0 == entry->num_sectors)
+        entry->root = sector;
+    entry->tail = sector;
+    entry->num_sectors++;
+}
+
+static void remove_from_file_index(fs_priv_t *fs_priv, uint8_t sector)
+{
+    uint8_t file_id = get_file_id(fs_priv, sector);
+
+    if ((uint8_t)FS_PRIV_NOT_ALLOCATED == file_id)
+        return;
+
+    /* Sectors are removed from the root, except when formatting where
+     * every sector of the file goes.
+     */
+    fs_priv_file_index_t *entry = &fs_priv->file_index[file_id];
+    if (--entry->num_sectors == 0)
+    {
+        entry->root = (uint8_t)FS_PRIV_NOT_ALLOCATED;
+        entry->tail = (uint8_t)FS_PRIV_NOT_ALLOCATED;
+    }
+    else if (entry->root == sector)
+    {
+        entry->root = next_allocation_unit(fs_priv, sector);
+    }
+}
+
+#if FS_PRIV_SESSION_CACHE
+static inline bool get_cached_sessions(fs_priv_t *fs_priv, uint8_t sector,
+        uint8_t *next_session, uint32_t *data_offset)
+{
+    fs_priv_session_cache_t *cache = &fs_priv->session_cache[sector];
+
+    if (!cache->valid)
+        return false;
+
+    *next_session = cache->next_session;
+    *data_offset = cache->last_offset;
+    return true;
+}
+
+static inline void set_cached_sessions(fs_priv_t *fs_priv, uint8_t sector,
+        uint8_t next_session, uint32_t data_offset)
+{
+    fs_priv_session_cache_t *cache = &fs_priv->session_cache[sector];
+
+    cache->next_session = next_session;
+    cache->last_offset = data_offset;
+    cache->valid = 1;
+}
+
+static inline void reset_session_cache(fs_priv_t *fs_priv)
+{
+    for (uint8_t sector = 0; sector < FS_PRIV_MAX_SECTORS; sector++)
+        fs_priv->session_cache[sector].valid = 0;
+}
+#else
+static inline bool get_cached_sessions(fs_priv_t *fs_priv, uint8_t sector,
+        uint8_t *next_session, uint32_t *data_offset)
+{
+    return false;
+}
+
+static inline void set_cached_sessions(fs_priv_t *fs_priv, uint8_t sector,
+        uint8_t next_session, uint32_t data_offset)
+{
+}
+
+static inline void reset_session_cache(fs_priv_t *fs_priv)
+{
+}
+#endif
+
+/* A writer only moves on from a sector once it is full or its session
+ * table has run out, so a sector followed by another holds the whole
+ * usable size unless its last session says otherwise.  Noting this at
+ * mount means seeking never has to read the session tables along a chain.
+ */
+template <class Flash>
+static int read_sector_lengths(Flash &flash, fs_priv_t *fs_priv)
 {
-    fs_priv->device = device;  /* Keep a copy of the device index */
+    for (uint8_t sector = 0; sector < fs_priv->num_sectors; sector++)
+    {
+        uint32_t last_session;
+
+        if ((uint8_t)FS_PRIV_NOT_ALLOCATED == get_file_id(fs_priv, sector) ||
+            is_last_allocation_unit(fs_priv, sector))
+            continue;
+
+        if (FlashOps<Flash>::read(flash, FS_PRIV_SECTOR_ADDR(sector) + FS_PRIV_SESSION_OFFSET +
+                (sizeof(uint32_t) * (FS_PRIV_NUM_WRITE_SESSIONS - 1)),
+                (uint8_t *)&last_session,
+                sizeof(uint32_t)))
+            return FS_ERROR_FLASH_MEDIA;
+
+        fs_priv->sector_length[sector] = ((uint32_t)FS_PRIV_NOT_ALLOCATED == last_session) ?
+                FS_PRIV_USABLE_SIZE : last_session;
+    }
+
+    return FS_NO_ERROR;
+}
+
+template <class Flash>
+static int init_fs_priv(Flash &flash, fs_priv_t *fs_priv)
+{
+    fs_priv->skipped_erases = 0;
+    fs_priv->copied_bytes = 0;
+    fs_priv->header_lookups = 0;
+    fs_priv->num_sectors = std::min(FlashOps<Flash>::get_capacity(flash) / FS_PRIV_SECTOR_SIZE,
+                                    (unsigned int)FS_PRIV_MAX_SECTORS);
 
     /* Iterate through each sector and read the allocation unit header into
      * our file system device structure.
      */
-    for (uint8_t sector = 0; sector < FS_PRIV_MAX_SECTORS; sector++)
+    for (uint8_t sector = 0; sector < fs_priv->num_sectors; sector++)
     {
-        if (FLASH(device)->read(FS_PRIV_SECTOR_ADDR(sector),
+        if (FlashOps<Flash>::read(flash, FS_PRIV_SECTOR_ADDR(sector),
         		(uint8_t *)&fs_priv->alloc_unit_list[sector],
         		sizeof(fs_priv_alloc_unit_header_t)))
             return FS_ERROR_FLASH_MEDIA;
@@ -63,6 +315,13 @@ static int init_fs_priv(fs_priv_t *fs_priv, void *device)
     /* TODO: we should probably implement some kind of file system
      * validation check here to avoid using a corrupt file system.
      */
+    build_file_index(fs_priv);
+    if (read_sector_lengths(flash, fs_priv))
+        return FS_ERROR_FLASH_MEDIA;
+
+    /* Session tables are read on first use */
+    reset_session_cache(fs_priv);
+
     return FS_NO_ERROR;
 }
 
@@ -84,7 +343,7 @@ static uint8_t find_free_allocation_unit(fs_priv_t *fs_priv)
     /* In the worst case, we have to check every sector on the disk to
      * find a free sector.
      */
-    for (uint8_t sector = 0; sector < FS_PRIV_MAX_SECTORS; sector++)
+    for (uint8_t sector = 0; sector < fs_priv->num_sectors; sector++)
     {
         /* Consider only unallocated sectors */
         if ((uint8_t)FS_PRIV_NOT_ALLOCATED == get_file_id(fs_priv, sector))
@@ -111,7 +370,7 @@ static uint8_t find_free_allocation_unit(fs_priv_t *fs_priv)
 static int allocate_handle(fs_priv_handle_t *fs_priv_handle_list,
 		fs_priv_t *fs_priv, fs_priv_handle_t **handle)
 {
-    for (uint8_t i = 0; i < FS_PRIV_MAX_HANDLES; i++)
+    for (uint8_t i = 0; i < FS_MAX_HANDLES; i++)
     {
         if (NULL == fs_priv_handle_list[i].fs_priv)
         {
@@ -125,11 +384,50 @@ static int allocate_handle(fs_priv_handle_t *fs_priv_handle_list,
     return FS_ERROR_NO_FREE_HANDLE;
 }
 
+static int allocate_page_cache(fs_priv_page_cache_t *page_cache_pool,
+        fs_priv_handle_t *handle)
+{
+    for (uint8_t i = 0; i < FS_PRIV_MAX_WRITERS; i++)
+    {
+        if (!page_cache_pool[i].in_use)
+        {
+            page_cache_pool[i].in_use = 1;
+            handle->page_cache = page_cache_pool[i].data;
+
+            return FS_NO_ERROR;
+        }
+    }
+
+    return FS_ERROR_NO_FREE_HANDLE;
+}
+
 static void free_handle(fs_priv_handle_t *handle)
 {
+    /* Return any page cache to the pool; the cache is the first member
+     * of its pool entry.
+     */
+    if (handle->page_cache)
+        ((fs_priv_page_cache_t *)handle->page_cache)->in_use = 0;
+
+    handle->page_cache = NULL;
     handle->fs_priv = NULL;
 }
 
+/* True if the file has an open handle with all of the given mode flags */
+static bool is_file_open(fs_priv_handle_t *fs_priv_handle_list, uint8_t file_id,
+        unsigned int mode)
+{
+    for (uint8_t i = 0; i < FS_MAX_HANDLES; i++)
+    {
+        if (fs_priv_handle_list[i].fs_priv &&
+            fs_priv_handle_list[i].file_id == file_id &&
+            (fs_priv_handle_list[i].flags.mode_flags & mode) == mode)
+            return true;
+    }
+
+    return false;
+}
+
 static bool is_protected(uint8_t protection_bits)
 {
     uint8_t count_bits;
@@ -152,48 +450,6 @@ static uint8_t set_protected(bool prot, uint8_t protected_bits)
     return protected_bits;
 }
 
-static uint8_t find_file_root(fs_priv_t *fs_priv, uint8_t file_id)
-{
-    uint8_t root = (uint8_t)FS_PRIV_NOT_ALLOCATED;
-    uint8_t parent[FS_PRIV_MAX_SECTORS];
-
-    /* Do not allow FS_PRIV_NOT_ALLOCATED as file_id */
-    if ((uint8_t)FS_PRIV_NOT_ALLOCATED == file_id)
-        return FS_PRIV_NOT_ALLOCATED;
-
-    /* Reset parent list to known values */
-    memset(parent, (uint8_t)FS_PRIV_NOT_ALLOCATED, sizeof(parent));
-
-    /* Scan all sectors and build a list of parent nodes for each
-     * sector allocated against the specified file_id
-     */
-    for (uint8_t sector = 0; sector < FS_PRIV_MAX_SECTORS; sector++)
-    {
-        /* Filter by file_id */
-        if (file_id == get_file_id(fs_priv, sector))
-        {
-            if (!is_last_allocation_unit(fs_priv, sector))
-                parent[next_allocation_unit(fs_priv, sector)] = sector;
-            /* Arbitrarily choose first found sector as the candidate root node */
-            if (root == (uint8_t)FS_PRIV_NOT_ALLOCATED)
-                root = sector;
-        }
-    }
-
-    /* Start with candidate root sector and walk all the parent nodes until we terminate */
-    while (root != (uint8_t)FS_PRIV_NOT_ALLOCATED)
-    {
-        /* Does this node have a parent?  If not then it is the root node */
-        if (parent[root] == (uint8_t)FS_PRIV_NOT_ALLOCATED)
-            break;
-        else
-            root = parent[root]; /* Try next one in chain */
-    }
-
-    /* Return the root node which may be FS_PRIV_NOT_ALLOCATED if no file was found */
-    return root;
-}
-
 static int check_file_flags(fs_priv_t *fs_priv, uint8_t root, unsigned int mode)
 {
     if ((uint8_t)FS_PRIV_NOT_ALLOCATED == root)
@@ -219,29 +475,68 @@ static int check_file_flags(fs_priv_t *fs_priv, uint8_t root, unsigned int mode)
     return FS_NO_ERROR;
 }
 
-static uint8_t find_next_session_offset(fs_priv_t *fs_priv, uint8_t sector, uint32_t *data_offset)
+#if FS_PRIV_SESSION_SEARCH == FS_PRIV_SESSION_SEARCH_BISECT
+template <class Flash>
+static int search_session_table(Flash &flash, uint8_t sector, uint8_t *next_session, uint32_t *data_offset)
+{
+    uint32_t lo = 0, hi = FS_PRIV_NUM_WRITE_SESSIONS;
+    uint32_t write_offset;
+
+    /* Sessions are written in order so the used entries come first;
+     * bisect for the first unused entry, reading one entry at a time.
+     */
+    *data_offset = 0; /* None yet assigned */
+    while (lo < hi)
+    {
+        uint32_t mid = (lo + hi) / 2;
+
+        if (FlashOps<Flash>::read(flash,
+                FS_PRIV_SECTOR_ADDR(sector) + FS_PRIV_SESSION_OFFSET + (sizeof(uint32_t) * mid),
+                (uint8_t *)&write_offset,
+                sizeof(uint32_t)))
+            return FS_ERROR_FLASH_MEDIA;
+
+        if ((uint32_t)FS_PRIV_NOT_ALLOCATED == write_offset)
+        {
+            hi = mid;
+        }
+        else
+        {
+            /* Last known write offset is the one just before lo */
+            lo = mid + 1;
+            *data_offset = write_offset;
+        }
+    }
+
+    /* If all entries are already used then no further writes can be done */
+    *next_session = (lo < FS_PRIV_NUM_WRITE_SESSIONS) ? lo : (uint8_t)FS_PRIV_NOT_ALLOCATED;
+
+    return FS_NO_ERROR;
+}
+#else
+template <class Flash>
+static int search_session_table(Flash &flash, uint8_t sector, uint8_t *next_session, uint32_t *data_offset)
 {
-    uint32_t write_offset = (uint8_t)FS_PRIV_NOT_ALLOCATED;
     uint32_t write_offsets[FS_PRIV_NUM_WRITE_SESSIONS];
 
     /* Read all the session offsets from flash */
-    FLASH(fs_priv->device)->read(FS_PRIV_SECTOR_ADDR(sector) + FS_PRIV_SESSION_OFFSET,
+    if (FlashOps<Flash>::read(flash, FS_PRIV_SECTOR_ADDR(sector) + FS_PRIV_SESSION_OFFSET,
     		(uint8_t *)write_offsets,
-            sizeof(write_offsets));
+            sizeof(write_offsets)))
+        return FS_ERROR_FLASH_MEDIA;
 
     /* Scan session offsets to find first free entry.  If all entries
      * are already used then no further writes can be done and
      * FS_PRIV_NOT_ALLOCATED shall be returned.
      */
+    *next_session = (uint8_t)FS_PRIV_NOT_ALLOCATED;
+    *data_offset = 0; /* None yet assigned */
     for (uint8_t i = 0; i < FS_PRIV_NUM_WRITE_SESSIONS; i++)
     {
         if ((uint32_t)FS_PRIV_NOT_ALLOCATED == write_offsets[i])
         {
-            if (i == 0)
-                *data_offset = 0; /* None yet assigned */
-
             /* Next available write offset has been found */
-            write_offset = i;
+            *next_session = i;
             break;
         }
 
@@ -249,27 +544,36 @@ static uint8_t find_next_session_offset(fs_priv_t *fs_priv, uint8_t sector, uint
         *data_offset = write_offsets[i];
     }
 
-    return write_offset;
+    return FS_NO_ERROR;
 }
+#endif
 
-static uint8_t find_last_allocation_unit(fs_priv_t *fs_priv, uint8_t root)
+template <class Flash>
+static uint8_t find_next_session_offset(Flash &flash, fs_priv_t *fs_priv, uint8_t sector, uint32_t *data_offset)
 {
-    /* Loop through until we reach the end of the file chain */
-    while (root != (uint8_t)FS_PRIV_NOT_ALLOCATED)
+    uint8_t next_session;
+
+    /* Sessions already known need no flash access */
+    if (get_cached_sessions(fs_priv, sector, &next_session, data_offset))
+        return next_session;
+
+    /* A sector that can't be read takes no further writes */
+    if (search_session_table(flash, sector, &next_session, data_offset))
     {
-        if (next_allocation_unit(fs_priv, root) != (uint8_t)FS_PRIV_NOT_ALLOCATED)
-            root = next_allocation_unit(fs_priv, root);
-        else
-            break;
+        *data_offset = 0;
+        return (uint8_t)FS_PRIV_NOT_ALLOCATED;
     }
 
-    return root;
+    set_cached_sessions(fs_priv, sector, next_session, *data_offset);
+
+    return next_session;
 }
 
-static uint8_t find_eof(fs_priv_t *fs_priv, uint8_t root, uint8_t *last_alloc_unit, uint32_t *data_offset)
+template <class Flash>
+static uint8_t find_eof(Flash &flash, fs_priv_t *fs_priv, uint8_t root, uint8_t *last_alloc_unit, uint32_t *data_offset)
 {
-    *last_alloc_unit = find_last_allocation_unit(fs_priv, root);
-    return find_next_session_offset(fs_priv, *last_alloc_unit, data_offset);
+    *last_alloc_unit = fs_priv->file_index[get_file_id(fs_priv, root)].tail;
+    return find_next_session_offset(flash, fs_priv, *last_alloc_unit, data_offset);
 }
 
 static bool is_eof(fs_priv_handle_t *fs_priv_handle)
@@ -281,15 +585,112 @@ static bool is_eof(fs_priv_handle_t *fs_priv_handle)
                     (uint8_t)FS_PRIV_NOT_ALLOCATED);
 }
 
-static int erase_allocation_unit(fs_priv_t *fs_priv, uint8_t sector)
+template <class Flash>
+static void find_sector_length(Flash &flash, fs_priv_t *fs_priv, uint8_t sector, uint32_t *length)
+{
+    /* Only the last sector of a file can still grow */
+    if (is_last_allocation_unit(fs_priv, sector))
+        find_next_session_offset(flash, fs_priv, sector, length);
+    else
+        *length = fs_priv->sector_length[sector];
+}
+
+template <class Flash>
+static int seek_handle(Flash &flash, fs_priv_handle_t *fs_priv_handle, uint32_t offset)
+{
+    fs_priv_t *fs_priv = fs_priv_handle->fs_priv;
+    uint8_t sector = fs_priv_handle->root_allocation_unit;
+    uint32_t length;
+
+    /* Walk the sector chain in RAM, skipping whole sectors by their valid
+     * length.  At most the session table of the last sector is read from
+     * flash and the file data itself is never touched.
+     */
+    for (;;)
+    {
+        find_sector_length(flash, fs_priv, sector, &length);
+        if (offset < length || is_last_allocation_unit(fs_priv, sector))
+            break;
+        offset -= length;
+        sector = next_allocation_unit(fs_priv, sector);
+    }
+
+    /* Seeking to the end of file is allowed but not beyond it */
+    if (offset > length)
+        return FS_ERROR_END_OF_FILE;
+
+    fs_priv_handle->curr_allocation_unit = sector;
+    fs_priv_handle->curr_data_offset = offset;
+    fs_priv_handle->last_data_offset = length;
+
+    return FS_NO_ERROR;
+}
+
+template <class Flash>
+static int is_allocation_unit_blank(Flash &flash, fs_priv_t *fs_priv, uint8_t sector, bool *blank)
+{
+    uint32_t address = FS_PRIV_SECTOR_ADDR(sector);
+    uint32_t counter_end = FS_PRIV_ALLOC_COUNTER_OFFSET + sizeof(uint32_t);
+    const uint8_t *file_info = (const uint8_t *)&fs_priv->alloc_unit_list[sector].file_info;
+
+    /* A sector is only written after its header has been given a file_id,
+     * so one with a used header is not blank.
+     */
+    for (unsigned int i = 0; i < sizeof(fs_priv_file_info_t); i++)
+    {
+        if (file_info[i] != 0xFF)
+        {
+            *blank = false;
+            return FS_NO_ERROR;
+        }
+    }
+
+    /* An unused header says nothing of the rest e.g., after an interrupted
+     * erase or data left by another layout, so check everything except the
+     * allocation counter.  The check stops at the first programmed word.
+     */
+    if (flash.is_blank(address, FS_PRIV_ALLOC_COUNTER_OFFSET, blank))
+        return FS_ERROR_FLASH_MEDIA;
+
+    if (*blank &&
+        flash.is_blank(address + counter_end, FS_PRIV_SECTOR_SIZE - counter_end, blank))
+        return FS_ERROR_FLASH_MEDIA;
+
+    return FS_NO_ERROR;
+}
+
+template <class Flash>
+static int erase_allocation_unit(Flash &flash, fs_priv_t *fs_priv, uint8_t sector)
 {
     /* Read existing allocation counter and increment for next allocation */
-    uint32_t new_alloc_counter = fs_priv->alloc_unit_list[sector].alloc_counter + 1;
+    uint32_t alloc_counter = fs_priv->alloc_unit_list[sector].alloc_counter;
+    uint32_t new_alloc_counter = alloc_counter + 1;
+    bool blank;
 
-    /* Erase the entire sector (should be all FF) */
-    if (FLASH(fs_priv->device)->erase_block(FS_PRIV_SECTOR_ADDR(sector)))
+    if (is_allocation_unit_blank(flash, fs_priv, sector, &blank))
         return FS_ERROR_FLASH_MEDIA;
 
+    if (blank)
+    {
+        /* Nothing to erase so the sector has not worn; only a sector that
+         * has never had its allocation counter written needs one.
+         */
+        fs_priv->skipped_erases++;
+        if ((uint32_t)FS_PRIV_NOT_ALLOCATED != alloc_counter)
+            return FS_NO_ERROR;
+    }
+    else
+    {
+        /* Erase the entire sector (should be all FF) */
+        if (FlashOps<Flash>::erase_block(flash, FS_PRIV_SECTOR_ADDR(sector)))
+            return FS_ERROR_FLASH_MEDIA;
+    }
+
+    remove_from_file_index(fs_priv, sector);
+
+    /* An erased sector has no sessions */
+    set_cached_sessions(fs_priv, sector, 0, 0);
+
     /* Reset local copy of allocation unit header */
     memset(&fs_priv->alloc_unit_list[sector], 0xFF, sizeof(fs_priv->alloc_unit_list[sector]));
 
@@ -297,7 +698,7 @@ static int erase_allocation_unit(fs_priv_t *fs_priv, uint8_t sector)
     fs_priv->alloc_unit_list[sector].alloc_counter = new_alloc_counter;
 
     /* Write only the allocation counter to flash */
-    if (FLASH(fs_priv->device)->write(FS_PRIV_SECTOR_ADDR(sector) + FS_PRIV_ALLOC_COUNTER_OFFSET,
+    if (FlashOps<Flash>::write(flash, FS_PRIV_SECTOR_ADDR(sector) + FS_PRIV_ALLOC_COUNTER_OFFSET,
     		(const uint8_t *)&new_alloc_counter,
             sizeof(uint32_t)))
         return FS_ERROR_FLASH_MEDIA;
@@ -305,7 +706,8 @@ static int erase_allocation_unit(fs_priv_t *fs_priv, uint8_t sector)
     return FS_NO_ERROR;
 }
 
-static int flush_page_cache(fs_priv_handle_t *fs_priv_handle)
+template <class Flash>
+static int flush_page_cache(Flash &flash, fs_priv_handle_t *fs_priv_handle)
 {
     uint32_t size, address;
 
@@ -322,7 +724,7 @@ static int flush_page_cache(fs_priv_handle_t *fs_priv_handle)
                 FS_PRIV_ALLOC_UNIT_SIZE + fs_priv_handle->last_data_offset;
 
         /* Write cached data to flash */
-        if (FLASH(fs_priv_handle->fs_priv->device)->write(address,
+        if (FlashOps<Flash>::write(flash, address,
         		fs_priv_handle->page_cache,
         		size))
             return FS_ERROR_FLASH_MEDIA;
@@ -334,7 +736,8 @@ static int flush_page_cache(fs_priv_handle_t *fs_priv_handle)
     return FS_NO_ERROR;
 }
 
-static int update_session_offset(fs_priv_handle_t *fs_priv_handle)
+template <class Flash>
+static int update_session_offset(Flash &flash, fs_priv_handle_t *fs_priv_handle)
 {
     uint32_t address;
 
@@ -348,7 +751,7 @@ static int update_session_offset(fs_priv_handle_t *fs_priv_handle)
             (sizeof(uint32_t) * fs_priv_handle->curr_session_offset);
 
     /* Write the new offset into the allocation unit */
-    if (FLASH(fs_priv_handle->fs_priv->device)->write(
+    if (FlashOps<Flash>::write(flash,
             address,
             (const uint8_t *)&fs_priv_handle->last_data_offset,
             sizeof(uint32_t)))
@@ -365,10 +768,15 @@ static int update_session_offset(fs_priv_handle_t *fs_priv_handle)
         fs_priv_handle->curr_session_offset = (uint8_t)FS_PRIV_NOT_ALLOCATED;
     }
 
+    /* Keep the cached session table in step with the flash */
+    set_cached_sessions(fs_priv_handle->fs_priv, fs_priv_handle->curr_allocation_unit,
+            fs_priv_handle->curr_session_offset, fs_priv_handle->curr_session_value);
+
     return FS_NO_ERROR;
 }
 
-static int flush_handle(fs_priv_handle_t *fs_priv_handle)
+template <class Flash>
+static int close_session(Flash &flash, fs_priv_handle_t *fs_priv_handle)
 {
     int ret;
 
@@ -377,15 +785,73 @@ static int flush_handle(fs_priv_handle_t *fs_priv_handle)
         return FS_ERROR_FILESYSTEM_FULL;
 
     /* Flush any bytes in the page cache */
-    ret = flush_page_cache(fs_priv_handle);
+    ret = flush_page_cache(flash, fs_priv_handle);
     if (ret)
         return ret;
 
     /* Set new write offset */
-    return update_session_offset(fs_priv_handle);
+    return update_session_offset(flash, fs_priv_handle);
+}
+
+/* Commits what is left in a full sector before the writer moves on.  A
+ * sector that ran out of sessions was committed by its last one and has
+ * nothing cached, so only a failure to commit stops the move.
+ */
+template <class Flash>
+static int close_sector(Flash &flash, fs_priv_handle_t *fs_priv_handle)
+{
+    if ((uint8_t)FS_PRIV_NOT_ALLOCATED == fs_priv_handle->curr_session_offset &&
+        cached_bytes(fs_priv_handle) == 0)
+        return FS_NO_ERROR;
+
+    return close_session(flash, fs_priv_handle);
+}
+
+template <class Flash>
+static int flush_handle(Flash &flash, fs_priv_handle_t *fs_priv_handle)
+{
+    int ret;
+
+    ret = close_session(flash, fs_priv_handle);
+    if (ret)
+        return ret;
+
+    /* The session is only committed once it has reached the device */
+    if (FlashOps<Flash>::write_barrier(flash))
+        return FS_ERROR_FLASH_MEDIA;
+
+    return FS_NO_ERROR;
+}
+
+/* Readers of a circular file whose root sector has been recycled carry
+ * on from the start of the new root, so the oldest data they have not yet
+ * read is lost rather than being read back from the reused sector.
+ */
+template <class Flash>
+static void move_readers_to_root(Flash &flash, fs_priv_handle_t *fs_priv_handle_list,
+        uint8_t file_id, uint8_t old_root, uint8_t new_root)
+{
+    for (uint8_t i = 0; i < FS_MAX_HANDLES; i++)
+    {
+        fs_priv_handle_t *reader = &fs_priv_handle_list[i];
+
+        if (!reader->fs_priv || reader->file_id != file_id ||
+            (reader->flags.mode_flags & FS_FILE_WRITEABLE))
+            continue;
+
+        reader->root_allocation_unit = new_root;
+        if (reader->curr_allocation_unit == old_root)
+        {
+            reader->curr_allocation_unit = new_root;
+            reader->curr_data_offset = 0;
+            find_next_session_offset(flash, reader->fs_priv, new_root, &reader->last_data_offset);
+        }
+    }
 }
 
-static int allocate_new_sector_to_file(fs_priv_handle_t *fs_priv_handle)
+template <class Flash>
+static int allocate_new_sector_to_file(Flash &flash, fs_priv_handle_t *fs_priv_handle_list,
+        fs_priv_handle_t *fs_priv_handle)
 {
     uint8_t sector;
     fs_priv_t *fs_priv = fs_priv_handle->fs_priv;
@@ -404,14 +870,16 @@ static int allocate_new_sector_to_file(fs_priv_handle_t *fs_priv_handle)
         /* Erase the current root sector so it can be recycled */
         uint8_t new_root =
             fs_priv->alloc_unit_list[fs_priv_handle->root_allocation_unit].file_info.next_allocation_unit;
-        if (erase_allocation_unit(fs_priv, fs_priv_handle->root_allocation_unit))
+        if (erase_allocation_unit(flash, fs_priv, fs_priv_handle->root_allocation_unit))
             return FS_ERROR_FLASH_MEDIA;
 
         /* Set new root sector and also link the new sector's next pointer to
-         * the new root sector.
+         * the new root sector.  A file of one sector starts again in it.
          */
         sector = fs_priv_handle->root_allocation_unit;
         fs_priv_handle->root_allocation_unit = new_root;
+        move_readers_to_root(flash, fs_priv_handle_list, fs_priv_handle->file_id, sector,
+                ((uint8_t)FS_PRIV_NOT_ALLOCATED == new_root) ? sector : new_root);
     }
 
     /* Update file system allocation table information for this allocation unit */
@@ -422,6 +890,8 @@ static int allocate_new_sector_to_file(fs_priv_handle_t *fs_priv_handle)
     fs_priv->alloc_unit_list[sector].file_info.file_flags.user_flags =
             fs_priv_handle->flags.user_flags;
 
+    add_to_file_index(fs_priv, fs_priv_handle->file_id, sector);
+
     /* Check if a root sector is already set for this handle */
     if ((uint8_t)FS_PRIV_NOT_ALLOCATED == fs_priv_handle->root_allocation_unit)
     {
@@ -437,12 +907,16 @@ static int allocate_new_sector_to_file(fs_priv_handle_t *fs_priv_handle)
         fs_priv->alloc_unit_list[sector].file_info.file_protect =
                 fs_priv->alloc_unit_list[fs_priv_handle->root_allocation_unit].file_info.file_protect;
 
-        /* Chain newly allocated sector onto the end of the current sector */
+        /* Chain newly allocated sector onto the end of the current sector,
+         * which keeps the length of its last session from now on.
+         */
         fs_priv->alloc_unit_list[fs_priv_handle->curr_allocation_unit].file_info.next_allocation_unit =
                 sector;
+        fs_priv->sector_length[fs_priv_handle->curr_allocation_unit] =
+                fs_priv_handle->curr_session_value;
 
         /* Write updated file information header contents to flash for the current sector */
-        if (FLASH(fs_priv->device)->write(
+        if (FlashOps<Flash>::write(flash,
                 FS_PRIV_SECTOR_ADDR(fs_priv_handle->curr_allocation_unit),
                 (const uint8_t *)&fs_priv->alloc_unit_list[fs_priv_handle->curr_allocation_unit],
                 sizeof(fs_priv_file_info_t)))
@@ -459,7 +933,7 @@ static int allocate_new_sector_to_file(fs_priv_handle_t *fs_priv_handle)
     fs_priv_handle->curr_session_value = 0;
 
     /* Write file information header contents to flash for new sector */
-    if (FLASH(fs_priv->device)->write(
+    if (FlashOps<Flash>::write(flash,
             FS_PRIV_SECTOR_ADDR(sector),
             (const uint8_t *)&fs_priv->alloc_unit_list[sector],
             sizeof(fs_priv_file_info_t)))
@@ -474,7 +948,8 @@ static inline bool is_full(fs_priv_handle_t *fs_priv_handle)
             fs_priv_handle->curr_data_offset >= FS_PRIV_USABLE_SIZE);
 }
 
-static int write_through_cache(fs_priv_handle_t *fs_priv_handle, const uint8_t *src, uint16_t size, uint16_t *written)
+template <class Flash>
+static int write_through_cache(Flash &flash, fs_priv_handle_t *fs_priv_handle, const uint8_t *src, uint16_t size, uint16_t *written)
 {
     uint16_t cached, page_boundary, sz;
 
@@ -511,6 +986,7 @@ static int write_through_cache(fs_priv_handle_t *fs_priv_handle, const uint8_t *
     {
         /* The size is guaranteed to be non-zero */
         memcpy(&fs_priv_handle->page_cache[cached], src, sz);
+        fs_priv_handle->fs_priv->copied_bytes += sz;
         src += sz;
         size -= sz;
         cached += sz;
@@ -527,7 +1003,7 @@ static int write_through_cache(fs_priv_handle_t *fs_priv_handle, const uint8_t *
         /* Write through to page boundary */
         uint32_t address = FS_PRIV_SECTOR_ADDR(fs_priv_handle->curr_allocation_unit) +
                 FS_PRIV_ALLOC_UNIT_SIZE + fs_priv_handle->last_data_offset;
-        if (FLASH(fs_priv_handle->fs_priv->device)->write(
+        if (FlashOps<Flash>::write(flash,
                 address,
                 fs_priv_handle->page_cache,
                 page_boundary))
@@ -540,7 +1016,8 @@ static int write_through_cache(fs_priv_handle_t *fs_priv_handle, const uint8_t *
     if (size > 0)
     {
         /* Cache is guaranteed to be empty */
-        memcpy(&fs_priv_handle->page_cache, src, size);
+        memcpy(fs_priv_handle->page_cache, src, size);
+        fs_priv_handle->fs_priv->copied_bytes += size;
         *written += size;
         fs_priv_handle->curr_data_offset += size;
     }
@@ -548,23 +1025,82 @@ static int write_through_cache(fs_priv_handle_t *fs_priv_handle, const uint8_t *
     return FS_NO_ERROR;
 }
 
+template <class Flash>
+static int commit_to_cache(Flash &flash, fs_priv_handle_t *fs_priv_handle, uint16_t size)
+{
+    uint16_t cached, page_boundary;
+
+    /* The data is already in the cache, possibly running past the page
+     * boundary into the slack after it, so it only remains to program any
+     * completed pages and move what is left to the start of the cache.
+     */
+    fs_priv_handle->curr_data_offset += size;
+    cached = cached_bytes(fs_priv_handle);
+    page_boundary = FS_PRIV_PAGE_SIZE - (fs_priv_handle->last_data_offset & (FS_PRIV_PAGE_SIZE - 1));
+
+    while (cached >= page_boundary)
+    {
+        uint32_t address = FS_PRIV_SECTOR_ADDR(fs_priv_handle->curr_allocation_unit) +
+                FS_PRIV_ALLOC_UNIT_SIZE + fs_priv_handle->last_data_offset;
+        if (FlashOps<Flash>::write(flash,
+                address,
+                fs_priv_handle->page_cache,
+                page_boundary))
+            return FS_ERROR_FLASH_MEDIA;
+
+        fs_priv_handle->last_data_offset += page_boundary;
+        cached -= page_boundary;
+        memmove(fs_priv_handle->page_cache, &fs_priv_handle->page_cache[page_boundary], cached);
+        fs_priv_handle->fs_priv->copied_bytes += cached;
+        page_boundary = FS_PRIV_PAGE_SIZE;
+    }
+
+    return FS_NO_ERROR;
+}
+
+template <class Flash>
+static int write_bypassing_cache(Flash &flash, fs_priv_handle_t *fs_priv_handle, const uint8_t *src, uint32_t size)
+{
+    /* The cache is empty and the write position is page aligned, so whole
+     * pages can be programmed straight from the caller's buffer.
+     */
+    uint32_t address = FS_PRIV_SECTOR_ADDR(fs_priv_handle->curr_allocation_unit) +
+            FS_PRIV_ALLOC_UNIT_SIZE + fs_priv_handle->last_data_offset;
+    if (FlashOps<Flash>::write(flash, address, src, size))
+        return FS_ERROR_FLASH_MEDIA;
+
+    fs_priv_handle->last_data_offset += size;
+    fs_priv_handle->curr_data_offset += size;
+
+    return FS_NO_ERROR;
+}
+
+static inline bool can_bypass_cache(fs_priv_handle_t *fs_priv_handle, unsigned int size)
+{
+    return (size >= FS_PRIV_PAGE_SIZE &&
+            cached_bytes(fs_priv_handle) == 0 &&
+            (fs_priv_handle->last_data_offset & (FS_PRIV_PAGE_SIZE - 1)) == 0);
+}
+
 /* FileSystem Class Methods */
 
-int FileSystem::format()
+template <class Flash>
+int FileSystem<Flash>::format()
 {
-    int ret;
+    int ret = FS_NO_ERROR;
     fs_priv_t *fs_priv = &priv;
 
-    for (uint8_t sector = 0; sector < FS_PRIV_MAX_SECTORS; sector++)
+    for (uint8_t sector = 0; sector < fs_priv->num_sectors; sector++)
     {
-        ret = erase_allocation_unit(fs_priv, sector);
+        ret = erase_allocation_unit(flash, fs_priv, sector);
         if (ret) break;
     }
 
     return ret;
 }
 
-int FileSystem::open(FileHandle *handle, uint8_t file_id, unsigned int mode, uint8_t *user_flags)
+template <class Flash>
+int FileSystem<Flash>::open(FileHandle *handle, uint8_t file_id, unsigned int mode, uint8_t *user_flags)
 {
 	int ret;
     fs_priv_t *fs_priv = &priv;
@@ -578,14 +1114,31 @@ int FileSystem::open(FileHandle *handle, uint8_t file_id, unsigned int mode, uin
     if (ret)
         return ret;
 
+    /* A file may have any number of readers but only one writer */
+    if ((mode & FS_FILE_WRITEABLE) &&
+        is_file_open(fs_priv_handle_list, file_id, FS_FILE_WRITEABLE))
+        return FS_ERROR_FILE_IN_USE;
+
     /* Allocate a free handle */
     ret = allocate_handle(fs_priv_handle_list, fs_priv, &fs_priv_handle);
     if (ret)
         return ret;
 
+    /* Writers also need a page cache from the pool */
+    if (mode & FS_FILE_WRITEABLE)
+    {
+        ret = allocate_page_cache(page_cache_pool, fs_priv_handle);
+        if (ret)
+        {
+            free_handle(fs_priv_handle);
+            return ret;
+        }
+    }
+
     /* Reset file handle */
     *handle = fs_priv_handle;
     fs_priv_handle->file_id = file_id;
+    fs_priv_handle->reserved_bytes = 0;
     fs_priv_handle->root_allocation_unit = (uint8_t)FS_PRIV_NOT_ALLOCATED;
 
     if (root != (uint8_t)FS_PRIV_NOT_ALLOCATED)
@@ -608,13 +1161,13 @@ int FileSystem::open(FileHandle *handle, uint8_t file_id, unsigned int mode, uin
             /* Find the last known write position in this sector so we
              * can check for when to advance to next sector or catch EOF
              */
-            find_next_session_offset(fs_priv, root,
+            find_next_session_offset(flash, fs_priv, root,
                     &fs_priv_handle->last_data_offset);
         }
         else
         {
             /* Write only: find end of file for appending new data */
-            fs_priv_handle->curr_session_offset = find_eof(fs_priv, root,
+            fs_priv_handle->curr_session_offset = find_eof(flash, fs_priv, root,
                     &fs_priv_handle->curr_allocation_unit,
                     &fs_priv_handle->curr_data_offset);
 
@@ -632,7 +1185,7 @@ int FileSystem::open(FileHandle *handle, uint8_t file_id, unsigned int mode, uin
         fs_priv_handle->flags.user_flags = user_flags ? *user_flags : 0;
 
         /* Allocate new sector to file handle */
-        ret = allocate_new_sector_to_file(fs_priv_handle);
+        ret = allocate_new_sector_to_file(flash, fs_priv_handle_list, fs_priv_handle);
         if (ret)
             free_handle(fs_priv_handle);
     }
@@ -640,7 +1193,8 @@ int FileSystem::open(FileHandle *handle, uint8_t file_id, unsigned int mode, uin
     return ret;
 }
 
-int FileSystem::close(FileHandle handle)
+template <class Flash>
+int FileSystem<Flash>::close(FileHandle handle)
 {
 	if (!is_valid_handle(handle))
 		return FS_ERROR_INVALID_HANDLE;
@@ -653,7 +1207,8 @@ int FileSystem::close(FileHandle handle)
     return FS_NO_ERROR;
 }
 
-int FileSystem::write(FileHandle handle, const uint8_t *src, unsigned int size, unsigned int *written)
+template <class Flash>
+int FileSystem<Flash>::write(FileHandle handle, const uint8_t *src, unsigned int size, unsigned int *written)
 {
 	if (!is_valid_handle(handle))
 		return FS_ERROR_INVALID_HANDLE;
@@ -669,19 +1224,41 @@ int FileSystem::write(FileHandle handle, const uint8_t *src, unsigned int size,
     if ((fs_priv_handle->flags.mode_flags & FS_FILE_WRITEABLE) == 0)
         return FS_ERROR_INVALID_MODE;
 
+    fs_priv_handle->reserved_bytes = 0;
+
     while (size > 0 && !ret)
     {
         /* Check if the current sector is full */
         if (is_full(fs_priv_handle))
         {
-            /* Flush file to clear cache and update session write offset */
-            flush_handle(fs_priv_handle);
+            /* Flush file to clear cache and update session write offset.
+             * No barrier is needed before chaining on the new sector: the
+             * header update is in the same page as the session table, so
+             * the two may be combined into one program.
+             */
+            ret = close_sector(flash, fs_priv_handle);
+            if (ret) return ret;
 
             /* Allocate new sector to file chain */
-            ret = allocate_new_sector_to_file(fs_priv_handle);
+            ret = allocate_new_sector_to_file(flash, fs_priv_handle_list, fs_priv_handle);
             if (ret) return ret;
         }
 
+        /* Whole pages from an aligned position skip the cache and go to
+         * flash in one write of up to the rest of the sector.
+         */
+        if (can_bypass_cache(fs_priv_handle, size))
+        {
+            uint32_t bulk_size = std::min(size, (unsigned int)remaining_bytes(fs_priv_handle));
+            bulk_size &= ~(FS_PRIV_PAGE_SIZE - 1);
+            ret = write_bypassing_cache(flash, fs_priv_handle, src, bulk_size);
+            if (ret) return ret;
+            src += bulk_size;
+            size -= bulk_size;
+            *written += bulk_size;
+            continue;
+        }
+
         /* The permitted write size is limited by the page size and also the
          * number of free bytes remaining in this sector i.e., we don't
          * permit the cache to fill above the sector size since we might not
@@ -696,7 +1273,7 @@ int FileSystem::write(FileHandle handle, const uint8_t *src, unsigned int size,
          * we won't try to fill the cache on a flash media error to prevent
          * hidden data loss.
          */
-        ret = write_through_cache(fs_priv_handle, src, write_size, &actual_write);
+        ret = write_through_cache(flash, fs_priv_handle, src, write_size, &actual_write);
         src += actual_write;
         size -= actual_write;
         *written += actual_write;
@@ -705,7 +1282,8 @@ int FileSystem::write(FileHandle handle, const uint8_t *src, unsigned int size,
     return ret;
 }
 
-int FileSystem::read(FileHandle handle, uint8_t *dest, unsigned int size, unsigned int *read)
+template <class Flash>
+int FileSystem<Flash>::read(FileHandle handle, uint8_t *dest, unsigned int size, unsigned int *read)
 {
 	if (!is_valid_handle(handle))
 		return FS_ERROR_INVALID_HANDLE;
@@ -720,9 +1298,16 @@ int FileSystem::read(FileHandle handle, uint8_t *dest, unsigned int size, unsign
     if (fs_priv_handle->flags.mode_flags & FS_FILE_WRITEABLE)
         return FS_ERROR_INVALID_MODE;
 
-    /* Check for end of file */
+    /* Check for end of file, allowing for a writer having committed
+     * more data to the last sector since its length was found.
+     */
     if (is_eof(fs_priv_handle))
-        return FS_ERROR_END_OF_FILE;
+    {
+        find_next_session_offset(flash, fs_priv, fs_priv_handle->curr_allocation_unit,
+                &fs_priv_handle->last_data_offset);
+        if (is_eof(fs_priv_handle))
+            return FS_ERROR_END_OF_FILE;
+    }
 
     while (size > 0)
     {
@@ -739,7 +1324,7 @@ int FileSystem::read(FileHandle handle, uint8_t *dest, unsigned int size, unsign
             /* Find the last known write position in this sector so we
              * can check for when to advance to next sector or catch EOF
              */
-            find_next_session_offset(fs_priv, sector, &fs_priv_handle->last_data_offset);
+            find_sector_length(flash, fs_priv, sector, &fs_priv_handle->last_data_offset);
 
             /* Reset data offset pointer */
             fs_priv_handle->curr_allocation_unit = sector;
@@ -751,11 +1336,12 @@ int FileSystem::read(FileHandle handle, uint8_t *dest, unsigned int size, unsign
         uint32_t address = FS_PRIV_SECTOR_ADDR(fs_priv_handle->curr_allocation_unit) +
                 FS_PRIV_FILE_DATA_REL_ADDRESS +
                 fs_priv_handle->curr_data_offset;
-        if (FLASH(fs_priv->device)->read(
+        if (FlashOps<Flash>::read(flash,
                 address,
                 dest,
                 read_size))
             return FS_ERROR_FLASH_MEDIA;
+        dest += read_size;
         *read += read_size;
         size -= read_size;
         fs_priv_handle->curr_data_offset += read_size;
@@ -764,7 +1350,53 @@ int FileSystem::read(FileHandle handle, uint8_t *dest, unsigned int size, unsign
     return FS_NO_ERROR;
 }
 
-int FileSystem::flush(FileHandle handle)
+template <class Flash>
+int FileSystem<Flash>::seek(FileHandle handle, unsigned int offset)
+{
+	if (!is_valid_handle(handle))
+		return FS_ERROR_INVALID_HANDLE;
+
+	fs_priv_handle_t *fs_priv_handle = (fs_priv_handle_t *)handle;
+
+    /* Writers only ever append */
+    if (fs_priv_handle->flags.mode_flags & FS_FILE_WRITEABLE)
+        return FS_ERROR_INVALID_MODE;
+
+    return seek_handle(flash, fs_priv_handle, offset);
+}
+
+template <class Flash>
+int FileSystem<Flash>::read_at(FileHandle handle, unsigned int offset, uint8_t *dest, unsigned int size, unsigned int *read)
+{
+	if (!is_valid_handle(handle))
+		return FS_ERROR_INVALID_HANDLE;
+
+	fs_priv_handle_t *fs_priv_handle = (fs_priv_handle_t *)handle;
+    int ret;
+
+    *read = 0;
+
+    if (fs_priv_handle->flags.mode_flags & FS_FILE_WRITEABLE)
+        return FS_ERROR_INVALID_MODE;
+
+    /* The handle's own read position is left where it was */
+    uint8_t curr_allocation_unit = fs_priv_handle->curr_allocation_unit;
+    uint32_t curr_data_offset = fs_priv_handle->curr_data_offset;
+    uint32_t last_data_offset = fs_priv_handle->last_data_offset;
+
+    ret = seek_handle(flash, fs_priv_handle, offset);
+    if (!ret)
+        ret = this->read(handle, dest, size, read);
+
+    fs_priv_handle->curr_allocation_unit = curr_allocation_unit;
+    fs_priv_handle->curr_data_offset = curr_data_offset;
+    fs_priv_handle->last_data_offset = last_data_offset;
+
+    return ret;
+}
+
+template <class Flash>
+int FileSystem<Flash>::flush(FileHandle handle)
 {
 	if (!is_valid_handle(handle))
 		return FS_ERROR_INVALID_HANDLE;
@@ -775,11 +1407,72 @@ int FileSystem::flush(FileHandle handle)
     if ((fs_priv_handle->flags.mode_flags & FS_FILE_WRITEABLE) == 0)
         return FS_ERROR_INVALID_MODE;
 
+    fs_priv_handle->reserved_bytes = 0;
+
     /* Flush the handle */
-    return flush_handle(fs_priv_handle);
+    return flush_handle(flash, fs_priv_handle);
+}
+
+template <class Flash>
+int FileSystem<Flash>::reserve(FileHandle handle, unsigned int max_len, uint8_t **buf, unsigned int *len)
+{
+	if (!is_valid_handle(handle))
+		return FS_ERROR_INVALID_HANDLE;
+
+	int ret;
+    fs_priv_handle_t *fs_priv_handle = (fs_priv_handle_t *)handle;
+    uint16_t cached;
+
+    *len = 0;
+
+    if ((fs_priv_handle->flags.mode_flags & FS_FILE_WRITEABLE) == 0)
+        return FS_ERROR_INVALID_MODE;
+
+    fs_priv_handle->reserved_bytes = 0;
+
+    /* Move on to a new sector just as write() would */
+    if (is_full(fs_priv_handle))
+    {
+        ret = close_sector(flash, fs_priv_handle);
+        if (ret) return ret;
+        ret = allocate_new_sector_to_file(flash, fs_priv_handle_list, fs_priv_handle);
+        if (ret) return ret;
+    }
+
+    /* The grant may run into the slack after the page boundary but not
+     * beyond the cache nor the end of the sector.
+     */
+    cached = cached_bytes(fs_priv_handle);
+    *len = std::min(max_len, (unsigned int)(FS_PRIV_PAGE_SIZE + FS_PRIV_RESERVE_SIZE - cached));
+    *len = std::min(*len, (unsigned int)remaining_bytes(fs_priv_handle));
+    *buf = &fs_priv_handle->page_cache[cached];
+    fs_priv_handle->reserved_bytes = *len;
+
+    return FS_NO_ERROR;
+}
+
+template <class Flash>
+int FileSystem<Flash>::commit(FileHandle handle, unsigned int len)
+{
+	if (!is_valid_handle(handle))
+		return FS_ERROR_INVALID_HANDLE;
+
+    fs_priv_handle_t *fs_priv_handle = (fs_priv_handle_t *)handle;
+    uint16_t reserved = fs_priv_handle->reserved_bytes;
+
+    if ((fs_priv_handle->flags.mode_flags & FS_FILE_WRITEABLE) == 0)
+        return FS_ERROR_INVALID_MODE;
+
+    /* Only what was last reserved can be committed and only once */
+    fs_priv_handle->reserved_bytes = 0;
+    if (len > reserved)
+        return FS_ERROR_INVALID_COMMIT;
+
+    return commit_to_cache(flash, fs_priv_handle, len);
 }
 
-int FileSystem::protect(uint8_t file_id)
+template <class Flash>
+int FileSystem<Flash>::protect(uint8_t file_id)
 {
     fs_priv_t *fs_priv = &priv;
 
@@ -796,10 +1489,11 @@ int FileSystem::protect(uint8_t file_id)
     file_protect = set_protected(true, file_protect);
 
     /* Write updated file protect bits to flash */
-    if (FLASH(fs_priv->device)->write(
+    if (FlashOps<Flash>::write(flash,
             FS_PRIV_SECTOR_ADDR(root) + FS_PRIV_FILE_PROTECT_OFFSET,
             &file_protect,
-            sizeof(uint8_t)))
+            sizeof(uint8_t)) ||
+        FlashOps<Flash>::write_barrier(flash))
         return FS_ERROR_FLASH_MEDIA;
 
     fs_priv->alloc_unit_list[root].file_info.file_protect = file_protect;
@@ -807,7 +1501,8 @@ int FileSystem::protect(uint8_t file_id)
     return FS_NO_ERROR;
 }
 
-int FileSystem::unprotect(uint8_t file_id)
+template <class Flash>
+int FileSystem<Flash>::unprotect(uint8_t file_id)
 {
     fs_priv_t *fs_priv = &priv;
 
@@ -824,10 +1519,11 @@ int FileSystem::unprotect(uint8_t file_id)
     file_protect = set_protected(false, file_protect);
 
     /* Write updated file protect bits to flash */
-    if (FLASH(fs_priv->device)->write(
+    if (FlashOps<Flash>::write(flash,
             FS_PRIV_SECTOR_ADDR(root) + FS_PRIV_FILE_PROTECT_OFFSET,
             &file_protect,
-            sizeof(uint8_t)))
+            sizeof(uint8_t)) ||
+        FlashOps<Flash>::write_barrier(flash))
         return FS_ERROR_FLASH_MEDIA;
 
     fs_priv->alloc_unit_list[root].file_info.file_protect = file_protect;
@@ -835,7 +1531,8 @@ int FileSystem::unprotect(uint8_t file_id)
     return FS_NO_ERROR;
 }
 
-int FileSystem::remove(uint8_t file_id)
+template <class Flash>
+int FileSystem<Flash>::remove(uint8_t file_id)
 {
     int ret;
     fs_priv_t *fs_priv = &priv;
@@ -849,6 +1546,10 @@ int FileSystem::remove(uint8_t file_id)
     if (is_protected(get_file_protect(fs_priv, root)))
         return FS_ERROR_FILE_PROTECTED;
 
+    /* Nor open through any handle */
+    if (is_file_open(fs_priv_handle_list, file_id, 0))
+        return FS_ERROR_FILE_IN_USE;
+
     /* Erase each allocation unit associated with the file */
     while ((uint8_t)FS_PRIV_NOT_ALLOCATED != root)
     {
@@ -860,7 +1561,7 @@ int FileSystem::remove(uint8_t file_id)
         /* This will erase both the flash sector and the local copy
          * of the allocation unit's header.
          */
-        ret = erase_allocation_unit(fs_priv, temp);
+        ret = erase_allocation_unit(flash, fs_priv, temp);
         if (ret)
             return ret;
     }
@@ -868,7 +1569,8 @@ int FileSystem::remove(uint8_t file_id)
     return FS_NO_ERROR;
 }
 
-bool FileSystem::is_valid_handle(FileHandle handle)
+template <class Flash>
+bool FileSystem<Flash>::is_valid_handle(FileHandle handle)
 {
 	intptr_t base_ptr = (intptr_t)fs_priv_handle_list;
 	intptr_t end_ptr = (size_t)base_ptr + sizeof(fs_priv_handle_list);
@@ -879,16 +1581,48 @@ bool FileSystem::is_valid_handle(FileHandle handle)
 			(((fs_priv_handle_t *)handle)->fs_priv == &priv));
 }
 
-FileSystem::FileSystem(SpiFlash &flash_device)
+template <class Flash>
+FileSystem<Flash>::FileSystem(Flash &flash_device) : flash(flash_device)
 {
+    check_geometry<Flash>(NULL);
+
 	/* Initialize private data */
-    init_fs_priv(&priv, &flash_device);
+    init_fs_priv(flash, &priv);
 
-    /* Mark all handles as free */
+    /* Mark all handles and page caches as free */
     for (unsigned int i = 0; i < FS_MAX_HANDLES; i++)
+    {
+    	fs_priv_handle_list[i].page_cache = NULL;
     	free_handle(&fs_priv_handle_list[i]);
+    }
+    for (unsigned int i = 0; i < FS_PRIV_MAX_WRITERS; i++)
+    	page_cache_pool[i].in_use = 0;
+}
+
+template <class Flash>
+FileSystem<Flash>::~FileSystem()
+{
+}
+
+template <class Flash>
+unsigned int FileSystem<Flash>::get_skipped_erases()
+{
+    return priv.skipped_erases;
+}
+
+template <class Flash>
+unsigned int FileSystem<Flash>::get_copied_bytes()
+{
+    return priv.copied_bytes;
 }
 
-FileSystem::~FileSystem()
+template <class Flash>
+unsigned int FileSystem<Flash>::get_header_lookups()
 {
+    return priv.header_lookups;
 }
+
+/* Supported flash types */
+template class FileSystem<SpiFlash>;
+template class FileSystem<S25FL128>;
+template class FileSystem<S25FL512>;
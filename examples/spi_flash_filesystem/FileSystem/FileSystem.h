@@ -8,7 +8,7 @@ extern "C" {
 
 
 #ifndef FS_MAX_HANDLES
-#define FS_MAX_HANDLES		1
+#define FS_MAX_HANDLES		FS_PRIV_MAX_HANDLES
 #endif
 
 
@@ -29,6 +29,8 @@ extern "C" {
 #define FS_ERROR_BAD_DEVICE            ( -9)
 #define FS_ERROR_FILE_VERSION_MISMATCH (-10)
 #define FS_ERROR_INVALID_HANDLE		   (-11)
+#define FS_ERROR_FILE_IN_USE           (-12)
+#define FS_ERROR_INVALID_COMMIT        (-13)
 
 #define FS_MODE_CREATE 					(FS_FILE_CREATE | FS_FILE_WRITEABLE)
 #define FS_MODE_CREATE_CIRCULAR			(FS_FILE_CREATE | FS_FILE_WRITEABLE | FS_FILE_CIRCULAR)
@@ -39,15 +41,27 @@ extern "C" {
 typedef void *FileHandle;
 
 
+/* The file system is bound to the flash type at compile time so that calls
+ * into the device need not go through the vtable.  Flash must be the most
+ * derived type of the device; FileSystem<SpiFlash> keeps virtual dispatch
+ * for devices only known at run time e.g., a StripedSpiFlash.  The
+ * supported types are instantiated in FileSystem.cpp.
+ */
+template <class Flash = SpiFlash>
 class FileSystem
 {
 private:
+	Flash &flash;
 	fs_priv_t  priv;
 	fs_priv_handle_t fs_priv_handle_list[FS_MAX_HANDLES];
+	fs_priv_page_cache_t page_cache_pool[FS_PRIV_MAX_WRITERS];
 	bool is_valid_handle(FileHandle handle);
 
 public:
-	FileSystem(SpiFlash &flash_device);
+	/* Devices with a FlashGeometry have it checked against the file system
+	 * layout at compile time.
+	 */
+	FileSystem(Flash &flash_device);
 	~FileSystem();
 	int format();
 	int remove(uint8_t file_id);
@@ -56,6 +70,34 @@ public:
 	int flush(FileHandle handle);
 	int read(FileHandle handle, uint8_t *buf, unsigned int sz, unsigned int *actual);
 	int write(FileHandle handle, const uint8_t *buf, unsigned int sz, unsigned int *actual);
+
+	/* Random access for read only handles.  Offsets are from the start of
+	 * the file; seek() moves the read position while read_at() leaves it
+	 * unchanged.
+	 */
+	int seek(FileHandle handle, unsigned int offset);
+	int read_at(FileHandle handle, unsigned int offset, uint8_t *buf, unsigned int sz, unsigned int *actual);
+
+	/* Zero copy append for writers.  reserve() grants up to max_len bytes
+	 * of the page cache to be filled in place and commit() appends the
+	 * first len of them to the file.  Fewer bytes than asked for are
+	 * granted at the end of a sector or for more than
+	 * FS_PRIV_RESERVE_SIZE bytes near a page boundary.  Any other call on
+	 * the handle discards an uncommitted reservation.
+	 */
+	int reserve(FileHandle handle, unsigned int max_len, uint8_t **buf, unsigned int *len);
+	int commit(FileHandle handle, unsigned int len);
 	int protect(uint8_t file_id);
 	int unprotect(uint8_t file_id);
+
+	/* Number of sector erases skipped because the sector was blank */
+	unsigned int get_skipped_erases();
+
+	/* Number of bytes copied into, or moved within, the page caches */
+	unsigned int get_copied_bytes();
+
+	/* Number of sector headers looked at in RAM to find files and follow
+	 * their sector chains
+	 */
+	unsigned int get_header_lookups();
 };
@@ -27,16 +27,35 @@
 #endif
 
 #ifndef FS_PRIV_MAX_HANDLES
-#define FS_PRIV_MAX_HANDLES             1
+#define FS_PRIV_MAX_HANDLES             4
+#endif
+
+/* Only writers need a page cache so handles share a smaller pool of them */
+#ifndef FS_PRIV_MAX_WRITERS
+#define FS_PRIV_MAX_WRITERS             2
+#endif
+
+#if FS_PRIV_MAX_WRITERS > FS_PRIV_MAX_HANDLES
+#error "FS_PRIV_MAX_WRITERS must not exceed FS_PRIV_MAX_HANDLES"
 #endif
 
 /* This defines the maximum number of sectors supported
- * by the implementation.
+ * by the implementation.  The default covers a 16MB device such as the
+ * S25FL128S; anything beyond it is left unused.  Each sector costs 16 bytes
+ * of RAM, so larger devices must ask for more e.g., 255 for the S25FL512S.
  */
 #ifndef FS_PRIV_MAX_SECTORS
 #define FS_PRIV_MAX_SECTORS             64
 #endif
 
+/* Sector numbers are held in a byte, in RAM and in each allocation unit
+ * header, and 0xFF marks an unallocated sector.  This caps the file system
+ * at 255 sectors e.g., all but the last sector of a 64MB device.
+ */
+#if FS_PRIV_MAX_SECTORS > 255
+#error "FS_PRIV_MAX_SECTORS must not exceed 255"
+#endif
+
 #ifndef FS_PRIV_SECTOR_SIZE
 #define FS_PRIV_SECTOR_SIZE             (256 * 1024)
 #endif
@@ -47,7 +66,17 @@
 #define FS_PRIV_PAGE_SIZE               512
 #endif
 
-#define FS_PRIV_SECTOR_ADDR(s)          (s * FS_PRIV_SECTOR_SIZE)
+/* Slack after each page cache so that a reserve() of up to this many bytes
+ * is always contiguous, even when it runs past the page boundary.
+ */
+#ifndef FS_PRIV_RESERVE_SIZE
+#define FS_PRIV_RESERVE_SIZE            64
+#endif
+
+/* File identifiers are 0 to 254 since 0xFF marks an unallocated sector */
+#define FS_PRIV_MAX_FILES               255
+
+#define FS_PRIV_SECTOR_ADDR(s)          ((uint32_t)(s) * FS_PRIV_SECTOR_SIZE)
 
 /* Relative addresses to sector boundary for data structures */
 #define FS_PRIV_ALLOC_UNIT_HEADER_REL_ADDRESS      0x00000000
@@ -57,6 +86,21 @@
 
 #define FS_PRIV_NUM_WRITE_SESSIONS      126
 
+/* How a session table is searched for the first free entry */
+#define FS_PRIV_SESSION_SEARCH_SCAN     0   /*!< Read the whole table and scan it */
+#define FS_PRIV_SESSION_SEARCH_BISECT   1   /*!< Bisect the table with single entry reads */
+
+#ifndef FS_PRIV_SESSION_SEARCH
+#define FS_PRIV_SESSION_SEARCH          FS_PRIV_SESSION_SEARCH_SCAN
+#endif
+
+/* Keeps the result of each session table search in RAM; set to 0 on
+ * builds that can't afford FS_PRIV_MAX_SECTORS * 8 bytes.
+ */
+#ifndef FS_PRIV_SESSION_CACHE
+#define FS_PRIV_SESSION_CACHE           1
+#endif
+
 /* Address offsets in allocation unit */
 #define FS_PRIV_FILE_ID_OFFSET          0
 #define FS_PRIV_FILE_PROTECT_OFFSET     1
@@ -102,8 +146,30 @@ typedef struct
 
 typedef struct
 {
-    void						*device;
+    uint8_t root;           /*!< First sector of the file, FS_PRIV_NOT_ALLOCATED if none */
+    uint8_t tail;           /*!< Last sector of the file */
+    uint8_t num_sectors;    /*!< Sectors allocated to the file */
+} fs_priv_file_index_t;
+
+typedef struct
+{
+    uint32_t last_offset;   /*!< Last session offset written, 0 if none */
+    uint8_t  next_session;  /*!< Next free session, FS_PRIV_NOT_ALLOCATED if none */
+    uint8_t  valid;         /*!< Non-zero once the session table has been read */
+} fs_priv_session_cache_t;
+
+typedef struct
+{
+    uint8_t                     num_sectors;  /*!< Sectors in use, limited by device capacity */
+    unsigned int                skipped_erases; /*!< Sector erases avoided as already blank */
+    unsigned int                copied_bytes;   /*!< Bytes copied into and within page caches */
+    unsigned int                header_lookups; /*!< Sector headers looked at to find files and follow chains */
     fs_priv_alloc_unit_header_t alloc_unit_list[FS_PRIV_MAX_SECTORS];
+    fs_priv_file_index_t        file_index[FS_PRIV_MAX_FILES]; /*!< Indexed by file_id */
+    uint32_t                    sector_length[FS_PRIV_MAX_SECTORS]; /*!< Valid bytes of a sector that is not the last of its file */
+#if FS_PRIV_SESSION_CACHE
+    fs_priv_session_cache_t     session_cache[FS_PRIV_MAX_SECTORS]; /*!< Filled on first use */
+#endif
 } fs_priv_t;
 
 typedef struct
@@ -117,7 +183,14 @@ typedef struct
     uint32_t        curr_session_value;   /*!< Session offset value */
     uint32_t        last_data_offset;     /*!< Read: last readable offset, Write: last flash write position */
     uint32_t        curr_data_offset;     /*!< Current read/write data offset in sector */
-    uint8_t         page_cache[FS_PRIV_PAGE_SIZE]; /*!< Page align cache */
+    uint8_t        *page_cache;           /*!< Page align cache from the pool, writers only */
+    uint16_t        reserved_bytes;       /*!< Granted by reserve() and not yet committed */
 } fs_priv_handle_t;
 
+typedef struct
+{
+    uint8_t         data[FS_PRIV_PAGE_SIZE + FS_PRIV_RESERVE_SIZE]; /*!< Page align cache */
+    uint8_t         in_use;                  /*!< Attached to a writer */
+} fs_priv_page_cache_t;
+
 #endif /* _FS_PRIV_H_ */
@@ -1,9 +1,50 @@
 #include "S25FL128.h"
 
+/* Command timings from the S25FL128S datasheet (default latency code) */
+static const spi_flash_op_desc_t s25fl128_read_ops[] =
+{
+	{ S25FL128_READ,      1, 1, 0,  50000000 },
+	{ S25FL128_FAST_READ, 1, 1, 8, 133000000 },
+	{ S25FL128_DOR,       1, 2, 8, 104000000 },
+	{ S25FL128_QOR,       1, 4, 8, 104000000 },
+	{ S25FL128_DIOR,      2, 2, 4, 104000000 },
+	{ S25FL128_QIOR,      4, 4, 6, 104000000 },
+};
+
+static const spi_flash_op_desc_t s25fl128_program_ops[] =
+{
+	{ S25FL128_PP,        1, 1, 0, 133000000 },
+	{ S25FL128_QPP,       1, 4, 0,  80000000 },
+};
+
+/* The 512 byte page variant has uniform 256KB sectors; the 4KB parameter
+ * sectors (P4E) only exist on the hybrid 64KB sector variant.
+ */
+static const spi_flash_erase_desc_t s25fl128_erase_ops[] =
+{
+	{ S25FL128_BE, 0,                   0, 0 },
+	{ S25FL128_SE, S25FL128_BLOCK_SIZE, 0, 0 },
+};
+
+static const spi_flash_suspend_desc_t s25fl128_suspend =
+{
+	S25FL128_ERS_SSP, S25FL128_ERS_RES,
+	S25FL128_PGSP, S25FL128_PGRS,
+	S25FL128_RDSR2, S25FL128_SR2_ES, S25FL128_SR2_PS
+};
+
+static const spi_flash_caps_t s25fl128_caps =
+{
+	s25fl128_read_ops, sizeof(s25fl128_read_ops) / sizeof(s25fl128_read_ops[0]),
+	s25fl128_program_ops, sizeof(s25fl128_program_ops) / sizeof(s25fl128_program_ops[0]),
+	s25fl128_erase_ops, sizeof(s25fl128_erase_ops) / sizeof(s25fl128_erase_ops[0]),
+	&s25fl128_suspend,
+	133000000
+};
+
 S25FL128::S25FL128(const nrf_drv_spi_t &spi, const nrf_drv_spi_config_t &spi_config) :
 	SpiFlash(spi, spi_config)
 {
-	page_size = S25FL128_PAGE_SIZE;
-	block_size = S25FL128_BLOCK_SIZE;
-	num_pages = S25FL128_NUM_PAGES;
+	set_geometry<Geometry>();
+	set_caps(s25fl128_caps);
 }
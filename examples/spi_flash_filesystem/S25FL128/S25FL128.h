@@ -4,8 +4,37 @@
 #define S25FL128_BLOCK_SIZE		0x40000
 #define S25FL128_NUM_PAGES		0x8000
 
+typedef FlashGeometry<S25FL128_PAGE_SIZE, S25FL128_BLOCK_SIZE, S25FL128_NUM_PAGES> S25FL128Geometry;
+
+/* Read commands */
+#define S25FL128_READ			0x03
+#define S25FL128_FAST_READ		0x0B
+#define S25FL128_DOR			0x3B
+#define S25FL128_QOR			0x6B
+#define S25FL128_DIOR			0xBB
+#define S25FL128_QIOR			0xEB
+
+/* Program commands */
+#define S25FL128_PP				0x02
+#define S25FL128_QPP			0x32
+
+/* Erase commands */
+#define S25FL128_BE				0xC7
+#define S25FL128_SE				0xD8
+
+/* Suspend/resume commands */
+#define S25FL128_ERS_SSP		0x75
+#define S25FL128_ERS_RES		0x7A
+#define S25FL128_PGSP			0x85
+#define S25FL128_PGRS			0x8A
+#define S25FL128_RDSR2			0x07
+#define S25FL128_SR2_PS			(1 << 0)
+#define S25FL128_SR2_ES			(1 << 1)
+
 class S25FL128 : public SpiFlash
 {
 public:
+	typedef S25FL128Geometry Geometry;
+
 	S25FL128(const nrf_drv_spi_t &spi, const nrf_drv_spi_config_t &spi_config);
 };
@@ -0,0 +1,51 @@
+#include "S25FL512.h"
+
+/* The 64MB part is beyond the reach of 3-byte addresses, so only the
+ * dedicated 4-byte address commands are used; the bank address register
+ * is left in its default state.
+ */
+static const spi_flash_op_desc_t s25fl512_read_ops[] =
+{
+	{ S25FL512_4READ,      1, 1, 0,  50000000 },
+	{ S25FL512_4FAST_READ, 1, 1, 8, 133000000 },
+	{ S25FL512_4DOR,       1, 2, 8, 104000000 },
+	{ S25FL512_4QOR,       1, 4, 8, 104000000 },
+	{ S25FL512_4DIOR,      2, 2, 4, 104000000 },
+	{ S25FL512_4QIOR,      4, 4, 6, 104000000 },
+};
+
+static const spi_flash_op_desc_t s25fl512_program_ops[] =
+{
+	{ S25FL512_4PP,        1, 1, 0, 133000000 },
+	{ S25FL512_4QPP,       1, 4, 0,  80000000 },
+};
+
+static const spi_flash_erase_desc_t s25fl512_erase_ops[] =
+{
+	{ S25FL512_BE,  0,                   0, 0 },
+	{ S25FL512_4SE, S25FL512_BLOCK_SIZE, 0, 0 },
+};
+
+static const spi_flash_suspend_desc_t s25fl512_suspend =
+{
+	S25FL512_ERS_SSP, S25FL512_ERS_RES,
+	S25FL512_PGSP, S25FL512_PGRS,
+	S25FL512_RDSR2, S25FL512_SR2_ES, S25FL512_SR2_PS
+};
+
+static const spi_flash_caps_t s25fl512_caps =
+{
+	s25fl512_read_ops, sizeof(s25fl512_read_ops) / sizeof(s25fl512_read_ops[0]),
+	s25fl512_program_ops, sizeof(s25fl512_program_ops) / sizeof(s25fl512_program_ops[0]),
+	s25fl512_erase_ops, sizeof(s25fl512_erase_ops) / sizeof(s25fl512_erase_ops[0]),
+	&s25fl512_suspend,
+	133000000
+};
+
+S25FL512::S25FL512(const nrf_drv_spi_t &spi, const nrf_drv_spi_config_t &spi_config) :
+	SpiFlash(spi, spi_config)
+{
+	set_geometry<Geometry>();
+	addr_bytes = 4;
+	set_caps(s25fl512_caps);
+}
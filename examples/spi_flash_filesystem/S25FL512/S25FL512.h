@@ -0,0 +1,40 @@
+#include "SpiFlash.h"
+
+#define S25FL512_PAGE_SIZE		0x200
+#define S25FL512_BLOCK_SIZE		0x40000
+#define S25FL512_NUM_PAGES		0x20000
+
+typedef FlashGeometry<S25FL512_PAGE_SIZE, S25FL512_BLOCK_SIZE, S25FL512_NUM_PAGES> S25FL512Geometry;
+
+/* 4-byte address read commands */
+#define S25FL512_4READ			0x13
+#define S25FL512_4FAST_READ		0x0C
+#define S25FL512_4DOR			0x3C
+#define S25FL512_4QOR			0x6C
+#define S25FL512_4DIOR			0xBC
+#define S25FL512_4QIOR			0xEC
+
+/* 4-byte address program commands */
+#define S25FL512_4PP			0x12
+#define S25FL512_4QPP			0x34
+
+/* Erase commands */
+#define S25FL512_BE				0xC7
+#define S25FL512_4SE			0xDC
+
+/* Suspend/resume commands */
+#define S25FL512_ERS_SSP		0x75
+#define S25FL512_ERS_RES		0x7A
+#define S25FL512_PGSP			0x85
+#define S25FL512_PGRS			0x8A
+#define S25FL512_RDSR2			0x07
+#define S25FL512_SR2_PS			(1 << 0)
+#define S25FL512_SR2_ES			(1 << 1)
+
+class S25FL512 : public SpiFlash
+{
+public:
+	typedef S25FL512Geometry Geometry;
+
+	S25FL512(const nrf_drv_spi_t &spi, const nrf_drv_spi_config_t &spi_config);
+};
@@ -0,0 +1,33 @@
+#pragma once
+
+static constexpr bool flash_geometry_is_pow2(unsigned int n)
+{
+	return n && !(n & (n - 1));
+}
+
+/* Compile-time layout of a flash device, checked as it is built.  Sizes
+ * are powers of two so that SpiFlash can address them with masks.
+ */
+template <unsigned int PageSize, unsigned int BlockSize, unsigned int NumPages>
+struct FlashGeometry
+{
+	static_assert(flash_geometry_is_pow2(PageSize), "Page size must be a power of two");
+	static_assert(flash_geometry_is_pow2(BlockSize) && BlockSize >= PageSize,
+			"Block size must be a power of two multiple of the page size");
+	static_assert(((unsigned long long)PageSize * NumPages) % BlockSize == 0,
+			"Capacity must be a whole number of blocks");
+
+	static const unsigned int page_size = PageSize;
+	static const unsigned int block_size = BlockSize;
+	static const unsigned int num_pages = NumPages;
+	static const unsigned int capacity = PageSize * NumPages;
+};
+
+template <unsigned int P, unsigned int B, unsigned int N>
+const unsigned int FlashGeometry<P, B, N>::page_size;
+template <unsigned int P, unsigned int B, unsigned int N>
+const unsigned int FlashGeometry<P, B, N>::block_size;
+template <unsigned int P, unsigned int B, unsigned int N>
+const unsigned int FlashGeometry<P, B, N>::num_pages;
+template <unsigned int P, unsigned int B, unsigned int N>
+const unsigned int FlashGeometry<P, B, N>::capacity;
@@ -4,6 +4,8 @@
 extern "C" {
 
 #include <string.h>
+#include "nrf_gpio.h"
+#include "app_util_platform.h"
 
 static void spi_event_handler(nrf_drv_spi_evt_t const * p_event, void * p_context)
 {
@@ -11,6 +13,12 @@ static void spi_event_handler(nrf_drv_spi_evt_t const * p_event, void * p_contex
 	p->_spi_event_handler(p_event);
 }
 
+static void poll_timer_handler(void * p_context)
+{
+	struct SpiFlash *p = (struct SpiFlash *)p_context;
+	p->_poll_timer_handler();
+}
+
 }
 
 #define WREN        			0x06
@@ -20,6 +28,11 @@ static void spi_event_handler(nrf_drv_spi_evt_t const * p_event, void * p_contex
 #define BE          			0xC7
 #define READ        			0x03
 
+/* 4-byte address variants */
+#define READ4       			0x13
+#define PP4         			0x12
+#define SE4         			0xDC
+
 
 /* SPI flash status bits */
 #define RDSR_BUSY   (1 << 0)
@@ -29,57 +42,767 @@ static void spi_event_handler(nrf_drv_spi_evt_t const * p_event, void * p_contex
 #define RDSR_BP2    (1 << 4)
 #define RDSR_SRWD   (1 << 7)
 
+/* Command sequencer states */
+#define STATE_IDLE				0
+#define STATE_WREN				1
+#define STATE_COMMAND			2
+#define STATE_DATA				3
+#define STATE_POLL				4
+#define STATE_SUSPEND			5
+#define STATE_SUSPEND_POLL		6
+#define STATE_SUSPEND_STATUS	7
+#define STATE_RESUME			8
+#define STATE_BUSY				9
+#define STATE_TIMEOUT_STATUS	10
+#define STATE_TIMEOUT_RESUME	11
+
+/* Page address of an empty read cache entry or write combining buffer */
+#define NO_PAGE					0xFFFFFFFF
+
+
+/* Generic device: legacy read and page program at any SPIM clock */
+static const spi_flash_op_desc_t default_read_op = { READ, 1, 1, 0, 8000000 };
+static const spi_flash_op_desc_t default_program_op = { PP, 1, 1, 0, 8000000 };
+static const spi_flash_op_desc_t default_read4_op = { READ4, 1, 1, 0, 8000000 };
+static const spi_flash_op_desc_t default_program4_op = { PP4, 1, 1, 0, 8000000 };
+static const spi_flash_caps_t default_caps =
+{
+	&default_read_op, 1,
+	&default_program_op, 1,
+	NULL, 0,
+	NULL,
+	8000000
+};
+
+
+typedef struct
+{
+	volatile bool done;
+	int result;
+} sync_t;
+
+static void sync_callback(int result, void *context)
+{
+	sync_t *sync = (sync_t *)context;
+	sync->result = result;
+	sync->done = true;
+}
+
+static uint32_t frequency_hz(nrf_drv_spi_frequency_t frequency)
+{
+	switch (frequency)
+	{
+	case NRF_DRV_SPI_FREQ_125K: return 125000;
+	case NRF_DRV_SPI_FREQ_250K: return 250000;
+	case NRF_DRV_SPI_FREQ_500K: return 500000;
+	case NRF_DRV_SPI_FREQ_1M: return 1000000;
+	case NRF_DRV_SPI_FREQ_2M: return 2000000;
+	case NRF_DRV_SPI_FREQ_4M: return 4000000;
+	default: return 8000000;
+	}
+}
 
 void SpiFlash::_spi_event_handler(nrf_drv_spi_evt_t const * p_event)
 {
-	xfer_busy = false;
+	step();
 }
 
-int SpiFlash::status(uint8_t &value)
+void SpiFlash::_poll_timer_handler()
 {
-	int ret;
+	read_status();
+}
+
+void SpiFlash::select()
+{
+	stats.cmd_count++;
+	nrf_gpio_pin_clear(ss_pin);
+}
+
+void SpiFlash::deselect()
+{
+	nrf_gpio_pin_set(ss_pin);
+}
+
+void SpiFlash::start_xfer(const uint8_t *tx, unsigned int tx_sz, uint8_t *rx, unsigned int rx_sz)
+{
+	stats.xfer_count++;
+	stats.xfer_bytes += std::max(tx_sz, rx_sz);
+	if (nrf_drv_spi_transfer(spi_instance, tx, tx_sz, rx, rx_sz) != NRF_SUCCESS)
+	{
+		deselect();
+		complete(SPI_FLASH_ERROR_BUS);
+	}
+}
+
+void SpiFlash::send_command()
+{
+	spi_flash_cmd_t *cmd = &queue[queue_head];
+	unsigned int sz = 1 + addr_bytes;
+
+	switch (cmd->op)
+	{
+	case SPI_FLASH_OP_READ:
+		spi_buffer[0] = read_op->opcode;
+		break;
+	case SPI_FLASH_OP_WRITE:
+		/* Program up to the end of the current device page */
+		spi_buffer[0] = program_op->opcode;
+		chunk_size = std::min(cmd->sz, page_size - (cmd->addr & page_mask));
+		stats.program_count++;
+		break;
+	case SPI_FLASH_OP_ERASE:
+		spi_buffer[0] = cmd->opcode;
+		stats.erase_count++;
+		break;
+	case SPI_FLASH_OP_ERASE_ALL:
+		spi_buffer[0] = cmd->opcode;
+		stats.erase_count++;
+		sz = 1;
+		break;
+	default:
+		break;
+	}
+
+	/* Reads served whilst a deferred program or erase is suspended must
+	 * not move its range.
+	 */
+	if (cmd->op != SPI_FLASH_OP_READ)
+		busy_addr = cmd->addr;
+
+	/* Address is sent most significant byte first */
+	for (unsigned int i = 0; i < addr_bytes; i++)
+		spi_buffer[1 + i] = (uint8_t)(cmd->addr >> (8 * (addr_bytes - 1 - i)));
+
+	/* Dummy cycles are clocked as whole bytes on a single line */
+	if (cmd->op == SPI_FLASH_OP_READ && read_op->dummy_cycles)
+	{
+		memset(&spi_buffer[sz], 0, read_op->dummy_cycles / 8);
+		sz += read_op->dummy_cycles / 8;
+	}
+
+	state = STATE_COMMAND;
+	select();
+	start_xfer(spi_buffer, sz, NULL, 0);
+}
+
+void SpiFlash::send_data()
+{
+	spi_flash_cmd_t *cmd = &queue[queue_head];
+
+	state = STATE_DATA;
+
+	if (cmd->op == SPI_FLASH_OP_READ)
+	{
+		xfer_size = std::min(cmd->sz, (unsigned int)SPI_FLASH_MAX_XFER_SIZE);
+		start_xfer(NULL, 0, cmd->data, xfer_size);
+	}
+	else
+	{
+		/* EasyDMA can only access RAM so data held elsewhere e.g., in
+		 * the code flash is copied through the bounce buffer.
+		 */
+		xfer_size = std::min(chunk_size, (unsigned int)SPI_FLASH_MAX_XFER_SIZE);
+		if (nrfx_is_in_ram(cmd->data))
+		{
+			start_xfer(cmd->data, xfer_size, NULL, 0);
+		}
+		else
+		{
+			memcpy(spi_buffer, cmd->data, xfer_size);
+			start_xfer(spi_buffer, xfer_size, NULL, 0);
+		}
+	}
+}
+
+void SpiFlash::poll(uint8_t poll_state)
+{
+	/* Start of a new wait */
+	state = poll_state;
+	poll_interval_us = poll_policy.interval_us;
+	poll_elapsed_us = 0;
+	read_status();
+}
+
+void SpiFlash::read_status()
+{
+	stats.poll[poll_policy.type].poll_count++;
+	stats.poll[poll_policy.type].wait_us += poll_xfer_us;
+	poll_elapsed_us += poll_xfer_us;
+
 	spi_buffer[0] = RDSR;
 	spi_buffer[1] = 0;
-	ret = xfer(2);
-	value = spi_buffer[1];
-	return ret;
+	select();
+	start_xfer(spi_buffer, 2, spi_buffer, 2);
 }
 
-int SpiFlash::wren()
+void SpiFlash::poll_again()
 {
-	spi_buffer[0] = WREN;
-	return xfer(1);
+	spi_flash_poll_stats_t *poll_stats = &stats.poll[poll_policy.type];
+	unsigned int delay_us = poll_interval_us;
+	uint32_t ticks;
+
+	if (poll_policy.timeout_us && poll_elapsed_us >= poll_policy.timeout_us)
+	{
+		poll_stats->timeout_count++;
+		timeout();
+		return;
+	}
+
+	if (poll_policy.type != SPI_FLASH_POLL_CONTINUOUS)
+	{
+		if (poll_policy.type == SPI_FLASH_POLL_BACKOFF)
+			poll_interval_us = std::min(poll_interval_us * 2, poll_policy.max_interval_us);
+
+		ticks = ROUNDED_DIV(delay_us * (uint64_t)APP_TIMER_CLOCK_FREQ,
+				1000000 * (APP_TIMER_CONFIG_RTC_FREQUENCY + 1));
+		ticks = std::max(ticks, (uint32_t)APP_TIMER_MIN_TIMEOUT_TICKS);
+		if (app_timer_start(poll_timer, ticks, this) == NRF_SUCCESS)
+		{
+			/* The timer handler issues the next status read */
+			delay_us = ROUNDED_DIV(ticks * (uint64_t)1000000 * (APP_TIMER_CONFIG_RTC_FREQUENCY + 1),
+					APP_TIMER_CLOCK_FREQ);
+			poll_stats->wait_us += delay_us;
+			poll_elapsed_us += delay_us;
+			return;
+		}
+		/* Timer queue full, so poll straight away */
+	}
+
+	read_status();
 }
 
-int SpiFlash::xfer(unsigned int sz)
+void SpiFlash::timeout()
 {
-	xfer_busy = true;
-	nrf_drv_spi_transfer(spi_instance, spi_buffer, sz, spi_buffer, sz);
-	while (xfer_busy);
-	return 0;
+	if (state == STATE_SUSPEND_POLL)
+	{
+		/* Don't leave the device suspended with nothing to resume it */
+		state = STATE_TIMEOUT_STATUS;
+		spi_buffer[0] = caps->suspend->status;
+		spi_buffer[1] = 0;
+		select();
+		start_xfer(spi_buffer, 2, spi_buffer, 2);
+	}
+	else if (device_busy)
+	{
+		/* A deferred program or erase has completed its command already so
+		 * the next sync() reports the timeout instead.  The commands behind
+		 * it go ahead and time out themselves if the device has hung.
+		 */
+		device_busy = false;
+		deferred_result = SPI_FLASH_ERROR_TIMEOUT;
+		if (queue_count > 0)
+			start();
+		else
+			state = STATE_IDLE;
+	}
+	else
+	{
+		/* Fail the command rather than wait forever on a hung device; the
+		 * next command polls again before it is sent.
+		 */
+		defer();
+		complete(SPI_FLASH_ERROR_TIMEOUT);
+	}
 }
 
-int SpiFlash::busy_wait()
+void SpiFlash::defer()
+{
+	spi_flash_cmd_t *cmd = &queue[queue_head];
+
+	/* Remember what the device is busy with for a later suspend */
+	device_busy = true;
+	busy_op = cmd->op;
+	busy_end = (cmd->op == SPI_FLASH_OP_ERASE) ? busy_addr + cmd->sz : cmd->addr + cmd->sz;
+}
+
+void SpiFlash::done()
+{
+	spi_flash_cmd_t *cmd = &queue[queue_head];
+
+	if (cmd->op == SPI_FLASH_OP_WRITE && cmd->sz > 0)
+		start();
+	else
+		complete(SPI_FLASH_NO_ERROR);
+}
+
+bool SpiFlash::can_serve(const spi_flash_cmd_t &cmd)
+{
+	/* Only reads outside of the suspended range may run whilst suspended */
+	return cmd.op == SPI_FLASH_OP_READ &&
+			(cmd.addr + cmd.sz <= suspended_start || cmd.addr >= suspended_end);
+}
+
+bool SpiFlash::can_suspend()
+{
+	spi_flash_cmd_t *cmd = &queue[queue_head];
+	const spi_flash_cmd_t *next;
+	uint8_t opcode = 0;
+	uint8_t op;
+
+	if (!caps->suspend || suspended || resume_polls < SPI_FLASH_RESUME_MIN_POLLS)
+		return false;
+
+	if (device_busy)
+	{
+		/* A deferred program or erase has already completed its command so
+		 * the head of the queue is the one waiting behind it.
+		 */
+		if (queue_count < 1)
+			return false;
+		op = busy_op;
+		next = cmd;
+		suspended_start = busy_addr;
+		suspended_end = busy_end;
+	}
+	else
+	{
+		if (queue_count < 2)
+			return false;
+		op = cmd->op;
+		next = &queue[(queue_head + 1) % SPI_FLASH_QUEUE_SIZE];
+		suspended_start = busy_addr;
+		/* Includes the pages still to be programmed */
+		suspended_end = (op == SPI_FLASH_OP_ERASE) ? busy_addr + cmd->sz : cmd->addr + cmd->sz;
+	}
+
+	/* The whole of a page being programmed is unreadable whilst suspended */
+	if (op == SPI_FLASH_OP_WRITE)
+	{
+		suspended_start &= ~page_mask;
+		suspended_end = (suspended_end + page_mask) & ~page_mask;
+	}
+
+	if (op == SPI_FLASH_OP_ERASE)
+		opcode = caps->suspend->erase_suspend;
+	else if (op == SPI_FLASH_OP_WRITE)
+		opcode = caps->suspend->program_suspend;
+
+	return opcode && can_serve(*next);
+}
+
+void SpiFlash::suspend()
+{
+	uint8_t op = device_busy ? busy_op : queue[queue_head].op;
+
+	state = STATE_SUSPEND;
+	spi_buffer[0] = (op == SPI_FLASH_OP_ERASE) ?
+			caps->suspend->erase_suspend : caps->suspend->program_suspend;
+	select();
+	start_xfer(spi_buffer, 1, NULL, 0);
+}
+
+void SpiFlash::resume()
+{
+	uint8_t op;
+
+	if (suspended_deferred)
+	{
+		/* Nothing to re-queue, just wait for the device again */
+		op = busy_op;
+		device_busy = true;
+	}
+	else
+	{
+		/* Put the suspended command back at the head of the queue */
+		queue_head = (queue_head + SPI_FLASH_QUEUE_SIZE - 1) % SPI_FLASH_QUEUE_SIZE;
+		queue[queue_head] = suspended_cmd;
+		queue_count++;
+		chunk_size = suspended_chunk;
+		op = suspended_cmd.op;
+	}
+	suspended = false;
+	resume_polls = 0;
+
+	state = STATE_RESUME;
+	send_resume(op);
+}
+
+void SpiFlash::send_resume(uint8_t op)
+{
+	spi_buffer[0] = (op == SPI_FLASH_OP_ERASE) ?
+			caps->suspend->erase_resume : caps->suspend->program_resume;
+	select();
+	start_xfer(spi_buffer, 1, NULL, 0);
+}
+
+void SpiFlash::start()
+{
+	spi_flash_cmd_t *cmd = &queue[queue_head];
+
+	/* Anything but a read outside the suspended range, including a command
+	 * queued from a completion callback, must wait for the suspended
+	 * program or erase to be resumed and finish.
+	 */
+	if (suspended && !can_serve(*cmd))
+	{
+		resume();
+	}
+	/* Wait for a deferred program or erase to finish first */
+	else if (device_busy)
+	{
+		poll(STATE_BUSY);
+	}
+	else if (cmd->op == SPI_FLASH_OP_READ)
+	{
+		if (cmd->sz == 0)
+			complete(SPI_FLASH_NO_ERROR);
+		else
+			send_command();
+	}
+	else if (cmd->op == SPI_FLASH_OP_WRITE && cmd->sz == 0)
+	{
+		complete(SPI_FLASH_NO_ERROR);
+	}
+	else if (cmd->op == SPI_FLASH_OP_SYNC)
+	{
+		int result = deferred_result;
+		deferred_result = SPI_FLASH_NO_ERROR;
+		complete(result);
+	}
+	else
+	{
+		/* Program and erase commands must be preceded by WREN */
+		state = STATE_WREN;
+		spi_buffer[0] = WREN;
+		select();
+		start_xfer(spi_buffer, 1, NULL, 0);
+	}
+}
+
+void SpiFlash::issued()
+{
+	spi_flash_cmd_t *cmd = &queue[queue_head];
+
+	deselect();
+
+	/* The final program or erase of a command may complete without waiting */
+	if (deferred_wait && !(cmd->op == SPI_FLASH_OP_WRITE && cmd->sz > 0))
+	{
+		defer();
+		complete(SPI_FLASH_NO_ERROR);
+	}
+	else
+	{
+		poll(STATE_POLL);
+	}
+}
+
+void SpiFlash::step()
+{
+	spi_flash_cmd_t *cmd = &queue[queue_head];
+
+	switch (state)
+	{
+	case STATE_WREN:
+		deselect();
+		send_command();
+		break;
+
+	case STATE_COMMAND:
+		if (cmd->op == SPI_FLASH_OP_READ || cmd->op == SPI_FLASH_OP_WRITE)
+		{
+			/* Keep chip select asserted and stream the data */
+			send_data();
+		}
+		else
+		{
+			issued();
+		}
+		break;
+
+	case STATE_DATA:
+		cmd->sz -= xfer_size;
+		cmd->addr += xfer_size;
+		cmd->data += xfer_size;
+		if (cmd->op == SPI_FLASH_OP_READ)
+		{
+			if (cmd->sz > 0)
+			{
+				send_data();
+			}
+			else
+			{
+				deselect();
+				complete(SPI_FLASH_NO_ERROR);
+			}
+		}
+		else
+		{
+			chunk_size -= xfer_size;
+			if (chunk_size > 0)
+			{
+				send_data();
+			}
+			else
+			{
+				issued();
+			}
+		}
+		break;
+
+	case STATE_POLL:
+		deselect();
+		resume_polls++;
+		if (spi_buffer[1] & RDSR_BUSY)
+		{
+			/* Let a pending read in ahead of a long program or erase */
+			if (can_suspend())
+				suspend();
+			else
+				poll_again();
+		}
+		else
+		{
+			done();
+		}
+		break;
+
+	case STATE_SUSPEND:
+		deselect();
+		poll(STATE_SUSPEND_POLL);
+		break;
+
+	case STATE_SUSPEND_POLL:
+		deselect();
+		if (spi_buffer[1] & RDSR_BUSY)
+		{
+			poll_again();
+		}
+		else
+		{
+			state = STATE_SUSPEND_STATUS;
+			spi_buffer[0] = caps->suspend->status;
+			spi_buffer[1] = 0;
+			select();
+			start_xfer(spi_buffer, 2, spi_buffer, 2);
+		}
+		break;
+
+	case STATE_SUSPEND_STATUS:
+		deselect();
+		if (spi_buffer[1] & (caps->suspend->erase_suspended | caps->suspend->program_suspended))
+		{
+			/* Park the suspended command and serve the reads behind it */
+			suspended_deferred = device_busy;
+			if (device_busy)
+			{
+				device_busy = false;
+			}
+			else
+			{
+				suspended_cmd = *cmd;
+				suspended_chunk = chunk_size;
+				queue_head = (queue_head + 1) % SPI_FLASH_QUEUE_SIZE;
+				queue_count--;
+			}
+			suspended = true;
+			stats.suspend_count++;
+			start();
+		}
+		else if (device_busy)
+		{
+			device_busy = false;
+			start();
+		}
+		else
+		{
+			/* Finished before the suspend took effect */
+			done();
+		}
+		break;
+
+	case STATE_RESUME:
+		deselect();
+		if (!device_busy)
+			poll(STATE_POLL);
+		else if (queue_count > 0)
+			poll(STATE_BUSY);
+		else
+			state = STATE_IDLE;
+		break;
+
+	case STATE_TIMEOUT_STATUS:
+		deselect();
+		if (spi_buffer[1] & (caps->suspend->erase_suspended | caps->suspend->program_suspended))
+		{
+			state = STATE_TIMEOUT_RESUME;
+			send_resume(device_busy ? busy_op : cmd->op);
+		}
+		else
+		{
+			timeout();
+		}
+		break;
+
+	case STATE_TIMEOUT_RESUME:
+		deselect();
+		timeout();
+		break;
+
+	case STATE_BUSY:
+		deselect();
+		resume_polls++;
+		if (spi_buffer[1] & RDSR_BUSY)
+		{
+			/* Reads need not wait for a deferred program or erase either */
+			if (can_suspend())
+				suspend();
+			else
+				poll_again();
+		}
+		else
+		{
+			device_busy = false;
+			start();
+		}
+		break;
+
+	default:
+		break;
+	}
+}
+
+void SpiFlash::complete(int result)
+{
+	spi_flash_cmd_t cmd = queue[queue_head];
+
+	queue_head = (queue_head + 1) % SPI_FLASH_QUEUE_SIZE;
+	queue_count--;
+	state = STATE_IDLE;
+
+	if (cmd.callback)
+		cmd.callback(result, cmd.context);
+
+	/* The callback may already have started a newly queued command */
+	if (state == STATE_IDLE)
+	{
+		if (queue_count > 0)
+			start();
+		else if (suspended)
+			resume();
+	}
+}
+
+int SpiFlash::submit(const spi_flash_cmd_t &cmd, bool block)
 {
 	int ret;
-	uint8_t s;
 
+	/* Blocking callers wait for a free queue slot */
 	do
 	{
-		ret = status(s);
-	} while ((s & RDSR_BUSY) && !ret);
+		ret = SPI_FLASH_NO_ERROR;
+		CRITICAL_REGION_ENTER();
+		/* A suspended command keeps its slot */
+		if (queue_count + ((suspended && !suspended_deferred) ? 1 : 0) == SPI_FLASH_QUEUE_SIZE)
+		{
+			ret = SPI_FLASH_ERROR_QUEUE_FULL;
+		}
+		else
+		{
+			queue[(queue_head + queue_count) % SPI_FLASH_QUEUE_SIZE] = cmd;
+			if (cmd.op == SPI_FLASH_OP_WRITE || cmd.op == SPI_FLASH_OP_ERASE)
+				invalidate_cached_pages(cmd.addr, cmd.sz);
+			else if (cmd.op == SPI_FLASH_OP_ERASE_ALL)
+				invalidate_cached_pages(0, get_capacity());
+			queue_count++;
+			if (state == STATE_IDLE)
+				start();
+		}
+		CRITICAL_REGION_EXIT();
+	} while (block && ret == SPI_FLASH_ERROR_QUEUE_FULL);
 
 	return ret;
 }
 
+int SpiFlash::wait(const spi_flash_cmd_t &cmd)
+{
+	sync_t sync;
+	spi_flash_cmd_t c = cmd;
+	int ret;
+
+	sync.done = false;
+	c.callback = sync_callback;
+	c.context = &sync;
+
+	ret = submit(c, true);
+	if (ret)
+		return ret;
+
+	while (!sync.done);
+
+	return sync.result;
+}
+
+void SpiFlash::init()
+{
+	queue_head = 0;
+	queue_count = 0;
+	state = STATE_IDLE;
+	suspended = false;
+	suspended_deferred = false;
+	resume_polls = SPI_FLASH_RESUME_MIN_POLLS;
+	deferred_wait = false;
+	device_busy = false;
+	deferred_result = SPI_FLASH_NO_ERROR;
+
+	set_layout(0, 0, 0);
+	addr_bytes = 3;
+	set_caps(default_caps);
+
+	/* Back-to-back polling with no timeout unless configured otherwise */
+	memset(&poll_policy, 0, sizeof(poll_policy));
+	poll_policy.type = SPI_FLASH_POLL_CONTINUOUS;
+	poll_xfer_us = (16 * 1000000 + bus_clock_hz - 1) / bus_clock_hz;
+	poll_timer_created = false;
+	memset(&poll_timer_data, 0, sizeof(poll_timer_data));
+	poll_timer = &poll_timer_data;
+
+	read_cache = NULL;
+	read_cache_pages = 0;
+	read_cache_clock = 0;
+	read_cache_fill = NO_PAGE;
+
+	combine_buffer = NULL;
+	combine_page = NO_PAGE;
+	combine_queued = false;
+
+	reset_stats();
+}
+
 SpiFlash::SpiFlash(const nrf_drv_spi_t &spi, const nrf_drv_spi_config_t &spi_config)
 {
+	/* Chip select is driven manually so that a single command may span
+	 * several DMA transfers e.g., streaming reads.
+	 */
+	nrf_drv_spi_config_t config = spi_config;
+	config.ss_pin = NRF_DRV_SPI_PIN_NOT_USED;
+	ss_pin = spi_config.ss_pin;
+	nrf_gpio_pin_set(ss_pin);
+	nrf_gpio_cfg_output(ss_pin);
+
+	bus_clock_hz = frequency_hz(spi_config.frequency);
+	init();
+
 	spi_instance = &spi;
-	nrf_drv_spi_init(spi_instance, &spi_config, spi_event_handler, static_cast<void*>(this));
+	nrf_drv_spi_init(spi_instance, &config, spi_event_handler, static_cast<void*>(this));
+}
+
+SpiFlash::SpiFlash()
+{
+	/* No bus of its own e.g., a composite of other devices */
+	ss_pin = NRF_DRV_SPI_PIN_NOT_USED;
+	bus_clock_hz = frequency_hz(NRF_DRV_SPI_FREQ_8M);
+	init();
+	spi_instance = NULL;
 }
 
 SpiFlash::~SpiFlash()
 {
+	if (!spi_instance)
+		return;
+
+	/* Let any outstanding commands finish */
+	SpiFlash::sync();
 	nrf_drv_spi_uninit(spi_instance);
 }
 
@@ -88,68 +811,641 @@ unsigned int SpiFlash::get_capacity()
 	return num_pages * page_size;
 }
 
-int SpiFlash::write(unsigned int addr, const uint8_t *data, unsigned int sz)
+unsigned int SpiFlash::get_block_size()
 {
-    while (sz > 0)
-    {
-    	wren();
+	return block_size;
+}
 
-        spi_buffer[0] = PP;
-        spi_buffer[1] = (uint8_t)(addr >> 16);
-        spi_buffer[2] = (uint8_t)(addr >> 8);
-        spi_buffer[3] = (uint8_t)(addr);
+unsigned int SpiFlash::get_page_size()
+{
+	return page_size;
+}
+
+const spi_flash_op_desc_t *SpiFlash::select_op(const spi_flash_op_desc_t *ops,
+		unsigned int num_ops, unsigned int bus_lines, uint32_t bus_clock_hz,
+		unsigned int len, unsigned int addr_bytes)
+{
+	const spi_flash_op_desc_t *best = NULL;
+	unsigned int best_clocks = 0;
+
+	for (unsigned int i = 0; i < num_ops; i++)
+	{
+		if (ops[i].addr_lines > bus_lines || ops[i].data_lines > bus_lines ||
+			ops[i].max_clock_hz < bus_clock_hz)
+			continue;
+
+		/* Opcode is always sent on a single line */
+		unsigned int clocks = 8 + ((addr_bytes * 8) / ops[i].addr_lines) + ops[i].dummy_cycles +
+				((len * 8) / ops[i].data_lines);
+		if (!best || clocks < best_clocks)
+		{
+			best = &ops[i];
+			best_clocks = clocks;
+		}
+	}
+
+	return best;
+}
 
-        uint8_t wr_size = std::min(sz, sizeof(spi_buffer) - 4);
-        memcpy(&spi_buffer[4], data, wr_size);
+void SpiFlash::set_caps(const spi_flash_caps_t &device_caps)
+{
+	caps = &device_caps;
 
-        xfer(wr_size + 4);
-        busy_wait();
+	/* Pick the fastest commands usable on this bus, falling back to the
+	 * legacy commands which every device supports.
+	 */
+	read_op = select_op(caps->read_ops, caps->num_read_ops,
+			SPI_FLASH_BUS_LINES, bus_clock_hz, page_size, addr_bytes);
+	if (!read_op)
+		read_op = (addr_bytes == 4) ? &default_read4_op : &default_read_op;
 
-        sz -= wr_size;
-        addr += wr_size;
-        data += wr_size;
-    }
+	program_op = select_op(caps->program_ops, caps->num_program_ops,
+			SPI_FLASH_BUS_LINES, bus_clock_hz, page_size, addr_bytes);
+	if (!program_op)
+		program_op = (addr_bytes == 4) ? &default_program4_op : &default_program_op;
+}
 
-    return 0;
+const spi_flash_caps_t &SpiFlash::get_caps()
+{
+	return *caps;
+}
+
+const spi_flash_op_desc_t &SpiFlash::get_read_op()
+{
+	return *read_op;
+}
+
+const spi_flash_op_desc_t &SpiFlash::get_program_op()
+{
+	return *program_op;
+}
+
+const spi_flash_stats_t &SpiFlash::get_stats()
+{
+	return stats;
+}
+
+void SpiFlash::reset_stats()
+{
+	memset(&stats, 0, sizeof(stats));
+}
+
+bool SpiFlash::is_busy()
+{
+	return queue_count > 0 || suspended;
+}
+
+void SpiFlash::set_deferred_wait(bool enable)
+{
+	deferred_wait = enable;
+}
+
+int SpiFlash::set_poll_policy(const spi_flash_poll_policy_t &policy)
+{
+	if (policy.type != SPI_FLASH_POLL_CONTINUOUS && !poll_timer_created)
+	{
+		if (app_timer_create(&poll_timer, APP_TIMER_MODE_SINGLE_SHOT, poll_timer_handler))
+			return SPI_FLASH_ERROR_TIMER;
+		poll_timer_created = true;
+	}
+
+	poll_policy = policy;
+	if (poll_policy.max_interval_us < poll_policy.interval_us)
+		poll_policy.max_interval_us = poll_policy.interval_us;
+
+	return SPI_FLASH_NO_ERROR;
+}
+
+int SpiFlash::sync()
+{
+	int ret = SpiFlash::write_barrier();
+	if (ret)
+		return ret;
+
+	spi_flash_cmd_t cmd = { SPI_FLASH_OP_SYNC, 0, 0, NULL, 0, NULL, NULL };
+	return wait(cmd);
+}
+
+int SpiFlash::read_async(unsigned int addr, uint8_t *data, unsigned int sz,
+		spi_flash_callback_t callback, void *context)
+{
+	int ret = order_combined_write(SPI_FLASH_OP_READ, addr, sz, false);
+	if (ret)
+		return ret;
+
+	spi_flash_cmd_t cmd = { SPI_FLASH_OP_READ, 0, addr, data, sz, callback, context };
+	return submit(cmd, false);
+}
+
+int SpiFlash::write_async(unsigned int addr, const uint8_t *data, unsigned int sz,
+		spi_flash_callback_t callback, void *context)
+{
+	int ret = order_combined_write(SPI_FLASH_OP_WRITE, addr, sz, false);
+	if (ret)
+		return ret;
+
+	spi_flash_cmd_t cmd = { SPI_FLASH_OP_WRITE, 0, addr, const_cast<uint8_t *>(data), sz, callback, context };
+	return submit(cmd, false);
+}
+
+int SpiFlash::erase_async(unsigned int addr, spi_flash_callback_t callback, void *context)
+{
+	int ret = order_combined_write(SPI_FLASH_OP_ERASE, addr, block_size, false);
+	if (ret)
+		return ret;
+
+	spi_flash_cmd_t cmd = { SPI_FLASH_OP_ERASE, block_erase_opcode(), addr, NULL, block_size, callback, context };
+	return submit(cmd, false);
+}
+
+int SpiFlash::write(unsigned int addr, const uint8_t *data, unsigned int sz)
+{
+	if (combine_buffer)
+		return write_combined(addr, data, sz);
+
+	spi_flash_cmd_t cmd = { SPI_FLASH_OP_WRITE, 0, addr, const_cast<uint8_t *>(data), sz, NULL, NULL };
+	return wait(cmd);
 }
 
 int SpiFlash::read(unsigned int addr, uint8_t *data, unsigned int sz)
 {
+	int ret = order_combined_write(SPI_FLASH_OP_READ, addr, sz);
+	if (ret)
+		return ret;
+
+	if (read_cache_pages)
+		return read_cached(addr, data, sz);
+
+	spi_flash_cmd_t cmd = { SPI_FLASH_OP_READ, 0, addr, data, sz, NULL, NULL };
+	return wait(cmd);
+}
+
+int SpiFlash::erase_block(unsigned int addr)
+{
+	int ret = order_combined_write(SPI_FLASH_OP_ERASE, addr, block_size);
+	if (ret)
+		return ret;
+
+	spi_flash_cmd_t cmd = { SPI_FLASH_OP_ERASE, block_erase_opcode(), addr, NULL, block_size, NULL, NULL };
+	return wait(cmd);
+}
+
+int SpiFlash::erase_all()
+{
+	int ret = order_combined_write(SPI_FLASH_OP_ERASE_ALL, 0, get_capacity());
+	if (ret)
+		return ret;
+
+	spi_flash_cmd_t cmd = { SPI_FLASH_OP_ERASE_ALL, BE, 0, NULL, 0, NULL, NULL };
+	return wait(cmd);
+}
+
+int SpiFlash::erase_all_async(spi_flash_callback_t callback, void *context)
+{
+	int ret = order_combined_write(SPI_FLASH_OP_ERASE_ALL, 0, get_capacity(), false);
+	if (ret)
+		return ret;
+
+	spi_flash_cmd_t cmd = { SPI_FLASH_OP_ERASE_ALL, BE, 0, NULL, 0, callback, context };
+	return submit(cmd, false);
+}
+
+int SpiFlash::set_read_cache(uint8_t *buffer, unsigned int num_pages)
+{
+	if (num_pages > SPI_FLASH_READ_CACHE_MAX_PAGES || (buffer && !page_size))
+		return SPI_FLASH_ERROR_INVALID_RANGE;
+
+	CRITICAL_REGION_ENTER();
+	read_cache = buffer;
+	read_cache_pages = buffer ? num_pages : 0;
+	for (unsigned int i = 0; i < SPI_FLASH_READ_CACHE_MAX_PAGES; i++)
+		read_cache_page[i].addr = NO_PAGE;
+	CRITICAL_REGION_EXIT();
+
+	return SPI_FLASH_NO_ERROR;
+}
+
+int SpiFlash::find_cached_page(unsigned int page)
+{
+	for (unsigned int i = 0; i < read_cache_pages; i++)
+	{
+		if (read_cache_page[i].addr == page)
+			return i;
+	}
+
+	return -1;
+}
+
+int SpiFlash::load_cached_page(unsigned int page)
+{
+	unsigned int slot = 0;
+	int ret;
+
+	/* Reuse an empty entry, otherwise evict the least recently used */
+	for (unsigned int i = 0; i < read_cache_pages; i++)
+	{
+		if (read_cache_page[i].addr == NO_PAGE)
+		{
+			slot = i;
+			break;
+		}
+		if (read_cache_page[i].last_used < read_cache_page[slot].last_used)
+			slot = i;
+	}
+
+	CRITICAL_REGION_ENTER();
+	read_cache_page[slot].addr = NO_PAGE;
+	read_cache_fill = page;
+	CRITICAL_REGION_EXIT();
+
+	spi_flash_cmd_t cmd = { SPI_FLASH_OP_READ, 0, page, &read_cache[slot * page_size], page_size, NULL, NULL };
+	ret = wait(cmd);
+
+	/* A program or erase queued whilst loading leaves the entry empty */
+	CRITICAL_REGION_ENTER();
+	if (!ret && read_cache_fill == page)
+		read_cache_page[slot].addr = page;
+	read_cache_fill = NO_PAGE;
+	CRITICAL_REGION_EXIT();
+
+	return ret ? ret : (int)slot;
+}
+
+void SpiFlash::invalidate_cached_pages(unsigned int addr, unsigned int len)
+{
+	if (!read_cache_pages)
+		return;
+
+	for (unsigned int i = 0; i < read_cache_pages; i++)
+	{
+		unsigned int page = read_cache_page[i].addr;
+		if (page != NO_PAGE && addr < page + page_size && page < addr + len)
+			read_cache_page[i].addr = NO_PAGE;
+	}
+
+	if (read_cache_fill != NO_PAGE &&
+		addr < read_cache_fill + page_size && read_cache_fill < addr + len)
+		read_cache_fill = NO_PAGE;
+}
+
+int SpiFlash::read_cached(unsigned int addr, uint8_t *data, unsigned int sz)
+{
+	int ret;
+
 	while (sz > 0)
 	{
-		spi_buffer[0] = READ;
-		spi_buffer[1] = (uint8_t)(addr >> 16);
-		spi_buffer[2] = (uint8_t)(addr >> 8);
-		spi_buffer[3] = (uint8_t)(addr);
+		unsigned int offset = addr & page_mask;
+		unsigned int page = addr - offset;
+		unsigned int len = std::min(sz, page_size - offset);
+		int slot = find_cached_page(page);
 
-		uint8_t rd_size = std::min(sz, sizeof(spi_buffer) - 4);
+		if (slot < 0 && len == page_size)
+		{
+			/* Whole pages gain nothing from the cache so the run of them
+			 * is read directly; the cache is coherent with the device.
+			 */
+			len = sz & ~page_mask;
+			spi_flash_cmd_t cmd = { SPI_FLASH_OP_READ, 0, addr, data, len, NULL, NULL };
+			ret = wait(cmd);
+			if (ret)
+				return ret;
+		}
+		else
+		{
+			if (slot < 0)
+			{
+				stats.read_cache_misses++;
+				slot = load_cached_page(page);
+				if (slot < 0)
+					return slot;
+			}
+			else
+			{
+				stats.read_cache_hits++;
+			}
 
-		xfer(rd_size + 4);
+			read_cache_page[slot].last_used = ++read_cache_clock;
+			memcpy(data, &read_cache[slot * page_size + offset], len);
+		}
 
-		sz -= rd_size;
-		addr += rd_size;
-		memcpy(data, &spi_buffer[4], rd_size);
-		data += rd_size;
+		addr += len;
+		data += len;
+		sz -= len;
 	}
 
-	return 0;
+	return SPI_FLASH_NO_ERROR;
 }
 
-int SpiFlash::erase_block(unsigned int addr)
+int SpiFlash::set_write_combining(uint8_t *buffer)
+{
+	int ret;
+
+	if (buffer && !page_size)
+		return SPI_FLASH_ERROR_INVALID_RANGE;
+
+	ret = SpiFlash::write_barrier();
+	while (combine_queued);
+	combine_buffer = buffer;
+
+	return ret;
+}
+
+int SpiFlash::write_combined(unsigned int addr, const uint8_t *data, unsigned int sz)
 {
-	wren();
-    spi_buffer[0] = SE;
-    spi_buffer[1] = (uint8_t) (addr >> 16);
-    spi_buffer[2] = (uint8_t) (addr >> 8);
-    spi_buffer[3] = (uint8_t) (addr);
-    xfer(4);
-    return busy_wait();
+	unsigned int offset = addr & page_mask;
+	unsigned int page = addr - offset;
+	int ret;
+
+	/* Whole pages, and writes crossing a page boundary, are programmed
+	 * directly once the pending write has been.
+	 */
+	if (sz == 0 || sz == page_size || offset + sz > page_size)
+	{
+		ret = SpiFlash::write_barrier();
+		if (ret)
+			return ret;
+
+		spi_flash_cmd_t cmd = { SPI_FLASH_OP_WRITE, 0, addr, const_cast<uint8_t *>(data), sz, NULL, NULL };
+		return wait(cmd);
+	}
+
+	/* The async operations may issue the pending program from interrupt
+	 * context, so it is merged into and taken with interrupts disabled.
+	 */
+	bool merged = false;
+	CRITICAL_REGION_ENTER();
+	if (page == combine_page)
+	{
+		combine_start = std::min(combine_start, offset);
+		combine_end = std::max(combine_end, offset + sz);
+		for (unsigned int i = 0; i < sz; i++)
+			combine_buffer[offset + i] &= data[i];
+		stats.combined_writes++;
+		merged = true;
+	}
+	CRITICAL_REGION_EXIT();
+
+	if (merged)
+		return SPI_FLASH_NO_ERROR;
+
+	ret = SpiFlash::write_barrier();
+	if (ret)
+		return ret;
+
+	/* Gaps between the combined writes are programmed as 0xFF, which
+	 * leaves the bytes already in the device unchanged.  Programming only
+	 * clears bits, so repeated writes to a byte combine.  The page is only
+	 * made pending once the buffer is filled.
+	 */
+	while (combine_queued);
+	memset(combine_buffer, 0xFF, page_size);
+	for (unsigned int i = 0; i < sz; i++)
+		combine_buffer[offset + i] &= data[i];
+
+	CRITICAL_REGION_ENTER();
+	combine_start = offset;
+	combine_end = offset + sz;
+	combine_page = page;
+	CRITICAL_REGION_EXIT();
+
+	return SPI_FLASH_NO_ERROR;
 }
 
-int SpiFlash::erase_all()
+int SpiFlash::order_combined_write(spi_flash_op_t op, unsigned int addr, unsigned int len, bool block)
 {
-	wren();
-    spi_buffer[0] = BE;
-    xfer(1);
-    return busy_wait();
+	int ret = SPI_FLASH_NO_ERROR;
+	bool barrier = false;
+
+	/* Reads only need to see the pending write, whereas a program or erase
+	 * must reach the device after it.  An erase of the whole page makes
+	 * the pending write redundant.
+	 */
+	CRITICAL_REGION_ENTER();
+	if (combine_page == NO_PAGE ||
+		(op == SPI_FLASH_OP_READ &&
+		 !(addr < combine_page + page_size && combine_page < addr + len)))
+	{
+		/* Nothing to order */
+	}
+	else if ((op == SPI_FLASH_OP_ERASE || op == SPI_FLASH_OP_ERASE_ALL) &&
+		addr <= combine_page && combine_page + page_size <= addr + len)
+	{
+		combine_page = NO_PAGE;
+	}
+	else if (!block)
+	{
+		ret = queue_combined_write();
+	}
+	else
+	{
+		barrier = true;
+	}
+	CRITICAL_REGION_EXIT();
+
+	if (barrier)
+		return SpiFlash::write_barrier();
+
+	return ret;
+}
+
+void SpiFlash::combined_write_callback(int result, void *context)
+{
+	SpiFlash *flash = (SpiFlash *)context;
+
+	if (result)
+		flash->deferred_result = result;
+	flash->combine_queued = false;
+}
+
+int SpiFlash::queue_combined_write()
+{
+	unsigned int addr = combine_page + combine_start;
+	int ret;
+
+	/* The async callers may be in interrupt context so the pending program
+	 * is queued ahead of their command rather than waited for; the buffer
+	 * is not reused until it completes and a failure is reported by the
+	 * next sync().  Called with interrupts disabled.
+	 */
+	spi_flash_cmd_t cmd = { SPI_FLASH_OP_WRITE, 0, addr, &combine_buffer[combine_start],
+			combine_end - combine_start, combined_write_callback, this };
+	combine_queued = true;
+	ret = submit(cmd, false);
+	if (ret)
+		combine_queued = false;
+	else
+		combine_page = NO_PAGE;
+
+	return ret;
+}
+
+int SpiFlash::write_barrier()
+{
+	spi_flash_cmd_t cmd = { SPI_FLASH_OP_WRITE, 0, 0, NULL, 0, NULL, NULL };
+
+	/* Taken with interrupts disabled so that the async operations cannot
+	 * queue the same program from interrupt context.
+	 */
+	CRITICAL_REGION_ENTER();
+	if (combine_page != NO_PAGE)
+	{
+		cmd.addr = combine_page + combine_start;
+		cmd.data = &combine_buffer[combine_start];
+		cmd.sz = combine_end - combine_start;
+		combine_page = NO_PAGE;
+	}
+	CRITICAL_REGION_EXIT();
+
+	if (!cmd.data)
+		return SPI_FLASH_NO_ERROR;
+
+	return wait(cmd);
+}
+
+uint8_t SpiFlash::block_erase_opcode()
+{
+	/* Prefer the device's own command e.g., a 4-byte address sector erase */
+	for (unsigned int i = 0; i < caps->num_erase_ops; i++)
+	{
+		if (caps->erase_ops[i].size == block_size && caps->erase_ops[i].region_end == 0)
+			return caps->erase_ops[i].opcode;
+	}
+
+	return (addr_bytes == 4) ? SE4 : SE;
+}
+
+bool SpiFlash::find_erase_op(unsigned int addr, unsigned int len, spi_flash_erase_desc_t &erase_op)
+{
+	/* Devices without an erase table can only erase whole blocks */
+	if (caps->num_erase_ops == 0)
+	{
+		erase_op.opcode = block_erase_opcode();
+		erase_op.size = block_size;
+		erase_op.region_start = 0;
+		erase_op.region_end = 0;
+		return (addr & block_mask) == 0 && len >= block_size;
+	}
+
+	/* The table is ordered largest first so the first command that is
+	 * aligned and fits inside the remaining range is the cheapest.
+	 */
+	for (unsigned int i = 0; i < caps->num_erase_ops; i++)
+	{
+		erase_op = caps->erase_ops[i];
+		if (erase_op.size == 0)
+		{
+			if (addr == 0 && len == get_capacity())
+				return true;
+		}
+		else if ((addr & (erase_op.size - 1)) == 0 && len >= erase_op.size &&
+				 (erase_op.region_end == 0 ||
+				  (addr >= erase_op.region_start && addr + erase_op.size <= erase_op.region_end)))
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+int SpiFlash::plan_erase_range(unsigned int addr, unsigned int len, unsigned int *num_ops)
+{
+	spi_flash_erase_desc_t erase_op;
+
+	*num_ops = 0;
+
+	if (addr + len > get_capacity() || addr + len < addr)
+		return SPI_FLASH_ERROR_INVALID_RANGE;
+
+	while (len > 0)
+	{
+		if (!find_erase_op(addr, len, erase_op))
+			return SPI_FLASH_ERROR_INVALID_RANGE;
+
+		unsigned int size = erase_op.size ? erase_op.size : len;
+		addr += size;
+		len -= size;
+		(*num_ops)++;
+	}
+
+	return SPI_FLASH_NO_ERROR;
+}
+
+int SpiFlash::is_blank(unsigned int addr, unsigned int len, bool *blank)
+{
+	uint32_t buffer[SPI_FLASH_BLANK_CHECK_SIZE / sizeof(uint32_t)];
+	int ret;
+
+	*blank = false;
+
+	if (addr + len > get_capacity() || addr + len < addr)
+		return SPI_FLASH_ERROR_INVALID_RANGE;
+
+	while (len > 0)
+	{
+		unsigned int sz = std::min(len, (unsigned int)sizeof(buffer));
+		unsigned int i;
+
+		ret = read(addr, (uint8_t *)buffer, sz);
+		if (ret)
+			return ret;
+
+		/* Compare whole words, then any trailing bytes */
+		for (i = 0; i < sz / sizeof(uint32_t); i++)
+		{
+			if (buffer[i] != 0xFFFFFFFF)
+				return SPI_FLASH_NO_ERROR;
+		}
+		for (i *= sizeof(uint32_t); i < sz; i++)
+		{
+			if (((uint8_t *)buffer)[i] != 0xFF)
+				return SPI_FLASH_NO_ERROR;
+		}
+
+		addr += sz;
+		len -= sz;
+	}
+
+	*blank = true;
+
+	return SPI_FLASH_NO_ERROR;
+}
+
+int SpiFlash::erase_range(unsigned int addr, unsigned int len, unsigned int *num_ops)
+{
+	spi_flash_erase_desc_t erase_op;
+	unsigned int planned;
+	int ret;
+
+	/* Reject ranges that can't be erased exactly before erasing anything */
+	ret = plan_erase_range(addr, len, &planned);
+	if (num_ops)
+		*num_ops = planned;
+	if (ret)
+		return ret;
+
+	ret = order_combined_write(SPI_FLASH_OP_ERASE, addr, len);
+	if (ret)
+		return ret;
+
+	while (len > 0)
+	{
+		find_erase_op(addr, len, erase_op);
+
+		if (erase_op.size == 0)
+		{
+			spi_flash_cmd_t cmd = { SPI_FLASH_OP_ERASE_ALL, erase_op.opcode, 0, NULL, 0, NULL, NULL };
+			return wait(cmd);
+		}
+
+		spi_flash_cmd_t cmd = { SPI_FLASH_OP_ERASE, erase_op.opcode, addr, NULL, erase_op.size, NULL, NULL };
+		ret = wait(cmd);
+		if (ret)
+			return ret;
+
+		addr += erase_op.size;
+		len -= erase_op.size;
+	}
+
+	return SPI_FLASH_NO_ERROR;
 }
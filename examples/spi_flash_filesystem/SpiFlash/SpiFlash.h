@@ -6,33 +6,376 @@ extern "C" {
 #include "nrf.h"
 #include "nordic_common.h"
 #include "nrf_drv_spi.h"
+#include "app_timer.h"
 
 }
 
+#include "FlashGeometry.h"
+
+/* Maximum EasyDMA transfer length supported by the SPIM peripheral */
+#define SPI_FLASH_MAX_XFER_SIZE		255
+
+/* Number of commands that may be queued using the asynchronous API */
+#ifndef SPI_FLASH_QUEUE_SIZE
+#define SPI_FLASH_QUEUE_SIZE		4
+#endif
+
+/* Status polls allowed after a resume before the device may be suspended
+ * again, so that a stream of reads can't starve a program or erase
+ * (e.g., S25FL128S tRS = 100us is about 25 polls at 4MHz).
+ */
+#ifndef SPI_FLASH_RESUME_MIN_POLLS
+#define SPI_FLASH_RESUME_MIN_POLLS	25
+#endif
+
+/* Bytes read at a time when blank checking */
+#ifndef SPI_FLASH_BLANK_CHECK_SIZE
+#define SPI_FLASH_BLANK_CHECK_SIZE	512
+#endif
+
+/* Most pages that may be held by the read cache */
+#ifndef SPI_FLASH_READ_CACHE_MAX_PAGES
+#define SPI_FLASH_READ_CACHE_MAX_PAGES	8
+#endif
+
+/* The SPIM peripheral only drives a single data line in each direction */
+#define SPI_FLASH_BUS_LINES			1
+
+#define SPI_FLASH_NO_ERROR			( 0)
+#define SPI_FLASH_ERROR_QUEUE_FULL	(-1)
+#define SPI_FLASH_ERROR_BUS			(-2)
+#define SPI_FLASH_ERROR_INVALID_RANGE	(-3)
+#define SPI_FLASH_ERROR_TIMEOUT		(-4)
+#define SPI_FLASH_ERROR_TIMER		(-5)
+#define SPI_FLASH_ERROR_NOT_SUPPORTED	(-6)
+
+/* Completion callback for asynchronous commands; note that it is called
+ * from the SPI interrupt context.
+ */
+typedef void (*spi_flash_callback_t)(int result, void *context);
+
+typedef enum
+{
+	SPI_FLASH_OP_READ,
+	SPI_FLASH_OP_WRITE,
+	SPI_FLASH_OP_ERASE,
+	SPI_FLASH_OP_ERASE_ALL,
+	SPI_FLASH_OP_SYNC
+} spi_flash_op_t;
+
+typedef struct
+{
+	spi_flash_op_t       op;
+	uint8_t              opcode;	/*!< Erase command to use */
+	unsigned int         addr;		/*!< Next flash address to access */
+	uint8_t              *data;		/*!< Next buffer position to access */
+	unsigned int         sz;		/*!< Bytes remaining, or the erase size */
+	spi_flash_callback_t callback;
+	void                 *context;
+} spi_flash_cmd_t;
+
+/* Describes one read or program command supported by a device */
+typedef struct
+{
+	uint8_t  opcode;
+	uint8_t  addr_lines;		/*!< Number of I/O lines used for the address */
+	uint8_t  data_lines;		/*!< Number of I/O lines used for the data */
+	uint8_t  dummy_cycles;		/*!< Dummy clocks between address and data */
+	uint32_t max_clock_hz;		/*!< Maximum SPI clock for this command */
+} spi_flash_op_desc_t;
+
+/* Describes one erase command supported by a device */
+typedef struct
+{
+	uint8_t      opcode;
+	unsigned int size;				/*!< Bytes erased, a power of two or 0 for the whole device */
+	unsigned int region_start;		/*!< First address the command applies to */
+	unsigned int region_end;		/*!< End of region, 0 for the whole device */
+} spi_flash_erase_desc_t;
+
+/* Describes program/erase suspend support; opcodes are 0 if unsupported */
+typedef struct
+{
+	uint8_t erase_suspend;
+	uint8_t erase_resume;
+	uint8_t program_suspend;
+	uint8_t program_resume;
+	uint8_t status;				/*!< Command to read the suspend status */
+	uint8_t erase_suspended;	/*!< Status bit set whilst an erase is suspended */
+	uint8_t program_suspended;	/*!< Status bit set whilst a program is suspended */
+} spi_flash_suspend_desc_t;
+
+/* Device capability descriptor populated by each device subclass */
+typedef struct
+{
+	const spi_flash_op_desc_t *read_ops;
+	unsigned int              num_read_ops;
+	const spi_flash_op_desc_t *program_ops;
+	unsigned int              num_program_ops;
+	const spi_flash_erase_desc_t *erase_ops;	/*!< Ordered largest first */
+	unsigned int              num_erase_ops;
+	const spi_flash_suspend_desc_t *suspend;	/*!< NULL if unsupported */
+	uint32_t                  max_clock_hz;
+} spi_flash_caps_t;
+
+/* How the status register is polled whilst the device is busy.  Polling
+ * runs from the SPI event handler, so the delays are timed by an app_timer
+ * rather than spent spinning there.
+ */
+typedef enum
+{
+	SPI_FLASH_POLL_CONTINUOUS,		/*!< Back-to-back status reads */
+	SPI_FLASH_POLL_FIXED,			/*!< Fixed delay between status reads */
+	SPI_FLASH_POLL_BACKOFF,			/*!< Delay doubles after each busy status read */
+	SPI_FLASH_POLL_NUM_POLICIES
+} spi_flash_poll_type_t;
+
+typedef struct
+{
+	spi_flash_poll_type_t type;
+	unsigned int interval_us;		/*!< Delay before the first re-poll */
+	unsigned int max_interval_us;	/*!< Upper limit for the backoff delay */
+	unsigned int timeout_us;		/*!< Give up after this long, 0 waits forever */
+} spi_flash_poll_policy_t;
+
+typedef struct
+{
+	unsigned int poll_count;		/*!< Number of status register reads */
+	unsigned int wait_us;			/*!< Time spent waiting, from bus and delay times */
+	unsigned int timeout_count;		/*!< Number of waits that timed out */
+} spi_flash_poll_stats_t;
+
+typedef struct
+{
+	unsigned int cmd_count;		/*!< Number of commands issued i.e., chip select assertions */
+	unsigned int xfer_count;	/*!< Number of SPI transfers issued */
+	unsigned int xfer_bytes;	/*!< Number of bytes clocked on the bus */
+	unsigned int program_count;	/*!< Number of page program operations */
+	unsigned int erase_count;	/*!< Number of erase operations */
+	unsigned int suspend_count;	/*!< Number of times a program/erase was suspended */
+	unsigned int read_cache_hits;	/*!< Partial page reads served by the read cache */
+	unsigned int read_cache_misses;	/*!< Partial page reads that loaded a page */
+	unsigned int combined_writes;	/*!< Writes merged into a pending page program */
+	spi_flash_poll_stats_t poll[SPI_FLASH_POLL_NUM_POLICIES];	/*!< Indexed by policy */
+} spi_flash_stats_t;
+
+typedef struct
+{
+	unsigned int addr;			/*!< Page address, all ones if empty */
+	unsigned int last_used;		/*!< Read cache clock at the last hit */
+} spi_flash_cache_page_t;
+
 class SpiFlash
 {
 private:
 	const nrf_drv_spi_t *spi_instance;
-	bool xfer_busy;
-	uint8_t spi_buffer[255];
+	uint32_t ss_pin;
+	uint32_t bus_clock_hz;
+	const spi_flash_caps_t *caps;
+	const spi_flash_op_desc_t *read_op;
+	const spi_flash_op_desc_t *program_op;
+	uint8_t spi_buffer[SPI_FLASH_MAX_XFER_SIZE];
+	spi_flash_stats_t stats;
+
+	/* Command queue; the head entry is the command in progress */
+	spi_flash_cmd_t queue[SPI_FLASH_QUEUE_SIZE];
+	volatile unsigned int queue_head;
+	volatile unsigned int queue_count;
+	volatile uint8_t state;
+	unsigned int chunk_size;	/*!< Bytes remaining in the current page program */
+	unsigned int xfer_size;		/*!< Bytes in the current data transfer */
+	unsigned int busy_addr;		/*!< Start of the range being programmed or erased */
 
-	int status(uint8_t &value);
-	int wren();
-	int busy_wait();
-	int xfer(unsigned int sz);
+	/* Program or erase parked whilst reads are served */
+	volatile bool suspended;
+	spi_flash_cmd_t suspended_cmd;
+	unsigned int suspended_chunk;
+	unsigned int suspended_start;
+	unsigned int suspended_end;
+	unsigned int resume_polls;
+	bool suspended_deferred;	/*!< Suspended a deferred wait rather than a queued command */
+
+	/* Deferred busy wait: the device is still programming or erasing */
+	bool deferred_wait;
+	volatile bool device_busy;
+	int deferred_result;		/*!< Reported by the next sync() */
+	uint8_t busy_op;			/*!< Deferred program or erase still in progress */
+	unsigned int busy_end;		/*!< End of the range it is programming or erasing */
+
+	/* Status polling */
+	spi_flash_poll_policy_t poll_policy;
+	unsigned int poll_interval_us;	/*!< Delay before the next re-poll */
+	unsigned int poll_elapsed_us;	/*!< Time spent in the current wait */
+	unsigned int poll_xfer_us;		/*!< Bus time of one status read */
+	bool poll_timer_created;
+	app_timer_t poll_timer_data;
+	app_timer_id_t poll_timer;
+
+	/* Read cache of whole pages, least recently used evicted first */
+	uint8_t *read_cache;
+	unsigned int read_cache_pages;
+	unsigned int read_cache_clock;
+	volatile unsigned int read_cache_fill;	/*!< Page being loaded */
+	spi_flash_cache_page_t read_cache_page[SPI_FLASH_READ_CACHE_MAX_PAGES];
+
+	/* Write combining: a pending program of part of one page */
+	uint8_t *combine_buffer;
+	unsigned int combine_page;		/*!< Page address, all ones if none is pending */
+	unsigned int combine_start;		/*!< Pending bytes within the page */
+	unsigned int combine_end;
+	volatile bool combine_queued;	/*!< Buffer is held by a queued program */
+
+	void init();
+	int submit(const spi_flash_cmd_t &cmd, bool block);
+	int wait(const spi_flash_cmd_t &cmd);
+	void start();
+	void step();
+	void complete(int result);
+	void start_xfer(const uint8_t *tx, unsigned int tx_sz, uint8_t *rx, unsigned int rx_sz);
+	void send_command();
+	void send_data();
+	void poll(uint8_t poll_state);
+	void read_status();
+	void poll_again();
+	void timeout();
+	void defer();
+	void done();
+	void issued();
+	bool can_serve(const spi_flash_cmd_t &cmd);
+	bool can_suspend();
+	void suspend();
+	void resume();
+	void send_resume(uint8_t op);
+	void select();
+	void deselect();
+	int read_cached(unsigned int addr, uint8_t *data, unsigned int sz);
+	int find_cached_page(unsigned int page);
+	int load_cached_page(unsigned int page);
+	void invalidate_cached_pages(unsigned int addr, unsigned int len);
+	int write_combined(unsigned int addr, const uint8_t *data, unsigned int sz);
+	int order_combined_write(spi_flash_op_t op, unsigned int addr, unsigned int len, bool block = true);
+	int queue_combined_write();
+	static void combined_write_callback(int result, void *context);
+	uint8_t block_erase_opcode();
+	bool find_erase_op(unsigned int addr, unsigned int len, spi_flash_erase_desc_t &erase_op);
 
 protected:
 	unsigned int num_pages;
 	unsigned int block_size;
 	unsigned int page_size;
+	unsigned int page_mask;		/*!< page_size - 1 */
+	unsigned int block_mask;	/*!< block_size - 1 */
+	unsigned int addr_bytes;	/*!< 3, or 4 for devices larger than 16MB */
+
+	void set_caps(const spi_flash_caps_t &device_caps);
+
+	/* Page and block sizes are powers of two so that address arithmetic on
+	 * them is done with the masks.
+	 */
+	void set_layout(unsigned int pages, unsigned int block, unsigned int page)
+	{
+		num_pages = pages;
+		block_size = block;
+		page_size = page;
+		block_mask = block - 1;
+		page_mask = page - 1;
+	}
+
+	template <class Geometry>
+	void set_geometry()
+	{
+		set_layout(Geometry::num_pages, Geometry::block_size, Geometry::page_size);
+	}
+
+	/* For devices without a bus of their own e.g., composites; these must
+	 * override the public operations.
+	 */
+	SpiFlash();
 
 public:
-	~SpiFlash();
+	virtual ~SpiFlash();
 	SpiFlash(const nrf_drv_spi_t &spi, const nrf_drv_spi_config_t &spi_config);
-	unsigned int get_capacity();
-	int write(unsigned int addr, const uint8_t *data, unsigned int sz);
-	int read(unsigned int addr, uint8_t *data, unsigned int sz);
-	int erase_block(unsigned int addr);
-	int erase_all();
+	virtual unsigned int get_capacity();
+	unsigned int get_block_size();
+	unsigned int get_page_size();
+	virtual int write(unsigned int addr, const uint8_t *data, unsigned int sz);
+	virtual int read(unsigned int addr, uint8_t *data, unsigned int sz);
+	virtual int erase_block(unsigned int addr);
+	virtual int erase_all();
+
+	/* Erases exactly [addr, addr + len) using the fewest erase commands from
+	 * the device erase table.  The number of planned erase commands is
+	 * returned through num_ops.  plan_erase_range only computes the plan.
+	 */
+	virtual int erase_range(unsigned int addr, unsigned int len, unsigned int *num_ops = NULL);
+	int plan_erase_range(unsigned int addr, unsigned int len, unsigned int *num_ops);
+
+	/* Keeps up to num_pages recently read pages in buffer, which must hold
+	 * num_pages * get_page_size() bytes; NULL disables the cache.  Reads
+	 * of part of a page then load the whole page and later reads of it are
+	 * served without a bus transfer.  Programs and erases invalidate the
+	 * pages they touch.
+	 */
+	int set_read_cache(uint8_t *buffer, unsigned int num_pages);
+
+	/* Holds writes of part of a page in buffer, which must hold
+	 * get_page_size() bytes, so that later writes to the same page are
+	 * merged into a single page program; NULL disables combining.  The
+	 * pending program is issued before a write to another page, an erase
+	 * or an overlapping read, so the device always holds the writes in the
+	 * order they were made.  write_barrier() issues it e.g., before
+	 * reporting metadata as committed.  Only write() combines, and only
+	 * from outside of interrupt context.  The async operations queue the
+	 * pending program ahead of their own command instead of waiting for it.
+	 */
+	int set_write_combining(uint8_t *buffer);
+	virtual int write_barrier();
+
+	/* Sets blank if every byte of [addr, addr + len) reads as 0xFF; stops
+	 * reading at the first programmed word.
+	 */
+	int is_blank(unsigned int addr, unsigned int len, bool *blank);
+
+	/* Non-blocking variants; buffers must remain valid until the callback
+	 * has been called.  SPI_FLASH_ERROR_QUEUE_FULL is returned if the
+	 * command could not be queued.
+	 */
+	virtual int read_async(unsigned int addr, uint8_t *data, unsigned int sz,
+			spi_flash_callback_t callback, void *context);
+	virtual int write_async(unsigned int addr, const uint8_t *data, unsigned int sz,
+			spi_flash_callback_t callback, void *context);
+	virtual int erase_async(unsigned int addr, spi_flash_callback_t callback, void *context);
+	virtual int erase_all_async(spi_flash_callback_t callback, void *context);
+	virtual bool is_busy();
+
+	/* With deferred wait enabled, programs and erases complete as soon as
+	 * the command has been sent and the status poll happens at the start
+	 * of the next command instead.  sync() waits for the device to finish
+	 * and returns SPI_FLASH_ERROR_TIMEOUT if a wait for one of them timed
+	 * out since the last sync().
+	 */
+	void set_deferred_wait(bool enable);
+	virtual int sync();
+
+	/* Sets how the device is polled whilst busy; only change it when no
+	 * commands are queued.  Policies with a delay need app_timer_init() to
+	 * have been called.  A wait that exceeds the timeout completes the
+	 * program or erase with SPI_FLASH_ERROR_TIMEOUT.
+	 */
+	int set_poll_policy(const spi_flash_poll_policy_t &policy);
+
+	/* Returns the command with the fewest bus clocks for a transfer of len
+	 * bytes that the bus can drive, or NULL if none is usable.
+	 */
+	static const spi_flash_op_desc_t *select_op(const spi_flash_op_desc_t *ops,
+			unsigned int num_ops, unsigned int bus_lines, uint32_t bus_clock_hz,
+			unsigned int len, unsigned int addr_bytes = 3);
+	const spi_flash_caps_t &get_caps();
+	const spi_flash_op_desc_t &get_read_op();
+	const spi_flash_op_desc_t &get_program_op();
+
+	const spi_flash_stats_t &get_stats();
+	void reset_stats();
 	void _spi_event_handler(nrf_drv_spi_evt_t const * p_event);
+	void _poll_timer_handler();
 };
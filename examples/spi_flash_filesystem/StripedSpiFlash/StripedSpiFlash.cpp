@@ -0,0 +1,287 @@
+#include <algorithm>
+#include "StripedSpiFlash.h"
+
+extern "C" {
+
+#include "app_util_platform.h"
+
+static void stripe_callback(int result, void *context)
+{
+	striped_flash_context_t *p = (striped_flash_context_t *)context;
+	p->owner->_complete(p->device, result);
+}
+
+}
+
+StripedSpiFlash::StripedSpiFlash(SpiFlash *const devices[], unsigned int num_devices,
+		unsigned int stripe_unit) : SpiFlash()
+{
+	this->num_devices = num_devices;
+	this->stripe_unit = stripe_unit;
+	pending = 0;
+	result = SPI_FLASH_NO_ERROR;
+
+	/* A stripe unit that splits a page or straddles a device block leaves
+	 * the composite with no capacity, so every access is out of range.  So
+	 * does a number of devices that would make the block size other than
+	 * a power of two, or more devices than there is room for.
+	 */
+	if (num_devices == 0 || num_devices > STRIPED_FLASH_MAX_DEVICES ||
+		(num_devices & (num_devices - 1)) != 0 ||
+		stripe_unit == 0 ||
+		(devices[0]->get_block_size() % stripe_unit) != 0 ||
+		(stripe_unit % devices[0]->get_page_size()) != 0)
+	{
+		this->num_devices = 0;
+		device_block_size = 0;
+		return;
+	}
+
+	for (unsigned int i = 0; i < this->num_devices; i++)
+	{
+		this->devices[i] = devices[i];
+		contexts[i].owner = this;
+		contexts[i].device = i;
+	}
+
+	/* The devices are assumed to be identical */
+	device_block_size = devices[0]->get_block_size();
+	set_layout((devices[0]->get_capacity() / devices[0]->get_page_size()) * this->num_devices,
+			device_block_size * this->num_devices, devices[0]->get_page_size());
+}
+
+StripedSpiFlash::~StripedSpiFlash()
+{
+	sync();
+}
+
+void StripedSpiFlash::_complete(unsigned int device, int result)
+{
+	if (result && this->result == SPI_FLASH_NO_ERROR)
+		this->result = result;
+	pending--;
+}
+
+int StripedSpiFlash::finish()
+{
+	/* Wait for every device to complete its share */
+	while (pending);
+	return result;
+}
+
+int StripedSpiFlash::transfer(bool write, unsigned int addr, uint8_t *data, unsigned int sz)
+{
+	int ret = SPI_FLASH_NO_ERROR;
+
+	if (addr + sz > get_capacity() || addr + sz < addr)
+		return SPI_FLASH_ERROR_INVALID_RANGE;
+
+	result = SPI_FLASH_NO_ERROR;
+
+	/* Hand each stripe unit to its device in turn; a device's queue keeps
+	 * it busy whilst the next device is being fed.
+	 */
+	while (sz > 0)
+	{
+		unsigned int stripe = addr / stripe_unit;
+		unsigned int offset = addr % stripe_unit;
+		unsigned int device = stripe % num_devices;
+		unsigned int device_addr = (stripe / num_devices) * stripe_unit + offset;
+		unsigned int len = std::min(sz, stripe_unit - offset);
+
+		CRITICAL_REGION_ENTER();
+		pending++;
+		CRITICAL_REGION_EXIT();
+
+		do
+		{
+			if (write)
+				ret = devices[device]->write_async(device_addr, data, len,
+						stripe_callback, &contexts[device]);
+			else
+				ret = devices[device]->read_async(device_addr, data, len,
+						stripe_callback, &contexts[device]);
+		} while (ret == SPI_FLASH_ERROR_QUEUE_FULL);
+
+		if (ret)
+		{
+			CRITICAL_REGION_ENTER();
+			pending--;
+			CRITICAL_REGION_EXIT();
+			break;
+		}
+
+		addr += len;
+		data += len;
+		sz -= len;
+	}
+
+	/* Wait for anything already queued even if a submission failed */
+	if (finish() == SPI_FLASH_NO_ERROR)
+		return ret;
+
+	return result;
+}
+
+unsigned int StripedSpiFlash::get_capacity()
+{
+	return num_pages * page_size;
+}
+
+int StripedSpiFlash::write(unsigned int addr, const uint8_t *data, unsigned int sz)
+{
+	return transfer(true, addr, const_cast<uint8_t *>(data), sz);
+}
+
+int StripedSpiFlash::read(unsigned int addr, uint8_t *data, unsigned int sz)
+{
+	return transfer(false, addr, data, sz);
+}
+
+int StripedSpiFlash::erase_block(unsigned int addr)
+{
+	unsigned int device_addr;
+	int ret = SPI_FLASH_NO_ERROR;
+
+	if (addr >= get_capacity())
+		return SPI_FLASH_ERROR_INVALID_RANGE;
+
+	device_addr = (addr / block_size) * device_block_size;
+
+	result = SPI_FLASH_NO_ERROR;
+
+	/* The block is erased on all devices at once */
+	for (unsigned int i = 0; i < num_devices && ret == SPI_FLASH_NO_ERROR; i++)
+	{
+		CRITICAL_REGION_ENTER();
+		pending++;
+		CRITICAL_REGION_EXIT();
+
+		while ((ret = devices[i]->erase_async(device_addr, stripe_callback, &contexts[i])) ==
+				SPI_FLASH_ERROR_QUEUE_FULL);
+
+		if (ret)
+		{
+			CRITICAL_REGION_ENTER();
+			pending--;
+			CRITICAL_REGION_EXIT();
+		}
+	}
+
+	if (finish() == SPI_FLASH_NO_ERROR)
+		return ret;
+
+	return result;
+}
+
+int StripedSpiFlash::erase_all()
+{
+	int ret = SPI_FLASH_NO_ERROR;
+
+	result = SPI_FLASH_NO_ERROR;
+
+	for (unsigned int i = 0; i < num_devices && ret == SPI_FLASH_NO_ERROR; i++)
+	{
+		CRITICAL_REGION_ENTER();
+		pending++;
+		CRITICAL_REGION_EXIT();
+
+		while ((ret = devices[i]->erase_all_async(stripe_callback, &contexts[i])) ==
+				SPI_FLASH_ERROR_QUEUE_FULL);
+
+		if (ret)
+		{
+			CRITICAL_REGION_ENTER();
+			pending--;
+			CRITICAL_REGION_EXIT();
+		}
+	}
+
+	if (finish() == SPI_FLASH_NO_ERROR)
+		return ret;
+
+	return result;
+}
+
+int StripedSpiFlash::erase_range(unsigned int addr, unsigned int len, unsigned int *num_ops)
+{
+	unsigned int planned;
+	int ret;
+
+	/* Only whole stripe blocks can be erased */
+	ret = plan_erase_range(addr, len, &planned);
+	if (num_ops)
+		*num_ops = planned;
+	if (ret)
+		return ret;
+
+	for (; len > 0; addr += block_size, len -= block_size)
+	{
+		ret = erase_block(addr);
+		if (ret)
+			return ret;
+	}
+
+	return SPI_FLASH_NO_ERROR;
+}
+
+int StripedSpiFlash::read_async(unsigned int addr, uint8_t *data, unsigned int sz,
+		spi_flash_callback_t callback, void *context)
+{
+	return SPI_FLASH_ERROR_NOT_SUPPORTED;
+}
+
+int StripedSpiFlash::write_async(unsigned int addr, const uint8_t *data, unsigned int sz,
+		spi_flash_callback_t callback, void *context)
+{
+	return SPI_FLASH_ERROR_NOT_SUPPORTED;
+}
+
+int StripedSpiFlash::erase_async(unsigned int addr, spi_flash_callback_t callback, void *context)
+{
+	return SPI_FLASH_ERROR_NOT_SUPPORTED;
+}
+
+int StripedSpiFlash::erase_all_async(spi_flash_callback_t callback, void *context)
+{
+	return SPI_FLASH_ERROR_NOT_SUPPORTED;
+}
+
+bool StripedSpiFlash::is_busy()
+{
+	for (unsigned int i = 0; i < num_devices; i++)
+	{
+		if (devices[i]->is_busy())
+			return true;
+	}
+
+	return pending > 0;
+}
+
+int StripedSpiFlash::write_barrier()
+{
+	int ret = SPI_FLASH_NO_ERROR;
+
+	for (unsigned int i = 0; i < num_devices; i++)
+	{
+		int r = devices[i]->write_barrier();
+		if (r && ret == SPI_FLASH_NO_ERROR)
+			ret = r;
+	}
+
+	return ret;
+}
+
+int StripedSpiFlash::sync()
+{
+	int ret = SPI_FLASH_NO_ERROR;
+
+	for (unsigned int i = 0; i < num_devices; i++)
+	{
+		int r = devices[i]->sync();
+		if (r && ret == SPI_FLASH_NO_ERROR)
+			ret = r;
+	}
+
+	return ret;
+}
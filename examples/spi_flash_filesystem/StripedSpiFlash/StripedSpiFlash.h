@@ -0,0 +1,68 @@
+#pragma once
+
+#include "SpiFlash.h"
+
+/* Maximum number of devices in a stripe set */
+#ifndef STRIPED_FLASH_MAX_DEVICES
+#define STRIPED_FLASH_MAX_DEVICES	2
+#endif
+
+class StripedSpiFlash;
+
+/* Completion context for the commands queued on each device */
+typedef struct
+{
+	StripedSpiFlash *owner;
+	unsigned int    device;
+} striped_flash_context_t;
+
+/* RAID-0 style composite that interleaves stripe_unit sized chunks of the
+ * address space across several identical devices, each on its own SPIM
+ * instance, and keeps all of them transferring at once.
+ *
+ * An erase block spans the same block on every device, so it is
+ * num_devices times the size of a device block; a FileSystem mounted on
+ * the composite needs FS_PRIV_SECTOR_SIZE to match get_block_size().
+ * The number of devices must be a power of two and the stripe unit a whole
+ * number of device pages that divides the device block size; otherwise
+ * get_capacity() is zero and every access fails with
+ * SPI_FLASH_ERROR_INVALID_RANGE.
+ *
+ * Only the blocking operations are supported; the asynchronous ones
+ * return SPI_FLASH_ERROR_NOT_SUPPORTED.
+ */
+class StripedSpiFlash : public SpiFlash
+{
+private:
+	SpiFlash *devices[STRIPED_FLASH_MAX_DEVICES];
+	striped_flash_context_t contexts[STRIPED_FLASH_MAX_DEVICES];
+	unsigned int num_devices;
+	unsigned int stripe_unit;
+	unsigned int device_block_size;
+	volatile unsigned int pending;	/*!< Device commands not yet completed */
+	volatile int result;			/*!< First error reported by a device */
+
+	int transfer(bool write, unsigned int addr, uint8_t *data, unsigned int sz);
+	int finish();
+
+public:
+	StripedSpiFlash(SpiFlash *const devices[], unsigned int num_devices, unsigned int stripe_unit);
+	~StripedSpiFlash();
+	unsigned int get_capacity();
+	int write(unsigned int addr, const uint8_t *data, unsigned int sz);
+	int read(unsigned int addr, uint8_t *data, unsigned int sz);
+	int erase_block(unsigned int addr);
+	int erase_all();
+	int erase_range(unsigned int addr, unsigned int len, unsigned int *num_ops = NULL);
+	int read_async(unsigned int addr, uint8_t *data, unsigned int sz,
+			spi_flash_callback_t callback, void *context);
+	int write_async(unsigned int addr, const uint8_t *data, unsigned int sz,
+			spi_flash_callback_t callback, void *context);
+	int erase_async(unsigned int addr, spi_flash_callback_t callback, void *context);
+	int erase_all_async(spi_flash_callback_t callback, void *context);
+	bool is_busy();
+	int sync();
+	int write_barrier();
+
+	void _complete(unsigned int device, int result);
+};
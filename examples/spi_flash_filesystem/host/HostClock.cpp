@@ -0,0 +1,28 @@
+#include "HostClock.h"
+
+static uint64_t clock_ns;
+
+extern "C" {
+
+uint64_t host_clock_ns(void)
+{
+	return __atomic_load_n(&clock_ns, __ATOMIC_SEQ_CST);
+}
+
+void host_clock_advance(uint64_t ns)
+{
+	__atomic_add_fetch(&clock_ns, ns, __ATOMIC_SEQ_CST);
+}
+
+void host_clock_advance_to(uint64_t time_ns)
+{
+	uint64_t now = host_clock_ns();
+
+	/* Retry if another context moved the clock on in the meantime */
+	while (now < time_ns)
+		if (__atomic_compare_exchange_n(&clock_ns, &now, time_ns, false,
+				__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+			break;
+}
+
+}
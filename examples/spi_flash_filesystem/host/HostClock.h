@@ -0,0 +1,22 @@
+#pragma once
+
+/* Simulated time for the host build.  It only moves on by the modelled
+ * cost of what the target would wait for: SPI transfers, flash busy times,
+ * delays and timer timeouts.  CPU time on the host is not counted, so
+ * results are repeatable whatever the host.
+ */
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+uint64_t host_clock_ns(void);
+
+/* Moves the clock on by ns, or up to a time that may already have passed */
+void host_clock_advance(uint64_t ns);
+void host_clock_advance_to(uint64_t time_ns);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,541 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "sdk_config.h"
+#include "nordic_common.h"
+#include "nrf.h"
+#include "nrf_drv_spi.h"
+#include "nrf_gpio.h"
+#include "app_util_platform.h"
+#include "HostFlash.h"
+#include "HostClock.h"
+
+#define STATUS_WIP					(1 << 0)
+#define STATUS_WEL					(1 << 1)
+#define STATUS2_PS					(1 << 0)
+#define STATUS2_ES					(1 << 1)
+
+typedef enum
+{
+	CMD_WREN,
+	CMD_RDSR,
+	CMD_RDSR2,
+	CMD_READ,
+	CMD_PROGRAM,
+	CMD_SECTOR_ERASE,
+	CMD_CHIP_ERASE,
+	CMD_ERASE_SUSPEND,
+	CMD_ERASE_RESUME,
+	CMD_PROGRAM_SUSPEND,
+	CMD_PROGRAM_RESUME
+} host_flash_cmd_type_t;
+
+typedef struct
+{
+	uint8_t opcode;
+	uint8_t type;
+	uint8_t addr_bytes;
+	uint8_t dummy_bytes;
+} host_flash_cmd_desc_t;
+
+/* Single I/O commands of the S25FL1-S family, including the 4-byte address
+ * variants so that 4-byte addressing can be exercised.
+ */
+static const host_flash_cmd_desc_t commands[] =
+{
+	{ 0x06, CMD_WREN,            0, 0 },
+	{ 0x05, CMD_RDSR,            0, 0 },
+	{ 0x07, CMD_RDSR2,           0, 0 },
+	{ 0x03, CMD_READ,            3, 0 },
+	{ 0x0B, CMD_READ,            3, 1 },
+	{ 0x13, CMD_READ,            4, 0 },
+	{ 0x0C, CMD_READ,            4, 1 },
+	{ 0x02, CMD_PROGRAM,         3, 0 },
+	{ 0x12, CMD_PROGRAM,         4, 0 },
+	{ 0xD8, CMD_SECTOR_ERASE,    3, 0 },
+	{ 0xDC, CMD_SECTOR_ERASE,    4, 0 },
+	{ 0xC7, CMD_CHIP_ERASE,      0, 0 },
+	{ 0x60, CMD_CHIP_ERASE,      0, 0 },
+	{ 0x75, CMD_ERASE_SUSPEND,   0, 0 },
+	{ 0x7A, CMD_ERASE_RESUME,    0, 0 },
+	{ 0x85, CMD_PROGRAM_SUSPEND, 0, 0 },
+	{ 0x8A, CMD_PROGRAM_RESUME,  0, 0 },
+};
+
+typedef enum
+{
+	BUSY_NONE,
+	BUSY_PROGRAM,
+	BUSY_ERASE
+} host_flash_busy_t;
+
+typedef struct
+{
+	uint8_t *mem;
+	int fd;					/*!< Image file, -1 if stored in RAM */
+
+	/* Command being clocked in */
+	bool selected;
+	unsigned int pos;
+	const host_flash_cmd_desc_t *cmd;
+	uint8_t opcode;
+	uint32_t addr;
+	uint8_t page[HOST_FLASH_PAGE_SIZE];
+	bool page_written[HOST_FLASH_PAGE_SIZE];
+	unsigned int page_bytes;
+
+	/* Program or erase in progress */
+	bool wel;
+	uint8_t busy;
+	uint64_t busy_until_ns;
+	uint32_t busy_start;
+	uint32_t busy_end;
+	bool suspending;
+	bool suspended;
+	uint64_t remaining_ns;	/*!< Busy time left when suspended */
+
+	unsigned int violations;
+} host_flash_t;
+
+static host_flash_t flash = { NULL, -1 };
+
+/* Cycle counter registers */
+host_dwt_t host_dwt;
+host_core_debug_t host_core_debug;
+
+/* SPI master state */
+static nrf_drv_spi_evt_handler_t spi_handler;
+static void *spi_context;
+static uint8_t spi_ss_pin = NRF_DRV_SPI_PIN_NOT_USED;
+static uint32_t spi_clock_hz;
+
+/* The interrupt lock is held by the interrupt thread whilst a handler runs
+ * and by critical regions; it is recursive as critical regions nest.
+ */
+static pthread_once_t irq_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t irq_lock;
+static pthread_mutex_t irq_pending_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t irq_pending_cond = PTHREAD_COND_INITIALIZER;
+static unsigned int irq_pending;
+
+static void violation(const char *what)
+{
+	flash.violations++;
+	printf("Host flash: %s (opcode 0x%02X)\n", what, flash.opcode);
+}
+
+/* Finishes a program or erase, or completes a suspend, once its time is up */
+static void settle()
+{
+	if (flash.busy == BUSY_NONE || flash.suspended || host_clock_ns() < flash.busy_until_ns)
+		return;
+
+	if (flash.suspending)
+	{
+		flash.suspending = false;
+		flash.suspended = true;
+	}
+	else
+		flash.busy = BUSY_NONE;
+}
+
+static bool is_busy()
+{
+	settle();
+	return flash.busy != BUSY_NONE && !flash.suspended;
+}
+
+static void start_busy(uint8_t busy, uint32_t start, uint32_t end, unsigned int busy_us)
+{
+	flash.wel = false;
+	flash.busy = busy;
+	flash.busy_start = start;
+	flash.busy_end = end;
+	flash.busy_until_ns = host_clock_ns() + busy_us * 1000ULL;
+}
+
+static void suspend(uint8_t busy)
+{
+	if (!is_busy() || flash.busy != busy || flash.suspending)
+		return;
+
+	flash.remaining_ns = flash.busy_until_ns - host_clock_ns();
+	flash.busy_until_ns = host_clock_ns() + HOST_FLASH_SUSPEND_US * 1000ULL;
+	flash.suspending = true;
+}
+
+static void resume(uint8_t busy)
+{
+	if (!flash.suspended || flash.busy != busy)
+	{
+		violation("resume when not suspended");
+		return;
+	}
+
+	flash.suspended = false;
+	flash.busy_until_ns = host_clock_ns() + flash.remaining_ns;
+}
+
+/* Programming can only clear bits */
+static void program()
+{
+	uint32_t page_addr = (flash.addr % HOST_FLASH_SIZE) & ~(HOST_FLASH_PAGE_SIZE - 1);
+
+	if (flash.page_bytes > HOST_FLASH_PAGE_SIZE)
+		violation("program longer than a page");
+
+	for (unsigned int i = 0; i < HOST_FLASH_PAGE_SIZE; i++)
+		if (flash.page_written[i])
+			flash.mem[page_addr + i] &= flash.page[i];
+
+	start_busy(BUSY_PROGRAM, page_addr, page_addr + HOST_FLASH_PAGE_SIZE, HOST_FLASH_PROGRAM_US);
+}
+
+static void erase(uint32_t start, uint32_t size, unsigned int busy_us)
+{
+	memset(&flash.mem[start], 0xFF, size);
+	start_busy(BUSY_ERASE, start, start + size, busy_us);
+}
+
+static void execute()
+{
+	const host_flash_cmd_desc_t *cmd = flash.cmd;
+	bool busy = is_busy();
+
+	if (cmd->type == CMD_RDSR || cmd->type == CMD_RDSR2 || cmd->type == CMD_READ)
+		return;
+
+	if (flash.pos < 1u + cmd->addr_bytes)
+	{
+		violation("command ended before its address");
+		return;
+	}
+
+	/* Only status reads and suspends are accepted whilst busy, and only
+	 * reads and resumes whilst suspended.
+	 */
+	if (busy && cmd->type != CMD_ERASE_SUSPEND && cmd->type != CMD_PROGRAM_SUSPEND)
+	{
+		violation("command whilst busy");
+		return;
+	}
+	if (flash.suspended && cmd->type != CMD_ERASE_RESUME && cmd->type != CMD_PROGRAM_RESUME)
+	{
+		violation("command whilst suspended");
+		return;
+	}
+	if ((cmd->type == CMD_PROGRAM || cmd->type == CMD_SECTOR_ERASE ||
+			cmd->type == CMD_CHIP_ERASE) && !flash.wel)
+	{
+		violation("program or erase without write enable");
+		return;
+	}
+
+	switch (cmd->type)
+	{
+	case CMD_WREN:
+		flash.wel = true;
+		break;
+	case CMD_PROGRAM:
+		program();
+		break;
+	case CMD_SECTOR_ERASE:
+		erase((flash.addr % HOST_FLASH_SIZE) & ~(HOST_FLASH_BLOCK_SIZE - 1),
+				HOST_FLASH_BLOCK_SIZE, HOST_FLASH_ERASE_US);
+		break;
+	case CMD_CHIP_ERASE:
+		erase(0, HOST_FLASH_SIZE, HOST_FLASH_CHIP_ERASE_US);
+		break;
+	case CMD_ERASE_SUSPEND:
+		suspend(BUSY_ERASE);
+		break;
+	case CMD_PROGRAM_SUSPEND:
+		suspend(BUSY_PROGRAM);
+		break;
+	case CMD_ERASE_RESUME:
+		resume(BUSY_ERASE);
+		break;
+	case CMD_PROGRAM_RESUME:
+		resume(BUSY_PROGRAM);
+		break;
+	}
+}
+
+static void chip_select()
+{
+	flash.selected = true;
+	flash.pos = 0;
+	flash.cmd = NULL;
+	flash.addr = 0;
+	flash.page_bytes = 0;
+	memset(flash.page_written, 0, sizeof(flash.page_written));
+}
+
+static void chip_deselect()
+{
+	if (!flash.selected)
+		return;
+
+	flash.selected = false;
+	if (flash.cmd)
+		execute();
+}
+
+static uint8_t clock_byte(uint8_t in)
+{
+	const host_flash_cmd_desc_t *cmd = flash.cmd;
+	unsigned int data_pos;
+	uint8_t out = 0xFF;
+
+	if (!flash.selected)
+		return out;
+
+	if (flash.pos == 0)
+	{
+		flash.opcode = in;
+		for (unsigned int i = 0; i < sizeof(commands) / sizeof(commands[0]); i++)
+			if (commands[i].opcode == in)
+				flash.cmd = &commands[i];
+		if (!flash.cmd)
+			violation("unsupported command");
+		flash.pos++;
+		return out;
+	}
+
+	if (!cmd)
+		return out;
+
+	if (flash.pos <= cmd->addr_bytes)
+	{
+		flash.addr = (flash.addr << 8) | in;
+		flash.pos++;
+		return out;
+	}
+
+	data_pos = flash.pos - 1 - cmd->addr_bytes;
+	flash.pos++;
+	if (data_pos < cmd->dummy_bytes)
+		return out;
+
+	switch (cmd->type)
+	{
+	case CMD_RDSR:
+		out = (is_busy() ? STATUS_WIP : 0) | (flash.wel ? STATUS_WEL : 0);
+		break;
+	case CMD_RDSR2:
+		settle();
+		if (flash.suspended)
+			out = (flash.busy == BUSY_ERASE) ? STATUS2_ES : STATUS2_PS;
+		else
+			out = 0;
+		break;
+	case CMD_READ:
+	{
+		uint32_t addr = flash.addr++ % HOST_FLASH_SIZE;
+		if (is_busy() || (flash.suspended && addr >= flash.busy_start && addr < flash.busy_end))
+			violation("read of a region being programmed or erased");
+		out = flash.mem[addr];
+		break;
+	}
+	case CMD_PROGRAM:
+	{
+		/* Data beyond the end of the page wraps to its start */
+		unsigned int offset = (flash.addr + flash.page_bytes++) & (HOST_FLASH_PAGE_SIZE - 1);
+		flash.page[offset] = in;
+		flash.page_written[offset] = true;
+		break;
+	}
+	default:
+		break;
+	}
+
+	return out;
+}
+
+static void *irq_thread(void *arg)
+{
+	nrf_drv_spi_evt_t event = { NRF_DRV_SPI_EVENT_DONE };
+
+	for (;;)
+	{
+		if (!__atomic_load_n(&irq_pending, __ATOMIC_SEQ_CST))
+		{
+			pthread_mutex_lock(&irq_pending_lock);
+			while (!__atomic_load_n(&irq_pending, __ATOMIC_SEQ_CST))
+				pthread_cond_wait(&irq_pending_cond, &irq_pending_lock);
+			pthread_mutex_unlock(&irq_pending_lock);
+		}
+		__atomic_sub_fetch(&irq_pending, 1, __ATOMIC_SEQ_CST);
+
+		pthread_mutex_lock(&irq_lock);
+		if (spi_handler)
+			spi_handler(&event, spi_context);
+		pthread_mutex_unlock(&irq_lock);
+	}
+
+	return NULL;
+}
+
+static void irq_init()
+{
+	pthread_mutexattr_t attr;
+	pthread_t thread;
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&irq_lock, &attr);
+	pthread_create(&thread, NULL, irq_thread, NULL);
+	pthread_detach(thread);
+}
+
+extern "C" {
+
+int host_flash_open(const char *path)
+{
+	struct stat st;
+
+	if (flash.mem)
+		return 0;
+
+	if (!path)
+	{
+		flash.mem = (uint8_t *)malloc(HOST_FLASH_SIZE);
+		if (!flash.mem)
+			return -1;
+		memset(flash.mem, 0xFF, HOST_FLASH_SIZE);
+		return 0;
+	}
+
+	flash.fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (flash.fd < 0 || fstat(flash.fd, &st) < 0)
+		goto fail;
+	if (st.st_size != HOST_FLASH_SIZE && ftruncate(flash.fd, HOST_FLASH_SIZE) < 0)
+		goto fail;
+
+	flash.mem = (uint8_t *)mmap(NULL, HOST_FLASH_SIZE, PROT_READ | PROT_WRITE,
+			MAP_SHARED, flash.fd, 0);
+	if (flash.mem == MAP_FAILED)
+	{
+		flash.mem = NULL;
+		goto fail;
+	}
+
+	/* Anything the image file didn't cover reads as erased */
+	if (st.st_size < HOST_FLASH_SIZE)
+		memset(&flash.mem[st.st_size], 0xFF, HOST_FLASH_SIZE - st.st_size);
+	return 0;
+
+fail:
+	if (flash.fd >= 0)
+		close(flash.fd);
+	flash.fd = -1;
+	return -1;
+}
+
+void host_flash_close(void)
+{
+	if (!flash.mem)
+		return;
+
+	if (flash.fd >= 0)
+	{
+		munmap(flash.mem, HOST_FLASH_SIZE);
+		close(flash.fd);
+		flash.fd = -1;
+	}
+	else
+		free(flash.mem);
+	flash.mem = NULL;
+}
+
+unsigned int host_flash_violations(void)
+{
+	return flash.violations;
+}
+
+void host_critical_region_enter(void)
+{
+	pthread_once(&irq_once, irq_init);
+	pthread_mutex_lock(&irq_lock);
+}
+
+void host_critical_region_exit(void)
+{
+	pthread_mutex_unlock(&irq_lock);
+}
+
+void nrf_gpio_cfg_output(uint32_t pin_number)
+{
+}
+
+void nrf_gpio_pin_set(uint32_t pin_number)
+{
+	if (pin_number == SPI_SS_PIN)
+		chip_deselect();
+}
+
+void nrf_gpio_pin_clear(uint32_t pin_number)
+{
+	if (pin_number == SPI_SS_PIN)
+		chip_select();
+}
+
+ret_code_t nrf_drv_spi_init(nrf_drv_spi_t const * const p_instance,
+		nrf_drv_spi_config_t const * p_config,
+		nrf_drv_spi_evt_handler_t handler, void * p_context)
+{
+	if (host_flash_open(NULL))
+		return NRF_ERROR_NULL;
+
+	pthread_once(&irq_once, irq_init);
+	spi_handler = handler;
+	spi_context = p_context;
+	spi_ss_pin = p_config->ss_pin;
+	spi_clock_hz = ((uint32_t)p_config->frequency / NRF_DRV_SPI_FREQ_125K) * 125000;
+	return NRF_SUCCESS;
+}
+
+void nrf_drv_spi_uninit(nrf_drv_spi_t const * const p_instance)
+{
+	spi_handler = NULL;
+}
+
+ret_code_t nrf_drv_spi_transfer(nrf_drv_spi_t const * const p_instance,
+		uint8_t const * p_tx_buffer, uint8_t tx_buffer_length,
+		uint8_t * p_rx_buffer, uint8_t rx_buffer_length)
+{
+	unsigned int len = MAX(tx_buffer_length, rx_buffer_length);
+
+	/* Bus time at the configured clock; the device acts on the bytes once
+	 * they have all been clocked.
+	 */
+	host_clock_advance((len * 8 * 1000000000ULL) / spi_clock_hz);
+
+	if (spi_ss_pin != NRF_DRV_SPI_PIN_NOT_USED)
+		chip_select();
+	for (unsigned int i = 0; i < len; i++)
+	{
+		uint8_t in = (i < tx_buffer_length) ? p_tx_buffer[i] : 0xFF;
+		uint8_t out = clock_byte(in);
+		if (i < rx_buffer_length)
+			p_rx_buffer[i] = out;
+	}
+	if (spi_ss_pin != NRF_DRV_SPI_PIN_NOT_USED)
+		chip_deselect();
+
+	/* Completion is signalled from the interrupt thread */
+	if (__atomic_fetch_add(&irq_pending, 1, __ATOMIC_SEQ_CST) == 0)
+	{
+		pthread_mutex_lock(&irq_pending_lock);
+		pthread_cond_signal(&irq_pending_cond);
+		pthread_mutex_unlock(&irq_pending_lock);
+	}
+	return NRF_SUCCESS;
+}
+
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+/* Host build stand-in for the SPI NOR flash wired to the SPI master.  It
+ * answers the commands SpiFlash issues at the byte level, so the drivers,
+ * FileSystem and tests run unmodified on the host.  NOR semantics are
+ * enforced: programming can only clear bits, erase sets bytes to 0xFF and
+ * both need a preceding write enable.  Commands a real device would reject
+ * or misbehave on are counted as violations.
+ */
+#include <stdint.h>
+
+/* Device geometry, matching the S25FL1-S family.  It is sized for the
+ * S25FL512S; an S25FL128S only uses the first 16MB.
+ */
+#ifndef HOST_FLASH_SIZE
+#define HOST_FLASH_SIZE				(64 * 1024 * 1024)
+#endif
+#define HOST_FLASH_PAGE_SIZE		0x200
+#define HOST_FLASH_BLOCK_SIZE		0x40000
+
+/* Typical program and erase times from the S25FL128S datasheet: tPP for a
+ * 512 byte page, tSE for a 256KB sector and tBE, plus the maximum suspend
+ * latency (tPSL and tESL).  These, and the bus time of every transfer at the
+ * configured SPI clock, move the simulated clock on.
+ */
+#ifndef HOST_FLASH_PROGRAM_US
+#define HOST_FLASH_PROGRAM_US		340
+#endif
+#ifndef HOST_FLASH_ERASE_US
+#define HOST_FLASH_ERASE_US			520000
+#endif
+#ifndef HOST_FLASH_CHIP_ERASE_US
+#define HOST_FLASH_CHIP_ERASE_US	33000000
+#endif
+#ifndef HOST_FLASH_SUSPEND_US
+#define HOST_FLASH_SUSPEND_US		45
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Stores the device in RAM, or in an image file mapped into memory if a
+ * path is given so that its contents persist between runs; a new image
+ * starts erased.  Returns 0 on success.  The SPI driver opens a RAM
+ * device if none has been opened.
+ */
+int host_flash_open(const char *path);
+void host_flash_close(void);
+
+/* Number of commands that broke the device rules */
+unsigned int host_flash_violations(void);
+
+#ifdef __cplusplus
+}
+#endif
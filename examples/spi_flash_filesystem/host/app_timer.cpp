@@ -0,0 +1,96 @@
+#include <pthread.h>
+#include <unistd.h>
+#include "app_timer.h"
+#include "app_util_platform.h"
+#include "HostClock.h"
+
+typedef struct
+{
+	app_timer_id_t timer_id;
+	unsigned int   generation;
+	uint64_t       period_ns;
+	uint64_t       expiry_ns;
+	void           *context;
+} timeout_t;
+
+static void *timeout_thread(void *arg)
+{
+	timeout_t *timeout = (timeout_t *)arg;
+	app_timer_t *timer = timeout->timer_id;
+
+	do
+	{
+		/* Sleeping for the timeout keeps timers firing in order; the clock
+		 * may already have been moved past it by other contexts.
+		 */
+		usleep((timeout->period_ns + 999) / 1000);
+		host_clock_advance_to(timeout->expiry_ns);
+		timeout->expiry_ns += timeout->period_ns;
+
+		/* Stopped or restarted timers must not fire */
+		CRITICAL_REGION_ENTER();
+		if (timer->generation == timeout->generation)
+			timer->handler(timeout->context);
+		CRITICAL_REGION_EXIT();
+	} while (timer->mode == APP_TIMER_MODE_REPEATED &&
+			timer->generation == timeout->generation);
+
+	delete timeout;
+	return NULL;
+}
+
+extern "C" {
+
+ret_code_t app_timer_init(void)
+{
+	return NRF_SUCCESS;
+}
+
+ret_code_t app_timer_create(app_timer_id_t const * p_timer_id, app_timer_mode_t mode,
+		app_timer_timeout_handler_t timeout_handler)
+{
+	if (!p_timer_id || !*p_timer_id || !timeout_handler)
+		return NRF_ERROR_NULL;
+
+	(*p_timer_id)->handler = timeout_handler;
+	(*p_timer_id)->mode = mode;
+	(*p_timer_id)->generation = 0;
+	return NRF_SUCCESS;
+}
+
+ret_code_t app_timer_start(app_timer_id_t timer_id, uint32_t timeout_ticks, void * p_context)
+{
+	timeout_t *timeout;
+	pthread_t thread;
+
+	if (!timer_id->handler)
+		return NRF_ERROR_INVALID_STATE;
+
+	timeout = new timeout_t;
+	CRITICAL_REGION_ENTER();
+	timeout->timer_id = timer_id;
+	timeout->generation = ++timer_id->generation;
+	timeout->period_ns = ROUNDED_DIV(timeout_ticks * 1000000000ULL *
+			(APP_TIMER_CONFIG_RTC_FREQUENCY + 1), APP_TIMER_CLOCK_FREQ);
+	timeout->expiry_ns = host_clock_ns() + timeout->period_ns;
+	timeout->context = p_context;
+	CRITICAL_REGION_EXIT();
+
+	if (pthread_create(&thread, NULL, timeout_thread, timeout))
+	{
+		delete timeout;
+		return NRF_ERROR_INVALID_STATE;
+	}
+	pthread_detach(thread);
+	return NRF_SUCCESS;
+}
+
+ret_code_t app_timer_stop(app_timer_id_t timer_id)
+{
+	CRITICAL_REGION_ENTER();
+	timer_id->generation++;
+	CRITICAL_REGION_EXIT();
+	return NRF_SUCCESS;
+}
+
+}
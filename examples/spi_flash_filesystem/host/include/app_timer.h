@@ -0,0 +1,52 @@
+#pragma once
+
+/* Host build stand-in for app_timer; each started timer sleeps for its
+ * timeout on its own host thread, moves the simulated clock on to the
+ * timeout and calls the handler inside a critical region, as the timer
+ * interrupt would.
+ */
+#include <stdint.h>
+#include "sdk_config.h"
+#include "nordic_common.h"
+#include "sdk_errors.h"
+
+#define APP_TIMER_CLOCK_FREQ			32768
+#define APP_TIMER_MIN_TIMEOUT_TICKS		5
+#define APP_TIMER_TICKS(MS) \
+	((uint32_t)ROUNDED_DIV((MS) * (uint64_t)APP_TIMER_CLOCK_FREQ, \
+			1000 * (APP_TIMER_CONFIG_RTC_FREQUENCY + 1)))
+
+typedef void (*app_timer_timeout_handler_t)(void * p_context);
+
+typedef enum
+{
+	APP_TIMER_MODE_SINGLE_SHOT,
+	APP_TIMER_MODE_REPEATED
+} app_timer_mode_t;
+
+typedef struct
+{
+	app_timer_timeout_handler_t handler;
+	app_timer_mode_t            mode;
+	volatile unsigned int       generation;	/*!< Bumped to cancel pending timeouts */
+} app_timer_t;
+
+typedef app_timer_t *app_timer_id_t;
+
+#define APP_TIMER_DEF(timer_id) \
+	static app_timer_t timer_id##_data = { 0 }; \
+	static const app_timer_id_t timer_id = &timer_id##_data
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+ret_code_t app_timer_init(void);
+ret_code_t app_timer_create(app_timer_id_t const * p_timer_id, app_timer_mode_t mode,
+		app_timer_timeout_handler_t timeout_handler);
+ret_code_t app_timer_start(app_timer_id_t timer_id, uint32_t timeout_ticks, void * p_context);
+ret_code_t app_timer_stop(app_timer_id_t timer_id);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,19 @@
+#pragma once
+
+/* Host build stand-in for the critical region macros.  Interrupt handlers
+ * run on a host thread which holds the same lock, so a critical region
+ * masks them just as it does on the target.
+ */
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void host_critical_region_enter(void);
+void host_critical_region_exit(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#define CRITICAL_REGION_ENTER()		{ host_critical_region_enter();
+#define CRITICAL_REGION_EXIT()		host_critical_region_exit(); }
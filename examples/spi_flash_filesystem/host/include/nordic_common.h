@@ -0,0 +1,7 @@
+#pragma once
+
+/* Host build stand-in for the nRF5 SDK common macros */
+#define ROUNDED_DIV(A, B)	(((A) + ((B) / 2)) / (B))
+#define CEIL_DIV(A, B)		(((A) + (B) - 1) / (B))
+#define MIN(a, b)			((a) < (b) ? (a) : (b))
+#define MAX(a, b)			((a) < (b) ? (b) : (a))
@@ -0,0 +1,39 @@
+#pragma once
+
+/* Host build stand-in for the nRF52 device header; only the DWT cycle
+ * counter used by the benchmarks is provided, counting simulated time as
+ * if at 64MHz.
+ */
+#include <stdint.h>
+#include "HostClock.h"
+
+#define SystemCoreClock					64000000UL
+
+struct host_cycle_counter
+{
+	operator uint32_t() const
+	{
+		return (uint32_t)((host_clock_ns() * (SystemCoreClock / 1000000)) / 1000);
+	}
+	/* Writes are ignored; benchmarks only use differences */
+	host_cycle_counter &operator=(uint32_t) { return *this; }
+};
+
+typedef struct
+{
+	uint32_t CTRL;
+	host_cycle_counter CYCCNT;
+} host_dwt_t;
+
+typedef struct
+{
+	uint32_t DEMCR;
+} host_core_debug_t;
+
+extern host_dwt_t host_dwt;
+extern host_core_debug_t host_core_debug;
+
+#define DWT								(&host_dwt)
+#define CoreDebug						(&host_core_debug)
+#define CoreDebug_DEMCR_TRCENA_Msk		(1UL << 24)
+#define DWT_CTRL_CYCCNTENA_Msk			(1UL << 0)
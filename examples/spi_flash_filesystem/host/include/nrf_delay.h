@@ -0,0 +1,17 @@
+#pragma once
+
+/* Host build stand-in for the busy-wait delays; they move the simulated
+ * clock on rather than waiting.
+ */
+#include <stdint.h>
+#include "HostClock.h"
+
+static inline void nrf_delay_us(uint32_t us)
+{
+	host_clock_advance(us * 1000ULL);
+}
+
+static inline void nrf_delay_ms(uint32_t ms)
+{
+	host_clock_advance(ms * 1000000ULL);
+}
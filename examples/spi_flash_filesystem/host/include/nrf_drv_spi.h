@@ -0,0 +1,92 @@
+#pragma once
+
+/* Host build stand-in for the legacy SPI master driver; transfers are
+ * clocked through the host flash device and completion events are
+ * delivered from a host thread standing in for the SPIM interrupt.
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "sdk_errors.h"
+
+#define NRF_DRV_SPI_PIN_NOT_USED	0xFF
+
+typedef struct
+{
+	uint8_t inst_idx;
+} nrf_drv_spi_t;
+
+#define NRF_DRV_SPI_INSTANCE(id)	{ id }
+
+typedef enum
+{
+	NRF_DRV_SPI_FREQ_125K = 0x02000000UL,
+	NRF_DRV_SPI_FREQ_250K = 0x04000000UL,
+	NRF_DRV_SPI_FREQ_500K = 0x08000000UL,
+	NRF_DRV_SPI_FREQ_1M   = 0x10000000UL,
+	NRF_DRV_SPI_FREQ_2M   = 0x20000000UL,
+	NRF_DRV_SPI_FREQ_4M   = 0x40000000UL,
+	NRF_DRV_SPI_FREQ_8M   = (int)0x80000000UL
+} nrf_drv_spi_frequency_t;
+
+typedef enum
+{
+	NRF_DRV_SPI_MODE_0,
+	NRF_DRV_SPI_MODE_1,
+	NRF_DRV_SPI_MODE_2,
+	NRF_DRV_SPI_MODE_3
+} nrf_drv_spi_mode_t;
+
+typedef enum
+{
+	NRF_DRV_SPI_BIT_ORDER_MSB_FIRST,
+	NRF_DRV_SPI_BIT_ORDER_LSB_FIRST
+} nrf_drv_spi_bit_order_t;
+
+typedef struct
+{
+	uint8_t sck_pin;
+	uint8_t mosi_pin;
+	uint8_t miso_pin;
+	uint8_t ss_pin;
+	uint8_t irq_priority;
+	uint8_t orc;
+	nrf_drv_spi_frequency_t frequency;
+	nrf_drv_spi_mode_t      mode;
+	nrf_drv_spi_bit_order_t bit_order;
+} nrf_drv_spi_config_t;
+
+typedef enum
+{
+	NRF_DRV_SPI_EVENT_DONE
+} nrf_drv_spi_evt_type_t;
+
+typedef struct
+{
+	nrf_drv_spi_evt_type_t type;
+} nrf_drv_spi_evt_t;
+
+typedef void (*nrf_drv_spi_evt_handler_t)(nrf_drv_spi_evt_t const * p_event, void * p_context);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+ret_code_t nrf_drv_spi_init(nrf_drv_spi_t const * const p_instance,
+		nrf_drv_spi_config_t const * p_config,
+		nrf_drv_spi_evt_handler_t handler, void * p_context);
+void nrf_drv_spi_uninit(nrf_drv_spi_t const * const p_instance);
+ret_code_t nrf_drv_spi_transfer(nrf_drv_spi_t const * const p_instance,
+		uint8_t const * p_tx_buffer, uint8_t tx_buffer_length,
+		uint8_t * p_rx_buffer, uint8_t rx_buffer_length);
+
+#ifdef __cplusplus
+}
+#endif
+
+/* All host memory is DMA-able */
+static inline bool nrfx_is_in_ram(void const * p_object)
+{
+	(void)p_object;
+	return true;
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+/* Host build stand-in for the GPIO HAL; the flash chip select pin is
+ * routed to the host flash device.
+ */
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void nrf_gpio_cfg_output(uint32_t pin_number);
+void nrf_gpio_pin_set(uint32_t pin_number);
+void nrf_gpio_pin_clear(uint32_t pin_number);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,10 @@
+#pragma once
+
+/* Host build stand-in for the nRF5 SDK error codes */
+#include <stdint.h>
+
+typedef uint32_t ret_code_t;
+
+#define NRF_SUCCESS					0
+#define NRF_ERROR_INVALID_STATE		8
+#define NRF_ERROR_NULL				14
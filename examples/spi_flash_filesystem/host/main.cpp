@@ -0,0 +1,28 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "CppUTest/CommandLineTestRunner.h"
+#include "HostFlash.h"
+
+int main(int argc, char *argv[])
+{
+	/* HOST_FLASH_IMAGE names an image file that keeps the flash contents */
+	const char *image = getenv("HOST_FLASH_IMAGE");
+	int result;
+
+	if (host_flash_open(image))
+	{
+		printf("Unable to open flash image %s\n", image);
+		return 1;
+	}
+
+	result = CommandLineTestRunner::RunAllTests(argc, argv);
+
+	if (host_flash_violations())
+	{
+		printf("Host flash: %u invalid commands\n", host_flash_violations());
+		result = 1;
+	}
+
+	host_flash_close();
+	return result;
+}
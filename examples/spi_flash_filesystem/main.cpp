@@ -58,6 +58,8 @@ extern "C" {
 #include "app_uart.h"
 #include "bsp.h"
 #include "app_error.h"
+#include "app_timer.h"
+#include "nrf_clock.h"
 
 #define UART_TX_BUF_SIZE 256                         /**< UART TX buffer size. */
 #define UART_RX_BUF_SIZE 256                         /**< UART RX buffer size. */
@@ -107,12 +109,27 @@ static void uart_init(void)
     APP_ERROR_CHECK(err_code);
 }
 
+static void timer_init(void)
+{
+    ret_code_t err_code;
+
+    /* app_timer runs from the low frequency clock */
+    nrf_clock_lf_src_set(NRF_CLOCK_LFCLK_RC);
+    nrf_clock_event_clear(NRF_CLOCK_EVENT_LFCLKSTARTED);
+    nrf_clock_task_trigger(NRF_CLOCK_TASK_LFCLKSTART);
+    while (!nrf_clock_event_check(NRF_CLOCK_EVENT_LFCLKSTARTED));
+
+    err_code = app_timer_init();
+    APP_ERROR_CHECK(err_code);
+}
+
 /**
  * @brief Function for application main entry.
  */
 int main(int ac, char *av[])
 {
     uart_init();
+    timer_init();
     int exit_code = CommandLineTestRunner::RunAllTests(ac, av);
     jumper_sudo_exit_with_exit_code(exit_code);
 }
@@ -0,0 +1,516 @@
+#include "CppUTest/TestHarness.h"
+#include "S25FL128.h"
+#include "FileSystem.h"
+#include "cycle_counter.h"
+#include "nrf_delay.h"
+#include <algorithm>
+
+extern "C" {
+#include <stdio.h>
+
+	static const nrf_drv_spi_t spi = NRF_DRV_SPI_INSTANCE(0);
+
+	static nrf_drv_spi_config_t spi_config =
+	{
+		    .sck_pin      = SPI_SCK_PIN,
+		    .mosi_pin     = SPI_MOSI_PIN,
+		    .miso_pin     = SPI_MISO_PIN,
+		    .ss_pin       = SPI_SS_PIN,
+		    .irq_priority = SPI_DEFAULT_CONFIG_IRQ_PRIORITY,
+		    .orc          = 0xFF,
+		    .frequency    = NRF_DRV_SPI_FREQ_4M,
+		    .mode         = NRF_DRV_SPI_MODE_0,
+		    .bit_order    = NRF_DRV_SPI_BIT_ORDER_MSB_FIRST,
+	};
+}
+
+static S25FL128 *s25fl128;
+static FileSystem<S25FL128> *fs;
+static uint8_t record[FS_PRIV_PAGE_SIZE];
+static uint8_t rd_buffer[FS_PRIV_PAGE_SIZE];
+
+TEST_GROUP(FileSystemBenchmark)
+{
+	void setup() {
+		s25fl128 = new S25FL128(spi, spi_config);
+		s25fl128->erase_all();
+		fs = new FileSystem<S25FL128>(*s25fl128);
+		cycle_counter_start();
+	}
+
+	void teardown() {
+		delete fs;
+		delete s25fl128;
+	}
+};
+
+/* Time a producer spends waiting on e.g., a sensor before each record.
+ * The host clock does not count CPU time, so this is what lets a deferred
+ * busy wait overlap a page program with the producer there.
+ */
+#define PRODUCE_RECORD_US	300
+
+/* Stand-in for the work a producer does between writes e.g., sampling
+ * and formatting a record.
+ */
+static void produce_record(uint8_t *buf, unsigned int sz, unsigned int seq)
+{
+	uint32_t crc = seq;
+
+	nrf_delay_us(PRODUCE_RECORD_US);
+
+	for (unsigned int i = 0; i < sz; i++)
+	{
+		for (unsigned int bit = 0; bit < 8; bit++)
+			crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+		buf[i] = (uint8_t)(seq + i);
+	}
+
+	buf[0] = (uint8_t)crc;
+}
+
+static uint32_t sequential_write_cycles(uint8_t file_id, unsigned int num_records)
+{
+	FileHandle handle;
+	unsigned int actual;
+	uint32_t start;
+
+	CHECK_EQUAL(FS_NO_ERROR, fs->open(&handle, file_id, FS_MODE_CREATE, NULL));
+
+	start = cycle_counter_read();
+	for (unsigned int i = 0; i < num_records; i++)
+	{
+		produce_record(record, sizeof(record), i);
+		CHECK_EQUAL(FS_NO_ERROR, fs->write(handle, record, sizeof(record), &actual));
+	}
+	CHECK_EQUAL(FS_NO_ERROR, fs->close(handle));
+	s25fl128->sync();
+
+	return cycle_counter_read() - start;
+}
+
+static void check_records(uint8_t file_id, unsigned int num_records)
+{
+	FileHandle handle;
+	unsigned int actual;
+
+	CHECK_EQUAL(FS_NO_ERROR, fs->open(&handle, file_id, FS_MODE_READONLY, NULL));
+	for (unsigned int i = 0; i < num_records; i++)
+	{
+		produce_record(record, sizeof(record), i);
+		CHECK_EQUAL(FS_NO_ERROR, fs->read(handle, rd_buffer, sizeof(rd_buffer), &actual));
+		MEMCMP_EQUAL(record, rd_buffer, sizeof(record));
+	}
+	CHECK_EQUAL(FS_NO_ERROR, fs->close(handle));
+}
+
+TEST(FileSystemBenchmark, SequentialWriteDeferredBusyWait)
+{
+	const unsigned int num_records = 128;
+	uint32_t blocking, deferred;
+
+	blocking = sequential_write_cycles(0, num_records);
+
+	s25fl128->set_deferred_wait(true);
+	deferred = sequential_write_cycles(1, num_records);
+	s25fl128->set_deferred_wait(false);
+
+	printf("Sequential write of %u KB: %lu cycles blocking, %lu cycles deferred busy wait\n",
+			(unsigned int)(num_records * sizeof(record)) / 1024,
+			(unsigned long)blocking, (unsigned long)deferred);
+	printf("Sequential write throughput: %u KB/s blocking, %u KB/s deferred busy wait\n",
+			cycle_counter_kb_per_s(num_records * sizeof(record), blocking),
+			cycle_counter_kb_per_s(num_records * sizeof(record), deferred));
+
+	check_records(0, num_records);
+	check_records(1, num_records);
+}
+
+TEST(FileSystemBenchmark, FormatBlankDevice)
+{
+	unsigned int num_sectors = s25fl128->get_capacity() / S25FL128_BLOCK_SIZE;
+	uint32_t start, cycles;
+
+	s25fl128->reset_stats();
+	start = cycle_counter_read();
+	CHECK_EQUAL(FS_NO_ERROR, fs->format());
+	cycles = cycle_counter_read() - start;
+
+	printf("Format of a blank device: %lu cycles, %u of %u sector erases skipped\n",
+			(unsigned long)cycles, fs->get_skipped_erases(), num_sectors);
+	CHECK_EQUAL(num_sectors - fs->get_skipped_erases(), s25fl128->get_stats().erase_count);
+}
+
+/* A logger's writes: whole page records with a flush every so often, run
+ * over a number of sectors, after which the file is protected.  Returns
+ * the page programs issued.
+ */
+static unsigned int logged_file_programs(uint8_t file_id, unsigned int num_sectors)
+{
+	const unsigned int num_records = num_sectors * FS_PRIV_USABLE_SIZE / sizeof(record);
+	FileHandle handle;
+	unsigned int actual;
+
+	s25fl128->reset_stats();
+	CHECK_EQUAL(FS_NO_ERROR, fs->open(&handle, file_id, FS_MODE_CREATE, NULL));
+	for (unsigned int i = 0; i < num_records; i++)
+	{
+		CHECK_EQUAL(FS_NO_ERROR, fs->write(handle, record, sizeof(record), &actual));
+		if ((i % 64) == 63)
+			CHECK_EQUAL(FS_NO_ERROR, fs->flush(handle));
+	}
+	CHECK_EQUAL(FS_NO_ERROR, fs->close(handle));
+	CHECK_EQUAL(FS_NO_ERROR, fs->protect(file_id));
+
+	return s25fl128->get_stats().program_count;
+}
+
+TEST(FileSystemBenchmark, ProgramsSavedByWriteCombining)
+{
+	static uint8_t combine[S25FL128_PAGE_SIZE];
+	const unsigned int num_sectors = 4;
+	unsigned int separate, combined;
+
+	separate = logged_file_programs(0, num_sectors);
+	CHECK_EQUAL(SPI_FLASH_NO_ERROR, s25fl128->set_write_combining(combine));
+	combined = logged_file_programs(1, num_sectors);
+	CHECK_EQUAL(SPI_FLASH_NO_ERROR, s25fl128->set_write_combining(NULL));
+
+	/* The session offset closing each full sector and its link to the next
+	 * are programmed together.
+	 */
+	printf("Logged file over %u sectors: %u programs separately, %u combined, %u saved\n",
+			num_sectors, separate, combined, separate - combined);
+	CHECK_EQUAL(num_sectors - 1, separate - combined);
+	CHECK_EQUAL(separate - combined, s25fl128->get_stats().combined_writes);
+}
+
+/* Sector headers looked at to open a file on a freshly mounted file
+ * system.  The host clock only counts the bus, which is the same whatever
+ * the number of sectors, so it is the lookups that show the cost of
+ * finding the file's root and tail.
+ */
+static unsigned int open_lookups(uint8_t file_id, unsigned int mode)
+{
+	FileHandle handle;
+	unsigned int lookups;
+
+	delete fs;
+	fs = new FileSystem<S25FL128>(*s25fl128);
+
+	lookups = fs->get_header_lookups();
+	CHECK_EQUAL(FS_NO_ERROR, fs->open(&handle, file_id, mode, NULL));
+	lookups = fs->get_header_lookups() - lookups;
+	CHECK_EQUAL(FS_NO_ERROR, fs->close(handle));
+
+	return lookups;
+}
+
+TEST(FileSystemBenchmark, OpenLatencyVsAllocatedSectors)
+{
+	static uint8_t bulk[8 * 1024];
+	const unsigned int num_sectors = s25fl128->get_capacity() / S25FL128_BLOCK_SIZE;
+	const unsigned int chain = 4;
+	FileHandle handle;
+	unsigned int actual, first_read, first_append, full_read, full_append;
+
+	CHECK_EQUAL(FS_NO_ERROR, fs->open(&handle, 0, FS_MODE_CREATE, NULL));
+	CHECK_EQUAL(FS_NO_ERROR, fs->close(handle));
+	first_read = open_lookups(0, FS_MODE_READONLY);
+	first_append = open_lookups(0, FS_MODE_WRITEONLY);
+
+	/* Grow the file to a chain of sectors and allocate each remaining
+	 * sector to a file of its own.
+	 */
+	CHECK_EQUAL(FS_NO_ERROR, fs->open(&handle, 0, FS_MODE_WRITEONLY, NULL));
+	for (unsigned int written = 0; written < (chain - 1) * FS_PRIV_USABLE_SIZE + 1; written += actual)
+		CHECK_EQUAL(FS_NO_ERROR, fs->write(handle, bulk, sizeof(bulk), &actual));
+	CHECK_EQUAL(FS_NO_ERROR, fs->close(handle));
+	for (unsigned int i = 1; i <= num_sectors - chain; i++)
+	{
+		CHECK_EQUAL(FS_NO_ERROR, fs->open(&handle, i, FS_MODE_CREATE, NULL));
+		CHECK_EQUAL(FS_NO_ERROR, fs->close(handle));
+	}
+	full_read = open_lookups(0, FS_MODE_READONLY);
+	full_append = open_lookups(0, FS_MODE_WRITEONLY);
+
+	printf("Open with 1 of %u sectors allocated: %u header lookups to read, %u to append; "
+			"with all allocated and a %u sector file: %u to read, %u to append\n",
+			num_sectors, first_read, first_append, chain, full_read, full_append);
+	CHECK_EQUAL(first_read, full_read);
+	CHECK_EQUAL(first_append, full_append);
+	CHECK_EQUAL(first_read, open_lookups(num_sectors - chain, FS_MODE_READONLY));
+}
+
+TEST(FileSystemBenchmark, SessionTableReads)
+{
+	/* Enough records to fill the first sector and continue in a second */
+	const unsigned int num_records = FS_PRIV_USABLE_SIZE / sizeof(record) + 4;
+	unsigned int append_bytes, record_bytes = 0, hop_bytes = 0;
+	FileHandle handle;
+	unsigned int actual;
+
+	sequential_write_cycles(0, num_records);
+
+	s25fl128->reset_stats();
+	CHECK_EQUAL(FS_NO_ERROR, fs->open(&handle, 0, FS_MODE_WRITEONLY, NULL));
+	CHECK_EQUAL(FS_NO_ERROR, fs->close(handle));
+	append_bytes = s25fl128->get_stats().xfer_bytes;
+
+	/* Bus bytes for each record read, including the first one read from
+	 * the second sector.
+	 */
+	CHECK_EQUAL(FS_NO_ERROR, fs->open(&handle, 0, FS_MODE_READONLY, NULL));
+	for (unsigned int i = 0; i < num_records; i++)
+	{
+		s25fl128->reset_stats();
+		CHECK_EQUAL(FS_NO_ERROR, fs->read(handle, rd_buffer, sizeof(rd_buffer), &actual));
+		CHECK_EQUAL(sizeof(rd_buffer), actual);
+		if (i == 0)
+			record_bytes = s25fl128->get_stats().xfer_bytes;
+		else if (i == FS_PRIV_USABLE_SIZE / sizeof(record))
+			hop_bytes = s25fl128->get_stats().xfer_bytes;
+	}
+	CHECK_EQUAL(FS_NO_ERROR, fs->close(handle));
+
+	printf("Open for append: %u bus bytes; record read: %u bus bytes, %u at the sector hop\n",
+			append_bytes, record_bytes, hop_bytes);
+#if FS_PRIV_SESSION_CACHE
+	CHECK_EQUAL(0, append_bytes);
+	CHECK_EQUAL(record_bytes, hop_bytes);
+#endif
+}
+
+TEST(FileSystemBenchmark, SessionTableSearch)
+{
+	const unsigned int num_sessions = 100;
+	const unsigned int session_size = 16;
+	FileHandle handle;
+	unsigned int actual, bytes;
+	uint32_t start, cycles;
+
+	CHECK_EQUAL(FS_NO_ERROR, fs->open(&handle, 0, FS_MODE_CREATE, NULL));
+	for (unsigned int i = 0; i < num_sessions; i++)
+	{
+		produce_record(record, session_size, i);
+		CHECK_EQUAL(FS_NO_ERROR, fs->write(handle, record, session_size, &actual));
+		CHECK_EQUAL(FS_NO_ERROR, fs->flush(handle));
+	}
+	CHECK_EQUAL(FS_NO_ERROR, fs->close(handle));
+
+	/* A fresh mount has to search the session table of the root sector */
+	FileSystem<S25FL128> remounted(*s25fl128);
+	s25fl128->reset_stats();
+	start = cycle_counter_read();
+	CHECK_EQUAL(FS_NO_ERROR, remounted.open(&handle, 0, FS_MODE_READONLY, NULL));
+	cycles = cycle_counter_read() - start;
+	bytes = s25fl128->get_stats().xfer_bytes;
+
+	printf("Session table search by %s with %u of %u sessions used: %lu cycles, %u bus bytes\n",
+#if FS_PRIV_SESSION_SEARCH == FS_PRIV_SESSION_SEARCH_BISECT
+			"bisection",
+#else
+			"bulk scan",
+#endif
+			num_sessions, FS_PRIV_NUM_WRITE_SESSIONS, (unsigned long)cycles, bytes);
+
+	for (unsigned int i = 0; i < num_sessions; i++)
+	{
+		produce_record(record, session_size, i);
+		CHECK_EQUAL(FS_NO_ERROR, remounted.read(handle, rd_buffer, session_size, &actual));
+		CHECK_EQUAL(session_size, actual);
+		MEMCMP_EQUAL(record, rd_buffer, session_size);
+	}
+	CHECK_EQUAL(FS_ERROR_END_OF_FILE, remounted.read(handle, rd_buffer, session_size, &actual));
+	CHECK_EQUAL(FS_NO_ERROR, remounted.close(handle));
+}
+
+static uint32_t tail_read_cycles(FileSystem<S25FL128> &file_system, FileHandle handle,
+		unsigned int offset, unsigned int *bytes)
+{
+	unsigned int actual;
+	uint32_t start, cycles;
+
+	s25fl128->reset_stats();
+	start = cycle_counter_read();
+	CHECK_EQUAL(FS_NO_ERROR, file_system.read_at(handle, offset, rd_buffer, sizeof(rd_buffer), &actual));
+	cycles = cycle_counter_read() - start;
+	*bytes = s25fl128->get_stats().xfer_bytes;
+	CHECK_EQUAL(sizeof(rd_buffer), actual);
+
+	return cycles;
+}
+
+TEST(FileSystemBenchmark, TailReadOfLargeFile)
+{
+	const unsigned int num_records = (10 * 1024 * 1024) / sizeof(record);
+	const unsigned int tail = (num_records - 1) * sizeof(record);
+	unsigned int actual, cold_bytes, warm_bytes, scan_bytes;
+	uint32_t cold, warm, scan, start;
+	FileHandle handle;
+
+	sequential_write_cycles(0, num_records);
+
+	/* A fresh mount knows nothing of the session tables */
+	FileSystem<S25FL128> remounted(*s25fl128);
+	CHECK_EQUAL(FS_NO_ERROR, remounted.open(&handle, 0, FS_MODE_READONLY, NULL));
+	cold = tail_read_cycles(remounted, handle, tail, &cold_bytes);
+	produce_record(record, sizeof(record), num_records - 1);
+	MEMCMP_EQUAL(record, rd_buffer, sizeof(record));
+	warm = tail_read_cycles(remounted, handle, tail, &warm_bytes);
+
+	/* Without random access the whole file has to be read to reach the tail */
+	s25fl128->reset_stats();
+	start = cycle_counter_read();
+	for (unsigned int i = 0; i < num_records; i++)
+		CHECK_EQUAL(FS_NO_ERROR, remounted.read(handle, rd_buffer, sizeof(rd_buffer), &actual));
+	scan = cycle_counter_read() - start;
+	scan_bytes = s25fl128->get_stats().xfer_bytes;
+	MEMCMP_EQUAL(record, rd_buffer, sizeof(record));
+	CHECK_EQUAL(FS_ERROR_END_OF_FILE, remounted.read(handle, rd_buffer, sizeof(rd_buffer), &actual));
+	CHECK_EQUAL(FS_NO_ERROR, remounted.close(handle));
+
+	printf("Tail read of a %u MB file: read_at %lu cycles/%u bus bytes on a fresh mount, "
+			"%lu cycles/%u bus bytes after; sequential %lu cycles/%u bus bytes\n",
+			(unsigned int)(num_records * sizeof(record)) / (1024 * 1024),
+			(unsigned long)cold, cold_bytes, (unsigned long)warm, warm_bytes,
+			(unsigned long)scan, scan_bytes);
+	CHECK(cold_bytes < scan_bytes / 100);
+#if FS_PRIV_SESSION_CACHE
+	CHECK(warm_bytes <= sizeof(rd_buffer) + 8);
+#endif
+}
+
+TEST(FileSystemBenchmark, SeekInFileOfManySectors)
+{
+	static uint8_t bulk[8 * 1024];
+	const unsigned int num_sectors = 32;
+	const unsigned int total = num_sectors * FS_PRIV_USABLE_SIZE;
+	unsigned int actual, mount_bytes, seek_bytes, max_seek_bytes = 0;
+	FileHandle handle;
+
+	for (unsigned int i = 0; i < sizeof(bulk); i++)
+		bulk[i] = (uint8_t)i;
+
+	CHECK_EQUAL(FS_NO_ERROR, fs->open(&handle, 0, FS_MODE_CREATE, NULL));
+	for (unsigned int written = 0; written < total; written += actual)
+		CHECK_EQUAL(FS_NO_ERROR, fs->write(handle, bulk,
+				std::min((unsigned int)sizeof(bulk), total - written), &actual));
+	CHECK_EQUAL(FS_NO_ERROR, fs->close(handle));
+
+	s25fl128->reset_stats();
+	FileSystem<S25FL128> remounted(*s25fl128);
+	mount_bytes = s25fl128->get_stats().xfer_bytes;
+	CHECK_EQUAL(FS_NO_ERROR, remounted.open(&handle, 0, FS_MODE_READONLY, NULL));
+
+	/* Seeking into any sector, the last one included, costs no more than
+	 * one session table search, whether or not session tables are cached.
+	 */
+	for (unsigned int sector = 0; sector < num_sectors; sector++)
+	{
+		s25fl128->reset_stats();
+		CHECK_EQUAL(FS_NO_ERROR, remounted.seek(handle, sector * FS_PRIV_USABLE_SIZE + 100));
+		seek_bytes = s25fl128->get_stats().xfer_bytes;
+		max_seek_bytes = std::max(max_seek_bytes, seek_bytes);
+
+		CHECK_EQUAL(FS_NO_ERROR, remounted.read(handle, rd_buffer, 4, &actual));
+		CHECK_EQUAL(4, actual);
+		CHECK_EQUAL((uint8_t)((sector * FS_PRIV_USABLE_SIZE + 100) % sizeof(bulk)), rd_buffer[0]);
+	}
+	CHECK_EQUAL(FS_NO_ERROR, remounted.seek(handle, total));
+	CHECK_EQUAL(FS_ERROR_END_OF_FILE, remounted.seek(handle, total + 1));
+	CHECK_EQUAL(FS_NO_ERROR, remounted.close(handle));
+
+	printf("Seek in a file of %u sectors: mount %u bus bytes, at most %u bus bytes per seek, session cache %s\n",
+			num_sectors, mount_bytes, max_seek_bytes, FS_PRIV_SESSION_CACHE ? "on" : "off");
+	CHECK(max_seek_bytes <= sizeof(uint32_t) * FS_PRIV_NUM_WRITE_SESSIONS + 8);
+}
+
+/* The SingleFileFillTheFlash workload: 8 KB writes until the device is full */
+TEST(FileSystemBenchmark, FillTheFlash)
+{
+	static uint8_t bulk[8 * 1024];
+	const unsigned int num_sectors = s25fl128->get_capacity() / S25FL128_BLOCK_SIZE;
+	unsigned int actual, total = 0;
+	uint32_t start, cycles;
+	FileHandle handle;
+	int ret;
+
+	for (unsigned int i = 0; i < sizeof(bulk); i++)
+		bulk[i] = (uint8_t)i;
+
+	CHECK_EQUAL(FS_NO_ERROR, fs->open(&handle, 0, FS_MODE_CREATE, NULL));
+	s25fl128->reset_stats();
+	start = cycle_counter_read();
+	do
+	{
+		ret = fs->write(handle, bulk, sizeof(bulk), &actual);
+		total += actual;
+	} while (ret == FS_NO_ERROR);
+	cycles = cycle_counter_read() - start;
+	CHECK_EQUAL(FS_ERROR_FILESYSTEM_FULL, ret);
+	CHECK_EQUAL(num_sectors * FS_PRIV_USABLE_SIZE, total);
+	CHECK_EQUAL(FS_NO_ERROR, fs->close(handle));
+
+	printf("Fill the flash with %u KB writes: %u KB in %lu cycles, %u KB/s, %u page programs\n",
+			(unsigned int)sizeof(bulk) / 1024, total / 1024, (unsigned long)cycles,
+			cycle_counter_kb_per_s(total, cycles), s25fl128->get_stats().program_count);
+}
+
+TEST(FileSystemBenchmark, ReserveCommitVsWrite)
+{
+	const unsigned int record_size = 48;
+	const unsigned int num_records = 1024;
+	unsigned int actual, len, write_copied, reserve_copied;
+	uint32_t start, write_cycles, reserve_cycles;
+	FileHandle handle;
+	uint8_t *buf;
+
+	/* Records formatted into a scratch buffer and copied by write() */
+	CHECK_EQUAL(FS_NO_ERROR, fs->open(&handle, 0, FS_MODE_CREATE, NULL));
+	write_copied = fs->get_copied_bytes();
+	start = cycle_counter_read();
+	for (unsigned int i = 0; i < num_records; i++)
+	{
+		produce_record(record, record_size, i);
+		CHECK_EQUAL(FS_NO_ERROR, fs->write(handle, record, record_size, &actual));
+	}
+	CHECK_EQUAL(FS_NO_ERROR, fs->close(handle));
+	write_cycles = cycle_counter_read() - start;
+	write_copied = fs->get_copied_bytes() - write_copied;
+
+	/* The same records formatted in place in the page cache */
+	CHECK_EQUAL(FS_NO_ERROR, fs->open(&handle, 1, FS_MODE_CREATE, NULL));
+	reserve_copied = fs->get_copied_bytes();
+	start = cycle_counter_read();
+	for (unsigned int i = 0; i < num_records; i++)
+	{
+		CHECK_EQUAL(FS_NO_ERROR, fs->reserve(handle, record_size, &buf, &len));
+		CHECK_EQUAL(record_size, len);
+		produce_record(buf, record_size, i);
+		CHECK_EQUAL(FS_NO_ERROR, fs->commit(handle, len));
+	}
+	CHECK_EQUAL(FS_NO_ERROR, fs->close(handle));
+	reserve_cycles = cycle_counter_read() - start;
+	reserve_copied = fs->get_copied_bytes() - reserve_copied;
+
+	/* Both program the same pages, so the host clock, which only counts
+	 * the bus and the device, cannot tell them apart; what reserve() saves
+	 * is the copy into the page cache, all but the records straddling a
+	 * page boundary.
+	 */
+	printf("%u records of %u bytes: write %lu cycles/%u bytes copied, reserve/commit %lu cycles/%u bytes copied\n",
+			num_records, record_size, (unsigned long)write_cycles, write_copied,
+			(unsigned long)reserve_cycles, reserve_copied);
+	CHECK_EQUAL(num_records * record_size, write_copied);
+	CHECK(reserve_copied < write_copied / 8);
+
+	CHECK_EQUAL(FS_NO_ERROR, fs->open(&handle, 1, FS_MODE_READONLY, NULL));
+	for (unsigned int i = 0; i < num_records; i++)
+	{
+		produce_record(record, record_size, i);
+		CHECK_EQUAL(FS_NO_ERROR, fs->read(handle, rd_buffer, record_size, &actual));
+		MEMCMP_EQUAL(record, rd_buffer, record_size);
+	}
+	CHECK_EQUAL(FS_NO_ERROR, fs->close(handle));
+}
@@ -1,7 +1,9 @@
 #include "CppUTest/TestHarness.h"
 #include "CppUTestExt/MockSupport.h"
 #include "S25FL128.h"
+#include "S25FL512.h"
 #include "FileSystem.h"
+#include <algorithm>
 
 extern "C" {
 	static const nrf_drv_spi_t spi = NRF_DRV_SPI_INSTANCE(0);
@@ -21,7 +23,7 @@ extern "C" {
 }
 
 static S25FL128 *s25fl128;
-static FileSystem *fs;
+static FileSystem<S25FL128> *fs;
 static uint8_t big_buffer[8*1024];
 static uint8_t wr_buffer[1024];
 static uint8_t rd_buffer[1024];
@@ -31,7 +33,7 @@ TEST_GROUP(FileSystem)
 	void setup() {
 		s25fl128 = new S25FL128(spi, spi_config);
 		s25fl128->erase_all();
-		fs = new FileSystem(*s25fl128);
+		fs = new FileSystem<S25FL128>(*s25fl128);
 		for (unsigned int i = 0; i < sizeof(wr_buffer); i++)
 		{
 			wr_buffer[i] = i;
@@ -119,13 +121,57 @@ TEST(FileSystem, ManyFilesExhaustAllSectors)
 
 TEST(FileSystem, OpenTooManyHandles)
 {
-	FileHandle handle;
+	FileHandle handle, writer;
 	const unsigned int max_handles = FS_MAX_HANDLES;
+	const unsigned int max_writers = FS_PRIV_MAX_WRITERS;
 
-	for (unsigned int i = 0; i < max_handles; i++)
-		CHECK_EQUAL(FS_NO_ERROR, fs->open(&handle, i, FS_MODE_CREATE, NULL));
+	/* Writers are limited by the page cache pool */
+	for (unsigned int i = 0; i < max_writers; i++)
+		CHECK_EQUAL(FS_NO_ERROR, fs->open(&writer, i, FS_MODE_CREATE, NULL));
+	CHECK_EQUAL(FS_ERROR_NO_FREE_HANDLE, fs->open(&handle, max_writers, FS_MODE_CREATE, NULL));
+	CHECK_EQUAL(FS_ERROR_FILE_NOT_FOUND, fs->open(&handle, max_writers, FS_MODE_READONLY, NULL));
+
+	/* Readers take up the remaining handles */
+	for (unsigned int i = max_writers; i < max_handles; i++)
+		CHECK_EQUAL(FS_NO_ERROR, fs->open(&handle, i % max_writers, FS_MODE_READONLY, NULL));
+	CHECK_EQUAL(FS_ERROR_NO_FREE_HANDLE, fs->open(&handle, 0, FS_MODE_READONLY, NULL));
+
+	/* A handle returned by a writer can be used by a reader */
+	CHECK_EQUAL(FS_NO_ERROR, fs->close(writer));
+	CHECK_EQUAL(FS_NO_ERROR, fs->open(&writer, max_writers - 1, FS_MODE_READONLY, NULL));
+	CHECK_EQUAL(FS_ERROR_NO_FREE_HANDLE, fs->open(&handle, max_writers - 1, FS_MODE_WRITEONLY, NULL));
+
+	/* And a page cache returned by a writer can be used by a new writer */
+	CHECK_EQUAL(FS_NO_ERROR, fs->close(writer));
+	CHECK_EQUAL(FS_NO_ERROR, fs->open(&writer, max_writers - 1, FS_MODE_WRITEONLY, NULL));
+	CHECK_EQUAL(FS_ERROR_NO_FREE_HANDLE, fs->open(&handle, 0, FS_MODE_READONLY, NULL));
+}
+
+TEST(FileSystem, ReaderFollowsWriter)
+{
+	FileHandle writer, reader;
+	unsigned int actual;
+
+	CHECK_EQUAL(FS_NO_ERROR, fs->open(&writer, 0, FS_MODE_CREATE, NULL));
+	CHECK_EQUAL(FS_NO_ERROR, fs->open(&reader, 0, FS_MODE_READONLY, NULL));
+	CHECK_EQUAL(FS_ERROR_FILE_IN_USE, fs->open(&writer, 0, FS_MODE_WRITEONLY, NULL));
+	CHECK_EQUAL(FS_ERROR_FILE_IN_USE, fs->remove(0));
+
+	/* The reader sees data once the writer has committed it */
+	CHECK_EQUAL(FS_NO_ERROR, fs->write(writer, wr_buffer, 100, &actual));
+	CHECK_EQUAL(FS_ERROR_END_OF_FILE, fs->read(reader, rd_buffer, sizeof(rd_buffer), &actual));
+	CHECK_EQUAL(FS_NO_ERROR, fs->flush(writer));
+	CHECK_EQUAL(FS_NO_ERROR, fs->read(reader, rd_buffer, sizeof(rd_buffer), &actual));
+	CHECK_EQUAL(100, actual);
+
+	CHECK_EQUAL(FS_NO_ERROR, fs->write(writer, &wr_buffer[100], sizeof(wr_buffer) - 100, &actual));
+	CHECK_EQUAL(FS_NO_ERROR, fs->close(writer));
+	CHECK_EQUAL(FS_NO_ERROR, fs->read(reader, &rd_buffer[100], sizeof(rd_buffer), &actual));
+	CHECK_EQUAL(sizeof(wr_buffer) - 100, actual);
+	MEMCMP_EQUAL(wr_buffer, rd_buffer, sizeof(rd_buffer));
 
-	CHECK_EQUAL(FS_ERROR_NO_FREE_HANDLE, fs->open(&handle, max_handles, FS_MODE_CREATE, NULL));
+	CHECK_EQUAL(FS_NO_ERROR, fs->close(reader));
+	CHECK_EQUAL(FS_NO_ERROR, fs->remove(0));
 }
 
 TEST(FileSystem, RemoveFileAndTryToOpenIt)
@@ -148,3 +194,531 @@ TEST(FileSystem, InvalidHandles)
 	CHECK_EQUAL(FS_NO_ERROR, fs->open(&handle, 0, FS_MODE_CREATE, NULL));
 	CHECK_EQUAL(FS_ERROR_INVALID_HANDLE, fs->close((FileHandle)((intptr_t)handle + 1)));
 }
+
+TEST(FileSystem, SectorAddressBeyond16MB)
+{
+	uint8_t sector = 254;
+
+	/* Sector addresses on a 64MB device need more than 24 bits */
+	CHECK_EQUAL(0x3FC0000, FS_PRIV_SECTOR_ADDR(sector + 1));
+}
+
+#if FS_PRIV_MAX_SECTORS > 64
+TEST(FileSystem, FileInSectorBeyond16MB)
+{
+	const uint8_t file_id = (16 * 1024 * 1024) / FS_PRIV_SECTOR_SIZE;
+	FileHandle handle;
+	unsigned int actual;
+
+	delete fs;
+	delete s25fl128;
+
+	{
+		S25FL512 s25fl512(spi, spi_config);
+
+		/* One empty file per sector fills the first 16MB */
+		{
+			FileSystem<S25FL512> fs512(s25fl512);
+
+			for (unsigned int i = 0; i < file_id; i++)
+			{
+				CHECK_EQUAL(FS_NO_ERROR, fs512.open(&handle, i, FS_MODE_CREATE, NULL));
+				CHECK_EQUAL(FS_NO_ERROR, fs512.close(handle));
+			}
+			CHECK_EQUAL(FS_NO_ERROR, fs512.open(&handle, file_id, FS_MODE_CREATE, NULL));
+			CHECK_EQUAL(FS_NO_ERROR, fs512.write(handle, wr_buffer, sizeof(wr_buffer), &actual));
+			CHECK_EQUAL(FS_NO_ERROR, fs512.close(handle));
+		}
+
+		/* The data is above 16MB rather than wrapped onto the first sector */
+		s25fl512.read(FS_PRIV_SECTOR_ADDR(file_id) + FS_PRIV_FILE_DATA_REL_ADDRESS,
+				rd_buffer, sizeof(rd_buffer));
+		MEMCMP_EQUAL(wr_buffer, rd_buffer, sizeof(rd_buffer));
+
+		/* It is found again after a remount */
+		{
+			FileSystem<S25FL512> fs512(s25fl512);
+
+			memset(rd_buffer, 0, sizeof(rd_buffer));
+			CHECK_EQUAL(FS_NO_ERROR, fs512.open(&handle, file_id, FS_MODE_READONLY, NULL));
+			CHECK_EQUAL(FS_NO_ERROR, fs512.read(handle, rd_buffer, sizeof(rd_buffer), &actual));
+			CHECK_EQUAL(sizeof(rd_buffer), actual);
+			MEMCMP_EQUAL(wr_buffer, rd_buffer, sizeof(rd_buffer));
+			CHECK_EQUAL(FS_NO_ERROR, fs512.close(handle));
+			CHECK_EQUAL(FS_NO_ERROR, fs512.open(&handle, 0, FS_MODE_READONLY, NULL));
+			CHECK_EQUAL(FS_ERROR_END_OF_FILE, fs512.read(handle, rd_buffer, sizeof(rd_buffer), &actual));
+			CHECK_EQUAL(FS_NO_ERROR, fs512.close(handle));
+		}
+	}
+
+	s25fl128 = new S25FL128(spi, spi_config);
+	fs = new FileSystem<S25FL128>(*s25fl128);
+}
+#endif
+
+TEST(FileSystem, FormatSkipsBlankSectors)
+{
+	const unsigned int num_sectors = s25fl128->get_capacity() / S25FL128_BLOCK_SIZE;
+	FileHandle handle;
+	unsigned int actual;
+
+	/* A freshly erased device only needs its allocation counters written */
+	s25fl128->reset_stats();
+	CHECK_EQUAL(FS_NO_ERROR, fs->format());
+	CHECK_EQUAL(num_sectors, fs->get_skipped_erases());
+	CHECK_EQUAL(0, s25fl128->get_stats().erase_count);
+
+	/* Only the sector holding file data is erased */
+	CHECK_EQUAL(FS_NO_ERROR, fs->open(&handle, 0, FS_MODE_CREATE, NULL));
+	CHECK_EQUAL(FS_NO_ERROR, fs->write(handle, wr_buffer, sizeof(wr_buffer), &actual));
+	CHECK_EQUAL(FS_NO_ERROR, fs->close(handle));
+	s25fl128->reset_stats();
+	CHECK_EQUAL(FS_NO_ERROR, fs->format());
+	CHECK_EQUAL(2 * num_sectors - 1, fs->get_skipped_erases());
+	CHECK_EQUAL(1, s25fl128->get_stats().erase_count);
+	CHECK_EQUAL(FS_ERROR_FILE_NOT_FOUND, fs->open(&handle, 0, FS_MODE_READONLY, NULL));
+}
+
+TEST(FileSystem, FormatScansSectorWithUnclaimedSessions)
+{
+	const unsigned int num_sectors = s25fl128->get_capacity() / S25FL128_BLOCK_SIZE;
+	const uint32_t sector_addr = FS_PRIV_SECTOR_ADDR(5);
+	uint32_t session = sizeof(wr_buffer);
+
+	/* Sessions and data with no file_id e.g., left by an interrupted erase */
+	CHECK_EQUAL(FS_NO_ERROR, fs->format());
+	s25fl128->write(sector_addr + FS_PRIV_SESSION_OFFSET, (const uint8_t *)&session, sizeof(session));
+	s25fl128->write(sector_addr + FS_PRIV_FILE_DATA_REL_ADDRESS, wr_buffer, sizeof(wr_buffer));
+	delete fs;
+	fs = new FileSystem<S25FL128>(*s25fl128);
+
+	/* Only that sector is erased */
+	s25fl128->reset_stats();
+	CHECK_EQUAL(FS_NO_ERROR, fs->format());
+	CHECK_EQUAL(num_sectors - 1, fs->get_skipped_erases());
+	CHECK_EQUAL(1, s25fl128->get_stats().erase_count);
+	s25fl128->read(sector_addr + FS_PRIV_FILE_DATA_REL_ADDRESS, rd_buffer, sizeof(rd_buffer));
+	for (unsigned int i = 0; i < sizeof(rd_buffer); i++)
+		CHECK_EQUAL(0xFF, rd_buffer[i]);
+}
+
+TEST(FileSystem, FormatErasesDataBehindBlankHeader)
+{
+	const unsigned int num_sectors = s25fl128->get_capacity() / S25FL128_BLOCK_SIZE;
+	const uint32_t sector_addr = FS_PRIV_SECTOR_ADDR(7);
+
+	/* Data with an unused header and session table e.g., written by
+	 * another layout.
+	 */
+	CHECK_EQUAL(FS_NO_ERROR, fs->format());
+	s25fl128->write(sector_addr + FS_PRIV_SECTOR_SIZE - sizeof(wr_buffer), wr_buffer, sizeof(wr_buffer));
+	delete fs;
+	fs = new FileSystem<S25FL128>(*s25fl128);
+
+	s25fl128->reset_stats();
+	CHECK_EQUAL(FS_NO_ERROR, fs->format());
+	CHECK_EQUAL(num_sectors - 1, fs->get_skipped_erases());
+	CHECK_EQUAL(1, s25fl128->get_stats().erase_count);
+	s25fl128->read(sector_addr + FS_PRIV_SECTOR_SIZE - sizeof(rd_buffer), rd_buffer, sizeof(rd_buffer));
+	for (unsigned int i = 0; i < sizeof(rd_buffer); i++)
+		CHECK_EQUAL(0xFF, rd_buffer[i]);
+}
+
+TEST(FileSystem, FileReadableThroughBaseClass)
+{
+	FileHandle handle;
+	unsigned int actual;
+
+	CHECK_EQUAL(FS_NO_ERROR, fs->open(&handle, 0, FS_MODE_CREATE, NULL));
+	CHECK_EQUAL(FS_NO_ERROR, fs->write(handle, wr_buffer, sizeof(wr_buffer), &actual));
+	CHECK_EQUAL(FS_NO_ERROR, fs->close(handle));
+
+	/* The same device mounted with virtual dispatch sees the same file */
+	FileSystem<SpiFlash> base_fs(*s25fl128);
+	CHECK_EQUAL(FS_NO_ERROR, base_fs.open(&handle, 0, FS_MODE_READONLY, NULL));
+	CHECK_EQUAL(FS_NO_ERROR, base_fs.read(handle, rd_buffer, sizeof(rd_buffer), &actual));
+	CHECK_EQUAL(sizeof(rd_buffer), actual);
+	MEMCMP_EQUAL(wr_buffer, rd_buffer, sizeof(rd_buffer));
+	CHECK_EQUAL(FS_NO_ERROR, base_fs.close(handle));
+}
+
+/* Fails writes to the session table of the first sector when asked to */
+class SessionWriteFailFlash : public S25FL128
+{
+public:
+	bool fail;
+
+	SessionWriteFailFlash(const nrf_drv_spi_t &spi, const nrf_drv_spi_config_t &spi_config) :
+		S25FL128(spi, spi_config), fail(false)
+	{
+	}
+
+	int write(unsigned int addr, const uint8_t *data, unsigned int sz)
+	{
+		if (fail && addr >= FS_PRIV_SESSION_OFFSET && addr < FS_PRIV_ALLOC_UNIT_SIZE)
+			return SPI_FLASH_ERROR_TIMEOUT;
+		return S25FL128::write(addr, data, sz);
+	}
+};
+
+TEST(FileSystem, FullSectorNotLeftUncommitted)
+{
+	FileHandle handle;
+	unsigned int actual, len, total = 0;
+	uint8_t *buf;
+
+	delete fs;
+	fs = NULL;
+	delete s25fl128;
+	s25fl128 = NULL;
+
+	{
+		SessionWriteFailFlash flash(spi, spi_config);
+		FileSystem<SpiFlash> failing_fs(flash);
+
+		CHECK_EQUAL(FS_NO_ERROR, failing_fs.open(&handle, 0, FS_MODE_CREATE, NULL));
+		for (; total < FS_PRIV_USABLE_SIZE; total += actual)
+			CHECK_EQUAL(FS_NO_ERROR, failing_fs.write(handle, big_buffer,
+					std::min((unsigned int)sizeof(big_buffer), FS_PRIV_USABLE_SIZE - total), &actual));
+
+		/* The writer stays in the full sector until its session is committed */
+		flash.fail = true;
+		CHECK_EQUAL(FS_ERROR_FLASH_MEDIA, failing_fs.write(handle, wr_buffer, 1, &actual));
+		CHECK_EQUAL(0, actual);
+		CHECK_EQUAL(FS_ERROR_FLASH_MEDIA, failing_fs.reserve(handle, 1, &buf, &len));
+		CHECK_EQUAL(0, len);
+
+		flash.fail = false;
+		CHECK_EQUAL(FS_NO_ERROR, failing_fs.write(handle, wr_buffer, 1, &actual));
+		CHECK_EQUAL(1, actual);
+		CHECK_EQUAL(FS_NO_ERROR, failing_fs.close(handle));
+	}
+
+	s25fl128 = new S25FL128(spi, spi_config);
+	fs = new FileSystem<S25FL128>(*s25fl128);
+	CHECK_EQUAL(FS_NO_ERROR, fs->open(&handle, 0, FS_MODE_READONLY, NULL));
+	CHECK_EQUAL(FS_NO_ERROR, fs->read_at(handle, total, rd_buffer, sizeof(rd_buffer), &actual));
+	CHECK_EQUAL(1, actual);
+	CHECK_EQUAL(wr_buffer[0], rd_buffer[0]);
+	CHECK_EQUAL(FS_NO_ERROR, fs->close(handle));
+}
+
+TEST(FileSystem, SessionsCommittedWithWriteCombining)
+{
+	static uint8_t combine[S25FL128_PAGE_SIZE];
+	FileHandle handle;
+	unsigned int actual;
+
+	CHECK_EQUAL(SPI_FLASH_NO_ERROR, s25fl128->set_write_combining(combine));
+	CHECK_EQUAL(FS_NO_ERROR, fs->open(&handle, 0, FS_MODE_CREATE, NULL));
+	for (unsigned int i = 0; i < sizeof(wr_buffer); i += 16)
+	{
+		CHECK_EQUAL(FS_NO_ERROR, fs->write(handle, &wr_buffer[i], 16, &actual));
+		CHECK_EQUAL(FS_NO_ERROR, fs->flush(handle));
+	}
+	CHECK_EQUAL(FS_NO_ERROR, fs->close(handle));
+	CHECK_EQUAL(FS_NO_ERROR, fs->protect(0));
+
+	/* Nothing is left pending once the file system has committed it */
+	s25fl128->reset_stats();
+	CHECK_EQUAL(SPI_FLASH_NO_ERROR, s25fl128->write_barrier());
+	CHECK_EQUAL(0, s25fl128->get_stats().program_count);
+
+	delete fs;
+	fs = new FileSystem<S25FL128>(*s25fl128);
+	CHECK_EQUAL(FS_ERROR_FILE_PROTECTED, fs->open(&handle, 0, FS_MODE_WRITEONLY, NULL));
+	CHECK_EQUAL(FS_NO_ERROR, fs->open(&handle, 0, FS_MODE_READONLY, NULL));
+	CHECK_EQUAL(FS_NO_ERROR, fs->read(handle, rd_buffer, sizeof(rd_buffer), &actual));
+	CHECK_EQUAL(sizeof(rd_buffer), actual);
+	MEMCMP_EQUAL(wr_buffer, rd_buffer, sizeof(rd_buffer));
+	CHECK_EQUAL(FS_NO_ERROR, fs->close(handle));
+}
+
+TEST(FileSystem, FileIndexFollowsChainsAcrossRemount)
+{
+	FileHandle handle;
+	unsigned int actual, total = 0;
+
+	/* File 1 spans two sectors with file 2 allocated in between */
+	CHECK_EQUAL(FS_NO_ERROR, fs->open(&handle, 1, FS_MODE_CREATE, NULL));
+	CHECK_EQUAL(FS_NO_ERROR, fs->close(handle));
+	CHECK_EQUAL(FS_NO_ERROR, fs->open(&handle, 2, FS_MODE_CREATE, NULL));
+	CHECK_EQUAL(FS_NO_ERROR, fs->close(handle));
+	CHECK_EQUAL(FS_NO_ERROR, fs->open(&handle, 1, FS_MODE_WRITEONLY, NULL));
+	while (total < FS_PRIV_USABLE_SIZE + sizeof(big_buffer))
+	{
+		CHECK_EQUAL(FS_NO_ERROR, fs->write(handle, big_buffer, sizeof(big_buffer), &actual));
+		total += actual;
+	}
+	CHECK_EQUAL(FS_NO_ERROR, fs->close(handle));
+
+	/* Appending after a remount continues from the last sector */
+	delete fs;
+	fs = new FileSystem<S25FL128>(*s25fl128);
+	CHECK_EQUAL(FS_NO_ERROR, fs->open(&handle, 1, FS_MODE_WRITEONLY, NULL));
+	CHECK_EQUAL(FS_NO_ERROR, fs->write(handle, wr_buffer, sizeof(wr_buffer), &actual));
+	CHECK_EQUAL(FS_NO_ERROR, fs->close(handle));
+
+	CHECK_EQUAL(FS_NO_ERROR, fs->open(&handle, 1, FS_MODE_READONLY, NULL));
+	for (unsigned int i = 0; i < total; i += actual)
+		CHECK_EQUAL(FS_NO_ERROR, fs->read(handle, big_buffer, sizeof(big_buffer), &actual));
+	CHECK_EQUAL(FS_NO_ERROR, fs->read(handle, rd_buffer, sizeof(rd_buffer), &actual));
+	CHECK_EQUAL(sizeof(wr_buffer), actual);
+	MEMCMP_EQUAL(wr_buffer, rd_buffer, sizeof(rd_buffer));
+	CHECK_EQUAL(FS_NO_ERROR, fs->close(handle));
+
+	/* Removing a file frees all of its sectors and leaves the others */
+	CHECK_EQUAL(FS_NO_ERROR, fs->remove(1));
+	CHECK_EQUAL(FS_ERROR_FILE_NOT_FOUND, fs->open(&handle, 1, FS_MODE_READONLY, NULL));
+	CHECK_EQUAL(FS_NO_ERROR, fs->open(&handle, 2, FS_MODE_READONLY, NULL));
+	CHECK_EQUAL(FS_NO_ERROR, fs->close(handle));
+	CHECK_EQUAL(FS_ERROR_FILE_NOT_FOUND, fs->remove(FS_FILE_ID_NONE));
+}
+
+/* File contents that identify their own position */
+static void fill_position(uint8_t *buf, unsigned int sz, unsigned int pos)
+{
+	for (unsigned int i = 0; i < sz; i++)
+		buf[i] = (uint8_t)((pos + i) ^ ((pos + i) >> 10));
+}
+
+TEST(FileSystem, ReadAcrossSectorBoundary)
+{
+	FileHandle handle;
+	unsigned int actual, total = 0;
+
+	CHECK_EQUAL(FS_NO_ERROR, fs->open(&handle, 0, FS_MODE_CREATE, NULL));
+	while (total < FS_PRIV_USABLE_SIZE + sizeof(wr_buffer))
+	{
+		fill_position(wr_buffer, sizeof(wr_buffer), total);
+		CHECK_EQUAL(FS_NO_ERROR, fs->write(handle, wr_buffer, sizeof(wr_buffer), &actual));
+		total += actual;
+	}
+	CHECK_EQUAL(FS_NO_ERROR, fs->close(handle));
+
+	/* The read that straddles the two sectors must fill the whole buffer */
+	CHECK_EQUAL(FS_NO_ERROR, fs->open(&handle, 0, FS_MODE_READONLY, NULL));
+	for (unsigned int pos = 0; pos < total; pos += actual)
+	{
+		CHECK_EQUAL(FS_NO_ERROR, fs->read(handle, rd_buffer, sizeof(rd_buffer), &actual));
+		CHECK_EQUAL(sizeof(rd_buffer), actual);
+		fill_position(wr_buffer, actual, pos);
+		MEMCMP_EQUAL(wr_buffer, rd_buffer, actual);
+	}
+	CHECK_EQUAL(FS_NO_ERROR, fs->close(handle));
+}
+
+TEST(FileSystem, SeekAndReadAt)
+{
+	FileHandle handle;
+	unsigned int actual, total = 0;
+
+	/* A file spanning two sectors */
+	CHECK_EQUAL(FS_NO_ERROR, fs->open(&handle, 0, FS_MODE_CREATE, NULL));
+	CHECK_EQUAL(FS_ERROR_INVALID_MODE, fs->seek(handle, 0));
+	CHECK_EQUAL(FS_ERROR_INVALID_MODE, fs->read_at(handle, 0, rd_buffer, sizeof(rd_buffer), &actual));
+	while (total < FS_PRIV_USABLE_SIZE + 4 * sizeof(wr_buffer))
+	{
+		fill_position(wr_buffer, sizeof(wr_buffer), total);
+		CHECK_EQUAL(FS_NO_ERROR, fs->write(handle, wr_buffer, sizeof(wr_buffer), &actual));
+		total += actual;
+	}
+	CHECK_EQUAL(FS_NO_ERROR, fs->close(handle));
+
+	delete fs;
+	fs = new FileSystem<S25FL128>(*s25fl128);
+	CHECK_EQUAL(FS_NO_ERROR, fs->open(&handle, 0, FS_MODE_READONLY, NULL));
+
+	/* Reads spanning the sector boundary and in the last sector */
+	CHECK_EQUAL(FS_NO_ERROR, fs->read_at(handle, FS_PRIV_USABLE_SIZE - 100, rd_buffer, sizeof(rd_buffer), &actual));
+	CHECK_EQUAL(sizeof(rd_buffer), actual);
+	fill_position(wr_buffer, sizeof(wr_buffer), FS_PRIV_USABLE_SIZE - 100);
+	MEMCMP_EQUAL(wr_buffer, rd_buffer, sizeof(rd_buffer));
+	CHECK_EQUAL(FS_NO_ERROR, fs->read_at(handle, total - 10, rd_buffer, sizeof(rd_buffer), &actual));
+	CHECK_EQUAL(10, actual);
+	fill_position(wr_buffer, 10, total - 10);
+	MEMCMP_EQUAL(wr_buffer, rd_buffer, 10);
+
+	/* read_at() leaves the read position at the start of file */
+	CHECK_EQUAL(FS_NO_ERROR, fs->read(handle, rd_buffer, sizeof(rd_buffer), &actual));
+	fill_position(wr_buffer, sizeof(wr_buffer), 0);
+	MEMCMP_EQUAL(wr_buffer, rd_buffer, sizeof(rd_buffer));
+
+	/* seek() moves it */
+	CHECK_EQUAL(FS_NO_ERROR, fs->seek(handle, FS_PRIV_USABLE_SIZE + 8));
+	CHECK_EQUAL(FS_NO_ERROR, fs->read(handle, rd_buffer, sizeof(rd_buffer), &actual));
+	fill_position(wr_buffer, sizeof(wr_buffer), FS_PRIV_USABLE_SIZE + 8);
+	MEMCMP_EQUAL(wr_buffer, rd_buffer, sizeof(rd_buffer));
+
+	/* The end of file can be sought but nothing beyond it */
+	CHECK_EQUAL(FS_NO_ERROR, fs->seek(handle, total));
+	CHECK_EQUAL(FS_ERROR_END_OF_FILE, fs->read(handle, rd_buffer, sizeof(rd_buffer), &actual));
+	CHECK_EQUAL(FS_ERROR_END_OF_FILE, fs->seek(handle, total + 1));
+	CHECK_EQUAL(FS_ERROR_END_OF_FILE, fs->read_at(handle, total + 1, rd_buffer, sizeof(rd_buffer), &actual));
+	CHECK_EQUAL(FS_NO_ERROR, fs->close(handle));
+}
+
+TEST(FileSystem, SeekPastSectorOutOfSessions)
+{
+	const unsigned int session_size = 16;
+	FileHandle handle;
+	unsigned int actual, total = 0;
+
+	/* The first sector runs out of sessions long before it is full */
+	CHECK_EQUAL(FS_NO_ERROR, fs->open(&handle, 0, FS_MODE_CREATE, NULL));
+	for (unsigned int i = 0; i < FS_PRIV_NUM_WRITE_SESSIONS; i++, total += actual)
+	{
+		fill_position(wr_buffer, session_size, total);
+		CHECK_EQUAL(FS_NO_ERROR, fs->write(handle, wr_buffer, session_size, &actual));
+		CHECK_EQUAL(FS_NO_ERROR, fs->flush(handle));
+	}
+	fill_position(wr_buffer, sizeof(wr_buffer), total);
+	CHECK_EQUAL(FS_NO_ERROR, fs->write(handle, wr_buffer, sizeof(wr_buffer), &actual));
+	total += actual;
+	CHECK_EQUAL(FS_NO_ERROR, fs->close(handle));
+
+	/* Before and after a remount */
+	for (unsigned int pass = 0; pass < 2; pass++)
+	{
+		CHECK_EQUAL(FS_NO_ERROR, fs->open(&handle, 0, FS_MODE_READONLY, NULL));
+		CHECK_EQUAL(FS_NO_ERROR, fs->read_at(handle, total - sizeof(wr_buffer) - 8, rd_buffer, sizeof(rd_buffer), &actual));
+		CHECK_EQUAL(sizeof(rd_buffer), actual);
+		fill_position(wr_buffer, sizeof(wr_buffer), total - sizeof(wr_buffer) - 8);
+		MEMCMP_EQUAL(wr_buffer, rd_buffer, sizeof(rd_buffer));
+		CHECK_EQUAL(FS_NO_ERROR, fs->seek(handle, total));
+		CHECK_EQUAL(FS_ERROR_END_OF_FILE, fs->seek(handle, total + 1));
+		CHECK_EQUAL(FS_NO_ERROR, fs->close(handle));
+
+		delete fs;
+		fs = new FileSystem<S25FL128>(*s25fl128);
+	}
+}
+
+TEST(FileSystem, ReaderFollowsCircularWriter)
+{
+	const unsigned int num_sectors = s25fl128->get_capacity() / S25FL128_BLOCK_SIZE;
+	FileHandle writer, reader;
+	unsigned int actual, pos, total = 0;
+
+	/* Leave two sectors for the circular file */
+	for (unsigned int i = 1; i < num_sectors - 1; i++)
+	{
+		CHECK_EQUAL(FS_NO_ERROR, fs->open(&writer, i, FS_MODE_CREATE, NULL));
+		CHECK_EQUAL(FS_NO_ERROR, fs->close(writer));
+	}
+
+	CHECK_EQUAL(FS_NO_ERROR, fs->open(&writer, 0, FS_MODE_CREATE_CIRCULAR, NULL));
+	for (; total < 4 * sizeof(wr_buffer); total += actual)
+	{
+		fill_position(wr_buffer, sizeof(wr_buffer), total);
+		CHECK_EQUAL(FS_NO_ERROR, fs->write(writer, wr_buffer, sizeof(wr_buffer), &actual));
+	}
+	CHECK_EQUAL(FS_NO_ERROR, fs->flush(writer));
+
+	CHECK_EQUAL(FS_NO_ERROR, fs->open(&reader, 0, FS_MODE_READONLY, NULL));
+	CHECK_EQUAL(FS_NO_ERROR, fs->read(reader, rd_buffer, sizeof(rd_buffer), &actual));
+	fill_position(wr_buffer, sizeof(wr_buffer), 0);
+	MEMCMP_EQUAL(wr_buffer, rd_buffer, sizeof(rd_buffer));
+
+	/* Fill both sectors and wrap around into the first */
+	for (; total < 2 * FS_PRIV_USABLE_SIZE + 4 * sizeof(wr_buffer); total += actual)
+	{
+		fill_position(wr_buffer, sizeof(wr_buffer), total);
+		CHECK_EQUAL(FS_NO_ERROR, fs->write(writer, wr_buffer, sizeof(wr_buffer), &actual));
+	}
+	CHECK_EQUAL(FS_NO_ERROR, fs->flush(writer));
+
+	/* The reader's sector was recycled so it carries on from the oldest
+	 * data left, at the start of the second sector.
+	 */
+	for (pos = FS_PRIV_USABLE_SIZE; pos < total; pos += actual)
+	{
+		CHECK_EQUAL(FS_NO_ERROR, fs->read(reader, rd_buffer, sizeof(rd_buffer), &actual));
+		CHECK(actual > 0);
+		fill_position(wr_buffer, actual, pos);
+		MEMCMP_EQUAL(wr_buffer, rd_buffer, actual);
+	}
+	CHECK_EQUAL(FS_ERROR_END_OF_FILE, fs->read(reader, rd_buffer, sizeof(rd_buffer), &actual));
+
+	CHECK_EQUAL(FS_NO_ERROR, fs->close(reader));
+	CHECK_EQUAL(FS_NO_ERROR, fs->close(writer));
+}
+
+TEST(FileSystem, AlignedWritesBypassPageCache)
+{
+	FileHandle handle;
+	unsigned int actual, total = 0;
+
+	/* An unaligned start leaves the first bulk write to fill the cached
+	 * page before whole pages can bypass the cache, up to the end of the
+	 * first sector and on into the second.
+	 */
+	CHECK_EQUAL(FS_NO_ERROR, fs->open(&handle, 0, FS_MODE_CREATE, NULL));
+	fill_position(big_buffer, 412, total);
+	CHECK_EQUAL(FS_NO_ERROR, fs->write(handle, big_buffer, 412, &actual));
+	total += actual;
+	while (total < FS_PRIV_USABLE_SIZE + sizeof(big_buffer))
+	{
+		fill_position(big_buffer, sizeof(big_buffer), total);
+		CHECK_EQUAL(FS_NO_ERROR, fs->write(handle, big_buffer, sizeof(big_buffer), &actual));
+		CHECK_EQUAL(sizeof(big_buffer), actual);
+		total += actual;
+	}
+	CHECK_EQUAL(FS_NO_ERROR, fs->close(handle));
+
+	CHECK_EQUAL(FS_NO_ERROR, fs->open(&handle, 0, FS_MODE_READONLY, NULL));
+	for (unsigned int pos = 0; pos < total; pos += actual)
+	{
+		CHECK_EQUAL(FS_NO_ERROR, fs->read(handle, rd_buffer, sizeof(rd_buffer), &actual));
+		fill_position(wr_buffer, actual, pos);
+		MEMCMP_EQUAL(wr_buffer, rd_buffer, actual);
+	}
+	CHECK_EQUAL(FS_ERROR_END_OF_FILE, fs->read(handle, rd_buffer, sizeof(rd_buffer), &actual));
+	CHECK_EQUAL(FS_NO_ERROR, fs->close(handle));
+}
+
+TEST(FileSystem, ReserveAndCommitRecords)
+{
+	const unsigned int record_size = 48;
+	FileHandle handle;
+	unsigned int actual, len, total = 0;
+	uint8_t *buf;
+
+	CHECK_EQUAL(FS_NO_ERROR, fs->open(&handle, 0, FS_MODE_CREATE, NULL));
+	CHECK_EQUAL(FS_ERROR_INVALID_COMMIT, fs->commit(handle, 1));
+
+	/* Records straddle page boundaries whole; only the end of the sector
+	 * splits a reservation.
+	 */
+	while (total < FS_PRIV_USABLE_SIZE + sizeof(wr_buffer))
+	{
+		CHECK_EQUAL(FS_NO_ERROR, fs->reserve(handle, record_size, &buf, &len));
+		if (len < record_size)
+			CHECK_EQUAL(FS_PRIV_USABLE_SIZE, total + len);
+		fill_position(buf, len, total);
+		CHECK_EQUAL(FS_NO_ERROR, fs->commit(handle, len));
+		total += len;
+	}
+
+	/* A reservation is committed at most once and is lost to any write */
+	CHECK_EQUAL(FS_NO_ERROR, fs->reserve(handle, record_size, &buf, &len));
+	CHECK_EQUAL(FS_ERROR_INVALID_COMMIT, fs->commit(handle, len + 1));
+	CHECK_EQUAL(FS_ERROR_INVALID_COMMIT, fs->commit(handle, len));
+	CHECK_EQUAL(FS_NO_ERROR, fs->reserve(handle, record_size, &buf, &len));
+	fill_position(wr_buffer, 10, total);
+	CHECK_EQUAL(FS_NO_ERROR, fs->write(handle, wr_buffer, 10, &actual));
+	total += actual;
+	CHECK_EQUAL(FS_ERROR_INVALID_COMMIT, fs->commit(handle, len));
+	CHECK_EQUAL(FS_NO_ERROR, fs->close(handle));
+
+	CHECK_EQUAL(FS_NO_ERROR, fs->open(&handle, 0, FS_MODE_READONLY, NULL));
+	CHECK_EQUAL(FS_ERROR_INVALID_MODE, fs->reserve(handle, record_size, &buf, &len));
+	for (unsigned int pos = 0; pos < total; pos += actual)
+	{
+		CHECK_EQUAL(FS_NO_ERROR, fs->read(handle, rd_buffer, sizeof(rd_buffer), &actual));
+		fill_position(wr_buffer, actual, pos);
+		MEMCMP_EQUAL(wr_buffer, rd_buffer, actual);
+	}
+	CHECK_EQUAL(FS_ERROR_END_OF_FILE, fs->read(handle, rd_buffer, sizeof(rd_buffer), &actual));
+	CHECK_EQUAL(FS_NO_ERROR, fs->close(handle));
+}
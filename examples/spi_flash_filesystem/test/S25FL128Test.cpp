@@ -1,6 +1,8 @@
 #include "CppUTest/TestHarness.h"
 #include "CppUTestExt/MockSupport.h"
 #include "S25FL128.h"
+#include "S25FL512.h"
+#include "nrf_delay.h"
 
 extern "C" {
 	static const nrf_drv_spi_t spi = NRF_DRV_SPI_INSTANCE(0);
@@ -102,3 +104,785 @@ TEST(SpiFlash, WriteBlockEraseWithReadBack)
 		s25fl128->read(i*S25FL128_PAGE_SIZE, rd_buffer, S25FL128_PAGE_SIZE);
 		CHECK_EQUAL(0xFF, rd_buffer[0]);
 }
+
+TEST(SpiFlash, StreamingReadMultiPage)
+{
+	static uint8_t rd_stream[4 * S25FL128_PAGE_SIZE];
+	const unsigned int sz = sizeof(rd_stream) - 1;
+
+	for (unsigned int i = 0; i < 4; i++)
+		s25fl128->write(i*S25FL128_PAGE_SIZE, wr_buffer, S25FL128_PAGE_SIZE);
+
+	/* Unaligned read spanning several DMA transfers */
+	s25fl128->reset_stats();
+	s25fl128->read(1, rd_stream, sz);
+	for (unsigned int i = 0; i < sz; i++)
+		CHECK_EQUAL((uint8_t)(i + 1), rd_stream[i]);
+
+	/* One command header followed by back-to-back data transfers */
+	CHECK_EQUAL(1, s25fl128->get_stats().cmd_count);
+	CHECK_EQUAL(1 + (sz + SPI_FLASH_MAX_XFER_SIZE - 1) / SPI_FLASH_MAX_XFER_SIZE,
+			s25fl128->get_stats().xfer_count);
+}
+
+static volatile unsigned int async_done;
+static int async_result[4];
+static unsigned int async_order[4];
+static unsigned int async_count;
+
+static void async_callback(int result, void *context)
+{
+	async_result[(intptr_t)context] = result;
+	async_order[async_count++ % 4] = (intptr_t)context;
+	async_done |= 1 << (intptr_t)context;
+}
+
+TEST(SpiFlash, AsyncWriteReadErase)
+{
+	async_done = 0;
+	async_count = 0;
+	for (unsigned int i = 0; i < 4; i++)
+		async_result[i] = 1;
+	CHECK_EQUAL(SPI_FLASH_NO_ERROR, s25fl128->write_async(0, wr_buffer, S25FL128_PAGE_SIZE, async_callback, (void *)0));
+	CHECK_EQUAL(SPI_FLASH_NO_ERROR, s25fl128->read_async(0, rd_buffer, S25FL128_PAGE_SIZE, async_callback, (void *)1));
+	while (async_done != 0x3);
+	CHECK_EQUAL(SPI_FLASH_NO_ERROR, async_result[0]);
+	CHECK_EQUAL(SPI_FLASH_NO_ERROR, async_result[1]);
+	MEMCMP_EQUAL(wr_buffer, rd_buffer, S25FL128_PAGE_SIZE);
+
+	/* A read of the block being erased can't be served by suspending the
+	 * erase, so commands complete in the order they were queued.
+	 */
+	CHECK_EQUAL(SPI_FLASH_NO_ERROR, s25fl128->erase_async(0, async_callback, (void *)2));
+	CHECK_EQUAL(SPI_FLASH_NO_ERROR, s25fl128->read_async(0, rd_buffer, S25FL128_PAGE_SIZE, async_callback, (void *)3));
+	while (async_done != 0xF);
+	CHECK_EQUAL(SPI_FLASH_NO_ERROR, async_result[2]);
+	CHECK_EQUAL(SPI_FLASH_NO_ERROR, async_result[3]);
+	CHECK_EQUAL(4, async_count);
+	for (unsigned int i = 0; i < 4; i++)
+		CHECK_EQUAL(i, async_order[i]);
+	CHECK_FALSE(s25fl128->is_busy());
+	CHECK_EQUAL(0xFF, rd_buffer[0]);
+	CHECK_EQUAL(0xFF, rd_buffer[S25FL128_PAGE_SIZE - 1]);
+}
+
+TEST(SpiFlash, WriteStraddlingPageBoundaryWithReadBack)
+{
+	s25fl128->reset_stats();
+	s25fl128->write(100, wr_buffer, S25FL128_PAGE_SIZE);
+	CHECK_EQUAL(2, s25fl128->get_stats().program_count);
+	s25fl128->read(100, rd_buffer, S25FL128_PAGE_SIZE);
+	MEMCMP_EQUAL(wr_buffer, rd_buffer, S25FL128_PAGE_SIZE);
+}
+
+/* Stand-in device descriptor whose legacy READ is rated below the bus
+ * clock so that the Fast Read command must be chosen instead.
+ */
+static const spi_flash_op_desc_t slow_read_ops[] =
+{
+	{ S25FL128_READ,      1, 1, 0,   2000000 },
+	{ S25FL128_FAST_READ, 1, 1, 8, 133000000 },
+};
+
+static const spi_flash_caps_t slow_read_caps =
+{
+	slow_read_ops, sizeof(slow_read_ops) / sizeof(slow_read_ops[0]),
+	NULL, 0,
+	NULL, 0,
+	NULL,
+	133000000
+};
+
+class SlowReadFlash : public S25FL128
+{
+public:
+	SlowReadFlash(const nrf_drv_spi_t &spi, const nrf_drv_spi_config_t &spi_config) :
+		S25FL128(spi, spi_config)
+	{
+		set_caps(slow_read_caps);
+	}
+};
+
+TEST(SpiFlash, CapabilitySelectsLegacyCommandsAt4MHz)
+{
+	CHECK_EQUAL(S25FL128_READ, s25fl128->get_read_op().opcode);
+	CHECK_EQUAL(S25FL128_PP, s25fl128->get_program_op().opcode);
+}
+
+TEST(SpiFlash, CapabilitySelectsFastestReadForBus)
+{
+	const spi_flash_caps_t &caps = s25fl128->get_caps();
+
+	CHECK_EQUAL(S25FL128_FAST_READ, SpiFlash::select_op(caps.read_ops, caps.num_read_ops,
+			1, 80000000, S25FL128_PAGE_SIZE)->opcode);
+	CHECK_EQUAL(S25FL128_DIOR, SpiFlash::select_op(caps.read_ops, caps.num_read_ops,
+			2, 80000000, S25FL128_PAGE_SIZE)->opcode);
+	CHECK_EQUAL(S25FL128_QIOR, SpiFlash::select_op(caps.read_ops, caps.num_read_ops,
+			4, 80000000, S25FL128_PAGE_SIZE)->opcode);
+	CHECK(NULL == SpiFlash::select_op(caps.read_ops, caps.num_read_ops,
+			1, 200000000, S25FL128_PAGE_SIZE));
+}
+
+TEST(SpiFlash, FastReadWithReadBack)
+{
+	s25fl128->write(100, wr_buffer, S25FL128_PAGE_SIZE);
+	delete s25fl128;
+
+	{
+		SlowReadFlash flash(spi, spi_config);
+		CHECK_EQUAL(S25FL128_FAST_READ, flash.get_read_op().opcode);
+		flash.read(100, rd_buffer, S25FL128_PAGE_SIZE);
+		MEMCMP_EQUAL(wr_buffer, rd_buffer, S25FL128_PAGE_SIZE);
+	}
+
+	s25fl128 = new S25FL128(spi, spi_config);
+}
+
+/* Stand-in for a hybrid sector part with 4KB parameter sectors in the
+ * bottom 128KB, 64KB and 256KB block erase and chip erase.
+ */
+static const spi_flash_erase_desc_t hybrid_erase_ops[] =
+{
+	{ S25FL128_BE, 0,                   0, 0 },
+	{ S25FL128_SE, S25FL128_BLOCK_SIZE, 0, 0 },
+	{ 0xD9,        0x10000,             0, 0 },
+	{ 0x20,        0x1000,              0, 0x20000 },
+};
+
+static const spi_flash_caps_t hybrid_caps =
+{
+	NULL, 0,
+	NULL, 0,
+	hybrid_erase_ops, sizeof(hybrid_erase_ops) / sizeof(hybrid_erase_ops[0]),
+	NULL,
+	133000000
+};
+
+class HybridSectorFlash : public S25FL128
+{
+public:
+	HybridSectorFlash(const nrf_drv_spi_t &spi, const nrf_drv_spi_config_t &spi_config) :
+		S25FL128(spi, spi_config)
+	{
+		set_caps(hybrid_caps);
+	}
+};
+
+TEST(SpiFlash, EraseRangeWithReadBack)
+{
+	unsigned int num_ops;
+	uint32_t rd;
+
+	for (unsigned int i = 0; i < 3; i++)
+		s25fl128->write(i*S25FL128_BLOCK_SIZE, wr_buffer, S25FL128_PAGE_SIZE);
+
+	/* Only whole 256KB sectors may be erased on this device */
+	CHECK_EQUAL(SPI_FLASH_ERROR_INVALID_RANGE, s25fl128->erase_range(S25FL128_BLOCK_SIZE, 0x1000, &num_ops));
+	CHECK_EQUAL(SPI_FLASH_ERROR_INVALID_RANGE, s25fl128->erase_range(s25fl128->get_capacity(), S25FL128_BLOCK_SIZE, &num_ops));
+
+	s25fl128->reset_stats();
+	CHECK_EQUAL(SPI_FLASH_NO_ERROR, s25fl128->erase_range(S25FL128_BLOCK_SIZE, 2*S25FL128_BLOCK_SIZE, &num_ops));
+	CHECK_EQUAL(2, num_ops);
+	CHECK_EQUAL(2, s25fl128->get_stats().erase_count);
+
+	s25fl128->read(0, (uint8_t *)&rd, 4);
+	CHECK_EQUAL(0x03020100, rd);
+	s25fl128->read(S25FL128_BLOCK_SIZE, (uint8_t *)&rd, 4);
+	CHECK_EQUAL(0xFFFFFFFF, rd);
+	s25fl128->read(2*S25FL128_BLOCK_SIZE, (uint8_t *)&rd, 4);
+	CHECK_EQUAL(0xFFFFFFFF, rd);
+
+	/* The whole device is a single chip erase */
+	CHECK_EQUAL(SPI_FLASH_NO_ERROR, s25fl128->plan_erase_range(0, s25fl128->get_capacity(), &num_ops));
+	CHECK_EQUAL(1, num_ops);
+}
+
+TEST(SpiFlash, EraseRangePlanUsesCheapestMix)
+{
+	unsigned int num_ops;
+
+	delete s25fl128;
+
+	{
+		HybridSectorFlash flash(spi, spi_config);
+
+		/* 15 x 4KB, then 64KB blocks up to the 256KB boundary and one more */
+		CHECK_EQUAL(SPI_FLASH_NO_ERROR, flash.plan_erase_range(0x1000, 0x4F000, &num_ops));
+		CHECK_EQUAL(15 + 3 + 1, num_ops);
+
+		/* A whole 256KB block */
+		CHECK_EQUAL(SPI_FLASH_NO_ERROR, flash.plan_erase_range(S25FL128_BLOCK_SIZE, S25FL128_BLOCK_SIZE, &num_ops));
+		CHECK_EQUAL(1, num_ops);
+
+		/* 4KB sectors only exist in the parameter region */
+		CHECK_EQUAL(SPI_FLASH_ERROR_INVALID_RANGE, flash.plan_erase_range(S25FL128_BLOCK_SIZE, 0x1000, &num_ops));
+	}
+
+	s25fl128 = new S25FL128(spi, spi_config);
+}
+
+TEST(SpiFlash, ReadDuringEraseSuspendsErase)
+{
+	uint32_t rd;
+
+	s25fl128->write(0, wr_buffer, S25FL128_PAGE_SIZE);
+	s25fl128->write(S25FL128_BLOCK_SIZE, wr_buffer, S25FL128_PAGE_SIZE);
+	s25fl128->reset_stats();
+
+	/* A read outside the sector being erased is served straight away */
+	async_done = 0;
+	CHECK_EQUAL(SPI_FLASH_NO_ERROR, s25fl128->erase_async(0, async_callback, (void *)0));
+	s25fl128->read(S25FL128_BLOCK_SIZE, rd_buffer, S25FL128_PAGE_SIZE);
+	CHECK_EQUAL(0, async_done);
+	MEMCMP_EQUAL(wr_buffer, rd_buffer, S25FL128_PAGE_SIZE);
+	CHECK_EQUAL(1, s25fl128->get_stats().suspend_count);
+
+	/* The erase resumes and completes afterwards */
+	while (async_done != 0x1);
+	CHECK_EQUAL(SPI_FLASH_NO_ERROR, async_result[0]);
+	s25fl128->read(0, (uint8_t *)&rd, 4);
+	CHECK_EQUAL(0xFFFFFFFF, rd);
+
+	/* A read of the sector being erased waits for the erase instead */
+	s25fl128->write(0, wr_buffer, S25FL128_PAGE_SIZE);
+	async_done = 0;
+	CHECK_EQUAL(SPI_FLASH_NO_ERROR, s25fl128->erase_async(0, async_callback, (void *)0));
+	s25fl128->read(0, (uint8_t *)&rd, 4);
+	CHECK_EQUAL(0x1, async_done);
+	CHECK_EQUAL(0xFFFFFFFF, rd);
+	CHECK_EQUAL(1, s25fl128->get_stats().suspend_count);
+}
+
+TEST(SpiFlash, ReadOfPageBeingProgrammedWaits)
+{
+	uint32_t rd;
+
+	s25fl128->reset_stats();
+
+	/* No part of a page may be read whilst its program is suspended, so a
+	 * read of the bytes before the ones programmed waits too.
+	 */
+	async_done = 0;
+	CHECK_EQUAL(SPI_FLASH_NO_ERROR, s25fl128->erase_async(S25FL128_BLOCK_SIZE, async_callback, (void *)0));
+	CHECK_EQUAL(SPI_FLASH_NO_ERROR, s25fl128->write_async(S25FL128_PAGE_SIZE / 2, wr_buffer,
+			S25FL128_PAGE_SIZE / 2, async_callback, (void *)1));
+	s25fl128->read(0, (uint8_t *)&rd, 4);
+	CHECK_EQUAL(0x3, async_done);
+	CHECK_EQUAL(0xFFFFFFFF, rd);
+	CHECK_EQUAL(0, s25fl128->get_stats().suspend_count);
+}
+
+TEST(SpiFlash, ReadDuringDeferredEraseSuspendsErase)
+{
+	uint32_t rd;
+
+	s25fl128->write(0, wr_buffer, S25FL128_PAGE_SIZE);
+	s25fl128->write(S25FL128_BLOCK_SIZE, wr_buffer, S25FL128_PAGE_SIZE);
+	s25fl128->set_deferred_wait(true);
+	s25fl128->reset_stats();
+
+	/* The erase completes as soon as it is issued and a read of another
+	 * sector suspends it rather than waiting for it to finish.
+	 */
+	async_done = 0;
+	CHECK_EQUAL(SPI_FLASH_NO_ERROR, s25fl128->erase_async(0, async_callback, (void *)0));
+	while (async_done != 0x1);
+	s25fl128->read(S25FL128_BLOCK_SIZE, rd_buffer, S25FL128_PAGE_SIZE);
+	MEMCMP_EQUAL(wr_buffer, rd_buffer, S25FL128_PAGE_SIZE);
+	CHECK_EQUAL(1, s25fl128->get_stats().suspend_count);
+
+	/* A read of the sector being erased resumes and waits for it */
+	s25fl128->read(0, (uint8_t *)&rd, 4);
+	CHECK_EQUAL(0xFFFFFFFF, rd);
+	CHECK_EQUAL(1, s25fl128->get_stats().suspend_count);
+	s25fl128->set_deferred_wait(false);
+}
+
+static void write_from_callback(int result, void *context)
+{
+	async_callback(result, context);
+	s25fl128->write_async(2 * S25FL128_BLOCK_SIZE, wr_buffer, S25FL128_PAGE_SIZE,
+			async_callback, (void *)2);
+}
+
+TEST(SpiFlash, WriteFromCallbackDuringEraseSuspend)
+{
+	uint32_t rd;
+
+	s25fl128->write(0, wr_buffer, S25FL128_PAGE_SIZE);
+	s25fl128->erase_block(2 * S25FL128_BLOCK_SIZE);
+	s25fl128->reset_stats();
+
+	/* The read is served whilst the erase is suspended and its callback
+	 * queues a write, which must wait for the erase to be resumed.
+	 */
+	async_done = 0;
+	async_count = 0;
+	CHECK_EQUAL(SPI_FLASH_NO_ERROR, s25fl128->erase_async(0, async_callback, (void *)0));
+	CHECK_EQUAL(SPI_FLASH_NO_ERROR, s25fl128->read_async(S25FL128_BLOCK_SIZE, rd_buffer,
+			S25FL128_PAGE_SIZE, write_from_callback, (void *)1));
+	while (async_done != 0x7);
+	CHECK_EQUAL(1, s25fl128->get_stats().suspend_count);
+	CHECK_EQUAL(SPI_FLASH_NO_ERROR, async_result[0]);
+	CHECK_EQUAL(SPI_FLASH_NO_ERROR, async_result[1]);
+	CHECK_EQUAL(SPI_FLASH_NO_ERROR, async_result[2]);
+	CHECK_EQUAL(1, async_order[0]);
+	CHECK_EQUAL(0, async_order[1]);
+	CHECK_EQUAL(2, async_order[2]);
+
+	s25fl128->read(0, (uint8_t *)&rd, 4);
+	CHECK_EQUAL(0xFFFFFFFF, rd);
+	s25fl128->read(2 * S25FL128_BLOCK_SIZE, rd_buffer, S25FL128_PAGE_SIZE);
+	MEMCMP_EQUAL(wr_buffer, rd_buffer, S25FL128_PAGE_SIZE);
+}
+
+TEST(SpiFlash, PollingPoliciesWithReadBack)
+{
+	static const spi_flash_poll_policy_t policies[] =
+	{
+		{ SPI_FLASH_POLL_FIXED,   100, 100,  0 },
+		{ SPI_FLASH_POLL_BACKOFF, 20,  1000, 0 },
+	};
+
+	for (unsigned int i = 0; i < sizeof(policies) / sizeof(policies[0]); i++)
+	{
+		spi_flash_poll_type_t type = policies[i].type;
+
+		CHECK_EQUAL(SPI_FLASH_NO_ERROR, s25fl128->set_poll_policy(policies[i]));
+		s25fl128->reset_stats();
+
+		CHECK_EQUAL(SPI_FLASH_NO_ERROR, s25fl128->write(0, wr_buffer, S25FL128_PAGE_SIZE));
+		s25fl128->read(0, rd_buffer, S25FL128_PAGE_SIZE);
+		MEMCMP_EQUAL(wr_buffer, rd_buffer, S25FL128_PAGE_SIZE);
+
+		CHECK_EQUAL(SPI_FLASH_NO_ERROR, s25fl128->erase_block(0));
+		s25fl128->read(0, rd_buffer, S25FL128_PAGE_SIZE);
+		for (unsigned int j = 0; j < S25FL128_PAGE_SIZE; j++)
+			CHECK_EQUAL(0xFF, rd_buffer[j]);
+
+		/* Only the configured policy's counters move */
+		CHECK(s25fl128->get_stats().poll[type].poll_count > 0);
+		CHECK(s25fl128->get_stats().poll[type].wait_us > 0);
+		CHECK_EQUAL(0, s25fl128->get_stats().poll[type].timeout_count);
+		CHECK_EQUAL(0, s25fl128->get_stats().poll[SPI_FLASH_POLL_CONTINUOUS].poll_count);
+	}
+}
+
+TEST(SpiFlash, PollTimeoutReturnsError)
+{
+	spi_flash_poll_policy_t policy = { SPI_FLASH_POLL_FIXED, 10, 10, 100 };
+	uint32_t rd;
+
+	/* A sector erase takes far longer than the timeout */
+	s25fl128->write(0, wr_buffer, S25FL128_PAGE_SIZE);
+	CHECK_EQUAL(SPI_FLASH_NO_ERROR, s25fl128->set_poll_policy(policy));
+	s25fl128->reset_stats();
+	CHECK_EQUAL(SPI_FLASH_ERROR_TIMEOUT, s25fl128->erase_block(0));
+	CHECK_EQUAL(1, s25fl128->get_stats().poll[SPI_FLASH_POLL_FIXED].timeout_count);
+
+	/* Waiting without a timeout sees the erase through */
+	policy.timeout_us = 0;
+	CHECK_EQUAL(SPI_FLASH_NO_ERROR, s25fl128->set_poll_policy(policy));
+	CHECK_EQUAL(SPI_FLASH_NO_ERROR, s25fl128->sync());
+	s25fl128->read(0, (uint8_t *)&rd, 4);
+	CHECK_EQUAL(0xFFFFFFFF, rd);
+}
+
+TEST(SpiFlash, DeferredPollTimeoutReportedBySync)
+{
+	spi_flash_poll_policy_t policy = { SPI_FLASH_POLL_FIXED, 10, 10, 100 };
+	uint32_t rd;
+
+	s25fl128->write(0, wr_buffer, S25FL128_PAGE_SIZE);
+	s25fl128->set_deferred_wait(true);
+	CHECK_EQUAL(SPI_FLASH_NO_ERROR, s25fl128->set_poll_policy(policy));
+	s25fl128->reset_stats();
+
+	/* The erase has already completed when its wait times out, so the
+	 * timeout is reported by the next sync() and only by that one.
+	 */
+	CHECK_EQUAL(SPI_FLASH_NO_ERROR, s25fl128->erase_block(0));
+	CHECK_EQUAL(SPI_FLASH_ERROR_TIMEOUT, s25fl128->sync());
+	CHECK_EQUAL(1, s25fl128->get_stats().poll[SPI_FLASH_POLL_FIXED].timeout_count);
+	CHECK_EQUAL(SPI_FLASH_NO_ERROR, s25fl128->sync());
+
+	/* Give the erase its datasheet maximum before reading it back */
+	nrf_delay_ms(2600);
+	s25fl128->set_deferred_wait(false);
+	s25fl128->read(0, (uint8_t *)&rd, 4);
+	CHECK_EQUAL(0xFFFFFFFF, rd);
+}
+
+/* The S25FL128S also accepts the 4-byte address commands, so it stands in
+ * for a part larger than 16MB here.
+ */
+static const spi_flash_op_desc_t four_byte_read_ops[] =
+{
+	{ S25FL512_4READ,      1, 1, 0,  50000000 },
+	{ S25FL512_4FAST_READ, 1, 1, 8, 133000000 },
+};
+
+static const spi_flash_op_desc_t four_byte_program_ops[] =
+{
+	{ S25FL512_4PP,        1, 1, 0, 133000000 },
+};
+
+static const spi_flash_erase_desc_t four_byte_erase_ops[] =
+{
+	{ S25FL512_BE,  0,                   0, 0 },
+	{ S25FL512_4SE, S25FL128_BLOCK_SIZE, 0, 0 },
+};
+
+static const spi_flash_caps_t four_byte_caps =
+{
+	four_byte_read_ops, sizeof(four_byte_read_ops) / sizeof(four_byte_read_ops[0]),
+	four_byte_program_ops, sizeof(four_byte_program_ops) / sizeof(four_byte_program_ops[0]),
+	four_byte_erase_ops, sizeof(four_byte_erase_ops) / sizeof(four_byte_erase_ops[0]),
+	NULL,
+	133000000
+};
+
+/* A part that only describes its read and program commands */
+static const spi_flash_caps_t four_byte_no_erase_table_caps =
+{
+	four_byte_read_ops, sizeof(four_byte_read_ops) / sizeof(four_byte_read_ops[0]),
+	four_byte_program_ops, sizeof(four_byte_program_ops) / sizeof(four_byte_program_ops[0]),
+	NULL, 0,
+	NULL,
+	133000000
+};
+
+class FourByteAddressFlash : public S25FL128
+{
+public:
+	FourByteAddressFlash(const nrf_drv_spi_t &spi, const nrf_drv_spi_config_t &spi_config,
+			const spi_flash_caps_t &caps = four_byte_caps) :
+		S25FL128(spi, spi_config)
+	{
+		addr_bytes = 4;
+		set_caps(caps);
+	}
+};
+
+TEST(SpiFlash, FourByteAddressWithReadBack)
+{
+	delete s25fl128;
+
+	{
+		FourByteAddressFlash flash(spi, spi_config);
+		unsigned int addr = S25FL128_BLOCK_SIZE + 100;
+
+		CHECK_EQUAL(S25FL512_4READ, flash.get_read_op().opcode);
+		CHECK_EQUAL(S25FL512_4PP, flash.get_program_op().opcode);
+
+		CHECK_EQUAL(SPI_FLASH_NO_ERROR, flash.write(addr, wr_buffer, S25FL128_PAGE_SIZE));
+		flash.read(addr, rd_buffer, S25FL128_PAGE_SIZE);
+		MEMCMP_EQUAL(wr_buffer, rd_buffer, S25FL128_PAGE_SIZE);
+
+		CHECK_EQUAL(SPI_FLASH_NO_ERROR, flash.erase_block(S25FL128_BLOCK_SIZE));
+		flash.read(addr, rd_buffer, S25FL128_PAGE_SIZE);
+		for (unsigned int i = 0; i < S25FL128_PAGE_SIZE; i++)
+			CHECK_EQUAL(0xFF, rd_buffer[i]);
+	}
+
+	s25fl128 = new S25FL128(spi, spi_config);
+}
+
+TEST(SpiFlash, FourByteAddressEraseRangeWithoutEraseTable)
+{
+	delete s25fl128;
+
+	{
+		FourByteAddressFlash flash(spi, spi_config, four_byte_no_erase_table_caps);
+		unsigned int num_ops;
+
+		CHECK_EQUAL(SPI_FLASH_NO_ERROR, flash.write(100, wr_buffer, S25FL128_PAGE_SIZE));
+		CHECK_EQUAL(SPI_FLASH_NO_ERROR, flash.write(S25FL128_BLOCK_SIZE + 100, wr_buffer, S25FL128_PAGE_SIZE));
+
+		/* Only the second block goes, erased with the 4-byte address command */
+		CHECK_EQUAL(SPI_FLASH_NO_ERROR, flash.erase_range(S25FL128_BLOCK_SIZE, S25FL128_BLOCK_SIZE, &num_ops));
+		CHECK_EQUAL(1, num_ops);
+		flash.read(S25FL128_BLOCK_SIZE + 100, rd_buffer, S25FL128_PAGE_SIZE);
+		for (unsigned int i = 0; i < S25FL128_PAGE_SIZE; i++)
+			CHECK_EQUAL(0xFF, rd_buffer[i]);
+		flash.read(100, rd_buffer, S25FL128_PAGE_SIZE);
+		MEMCMP_EQUAL(wr_buffer, rd_buffer, S25FL128_PAGE_SIZE);
+	}
+
+	s25fl128 = new S25FL128(spi, spi_config);
+}
+
+TEST(SpiFlash, S25FL512UsesFourByteAddressCommands)
+{
+	delete s25fl128;
+
+	{
+		S25FL512 flash(spi, spi_config);
+		CHECK_EQUAL(64 * 1024 * 1024, flash.get_capacity());
+		CHECK_EQUAL(S25FL512_4READ, flash.get_read_op().opcode);
+		CHECK_EQUAL(S25FL512_4PP, flash.get_program_op().opcode);
+	}
+
+	s25fl128 = new S25FL128(spi, spi_config);
+}
+
+TEST(SpiFlash, GeometryMatchesDevice)
+{
+	CHECK_EQUAL(S25FL128::Geometry::capacity, s25fl128->get_capacity());
+	CHECK_EQUAL(S25FL128::Geometry::block_size, s25fl128->get_block_size());
+	CHECK_EQUAL(S25FL128::Geometry::page_size, s25fl128->get_page_size());
+}
+
+TEST(SpiFlash, BlankCheck)
+{
+	bool blank;
+
+	CHECK_EQUAL(SPI_FLASH_NO_ERROR, s25fl128->is_blank(0, S25FL128_BLOCK_SIZE, &blank));
+	CHECK_TRUE(blank);
+
+	/* A single programmed bit in an odd trailing byte is found */
+	wr_buffer[0] = 0xFE;
+	s25fl128->write(S25FL128_PAGE_SIZE + 6, wr_buffer, 1);
+	CHECK_EQUAL(SPI_FLASH_NO_ERROR, s25fl128->is_blank(S25FL128_PAGE_SIZE, 7, &blank));
+	CHECK_FALSE(blank);
+	CHECK_EQUAL(SPI_FLASH_NO_ERROR, s25fl128->is_blank(S25FL128_PAGE_SIZE, 6, &blank));
+	CHECK_TRUE(blank);
+	CHECK_EQUAL(SPI_FLASH_NO_ERROR, s25fl128->is_blank(0, S25FL128_BLOCK_SIZE, &blank));
+	CHECK_FALSE(blank);
+
+	CHECK_EQUAL(SPI_FLASH_ERROR_INVALID_RANGE, s25fl128->is_blank(s25fl128->get_capacity(), 1, &blank));
+}
+
+TEST(SpiFlash, ReadCacheServesPartialPageReads)
+{
+	static uint8_t cache[2 * S25FL128_PAGE_SIZE];
+	uint32_t rd;
+
+	s25fl128->write(0, wr_buffer, S25FL128_PAGE_SIZE);
+	CHECK_EQUAL(SPI_FLASH_NO_ERROR, s25fl128->set_read_cache(cache, 2));
+	s25fl128->reset_stats();
+
+	/* The first read loads the page and the rest need no bus commands */
+	for (unsigned int i = 0; i < S25FL128_PAGE_SIZE; i += sizeof(rd))
+	{
+		s25fl128->read(i, (uint8_t *)&rd, sizeof(rd));
+		MEMCMP_EQUAL(&wr_buffer[i], &rd, sizeof(rd));
+	}
+	CHECK_EQUAL(1, s25fl128->get_stats().read_cache_misses);
+	CHECK_EQUAL(S25FL128_PAGE_SIZE / sizeof(rd) - 1, s25fl128->get_stats().read_cache_hits);
+	CHECK_EQUAL(1, s25fl128->get_stats().cmd_count);
+
+	/* Whole pages bypass the cache */
+	s25fl128->reset_stats();
+	s25fl128->read(S25FL128_PAGE_SIZE, rd_buffer, S25FL128_PAGE_SIZE);
+	CHECK_EQUAL(0, s25fl128->get_stats().read_cache_misses);
+	CHECK_EQUAL(0, s25fl128->get_stats().read_cache_hits);
+
+	CHECK_EQUAL(SPI_FLASH_ERROR_INVALID_RANGE,
+			s25fl128->set_read_cache(cache, SPI_FLASH_READ_CACHE_MAX_PAGES + 1));
+}
+
+TEST(SpiFlash, ReadCacheEvictsLeastRecentlyUsed)
+{
+	static uint8_t cache[2 * S25FL128_PAGE_SIZE];
+	uint8_t rd;
+
+	CHECK_EQUAL(SPI_FLASH_NO_ERROR, s25fl128->set_read_cache(cache, 2));
+	s25fl128->reset_stats();
+
+	/* Pages 0 and 1 are loaded, page 0 is used again so page 2 evicts 1 */
+	s25fl128->read(0, &rd, 1);
+	s25fl128->read(S25FL128_PAGE_SIZE, &rd, 1);
+	s25fl128->read(1, &rd, 1);
+	s25fl128->read(2 * S25FL128_PAGE_SIZE, &rd, 1);
+	CHECK_EQUAL(3, s25fl128->get_stats().read_cache_misses);
+	s25fl128->read(2, &rd, 1);
+	CHECK_EQUAL(2, s25fl128->get_stats().read_cache_hits);
+	s25fl128->read(S25FL128_PAGE_SIZE + 1, &rd, 1);
+	CHECK_EQUAL(4, s25fl128->get_stats().read_cache_misses);
+}
+
+TEST(SpiFlash, ReadCacheInvalidatedByProgramAndErase)
+{
+	static uint8_t cache[2 * S25FL128_PAGE_SIZE];
+	uint32_t rd = 0;
+	uint32_t wr = 0x12345678;
+
+	CHECK_EQUAL(SPI_FLASH_NO_ERROR, s25fl128->set_read_cache(cache, 2));
+	s25fl128->read(0, (uint8_t *)&rd, sizeof(rd));
+	CHECK_EQUAL(0xFFFFFFFF, rd);
+
+	s25fl128->write(4, (uint8_t *)&wr, sizeof(wr));
+	s25fl128->read(4, (uint8_t *)&rd, sizeof(rd));
+	CHECK_EQUAL(wr, rd);
+
+	s25fl128->erase_block(0);
+	s25fl128->read(4, (uint8_t *)&rd, sizeof(rd));
+	CHECK_EQUAL(0xFFFFFFFF, rd);
+
+	s25fl128->write(4, (uint8_t *)&wr, sizeof(wr));
+	s25fl128->read(4, (uint8_t *)&rd, sizeof(rd));
+	s25fl128->erase_all();
+	s25fl128->read(4, (uint8_t *)&rd, sizeof(rd));
+	CHECK_EQUAL(0xFFFFFFFF, rd);
+	CHECK_EQUAL(5, s25fl128->get_stats().read_cache_misses);
+}
+
+TEST(SpiFlash, WriteCombiningMergesSamePageWrites)
+{
+	static uint8_t combine[S25FL128_PAGE_SIZE];
+	uint32_t wr = 0x12345678;
+	uint8_t protect = 0xFE;
+
+	CHECK_EQUAL(SPI_FLASH_NO_ERROR, s25fl128->set_write_combining(combine));
+	s25fl128->reset_stats();
+
+	/* Header fields written one at a time are programmed together */
+	s25fl128->write(0, wr_buffer, 4);
+	s25fl128->write(8, (uint8_t *)&wr, sizeof(wr));
+	s25fl128->write(1, &protect, 1);
+	s25fl128->write(4, wr_buffer, 4);
+	CHECK_EQUAL(0, s25fl128->get_stats().program_count);
+	CHECK_EQUAL(3, s25fl128->get_stats().combined_writes);
+
+	/* An overlapping read sees the combined writes */
+	s25fl128->read(0, rd_buffer, 12);
+	CHECK_EQUAL(1, s25fl128->get_stats().program_count);
+	CHECK_EQUAL(wr_buffer[0], rd_buffer[0]);
+	CHECK_EQUAL(wr_buffer[1] & protect, rd_buffer[1]);
+	MEMCMP_EQUAL(&wr_buffer[2], &rd_buffer[2], 2);
+	MEMCMP_EQUAL(wr_buffer, &rd_buffer[4], 4);
+	MEMCMP_EQUAL(&wr, &rd_buffer[8], sizeof(wr));
+
+	/* A write to another page issues the pending program first */
+	s25fl128->write(16, wr_buffer, 4);
+	s25fl128->write(S25FL128_PAGE_SIZE, wr_buffer, 4);
+	CHECK_EQUAL(2, s25fl128->get_stats().program_count);
+	CHECK_EQUAL(SPI_FLASH_NO_ERROR, s25fl128->write_barrier());
+	CHECK_EQUAL(3, s25fl128->get_stats().program_count);
+	CHECK_EQUAL(SPI_FLASH_NO_ERROR, s25fl128->write_barrier());
+	CHECK_EQUAL(3, s25fl128->get_stats().program_count);
+
+	s25fl128->read(S25FL128_PAGE_SIZE, rd_buffer, 4);
+	MEMCMP_EQUAL(wr_buffer, rd_buffer, 4);
+}
+
+static void read_from_callback(int result, void *context)
+{
+	async_callback(result, context);
+	s25fl128->read_async(0, rd_buffer, 4, async_callback, (void *)1);
+}
+
+TEST(SpiFlash, WriteCombiningOrderedBeforeAsyncFromCallback)
+{
+	static uint8_t combine[S25FL128_PAGE_SIZE];
+
+	CHECK_EQUAL(SPI_FLASH_NO_ERROR, s25fl128->set_write_combining(combine));
+	s25fl128->reset_stats();
+
+	/* The write is combined whilst the erase is in progress.  The
+	 * callback's read of the pending page cannot wait for the pending
+	 * program so it is queued ahead of the read instead.
+	 */
+	async_done = 0;
+	async_count = 0;
+	CHECK_EQUAL(SPI_FLASH_NO_ERROR, s25fl128->erase_async(S25FL128_BLOCK_SIZE,
+			read_from_callback, (void *)0));
+	s25fl128->write(0, wr_buffer, 4);
+	while (async_done != 0x3);
+	CHECK_EQUAL(SPI_FLASH_NO_ERROR, async_result[1]);
+	CHECK_EQUAL(1, s25fl128->get_stats().program_count);
+	MEMCMP_EQUAL(wr_buffer, rd_buffer, 4);
+
+	/* The buffer is free for the next page once the program is done */
+	s25fl128->write(S25FL128_PAGE_SIZE, wr_buffer, 4);
+	CHECK_EQUAL(SPI_FLASH_NO_ERROR, s25fl128->sync());
+	CHECK_EQUAL(2, s25fl128->get_stats().program_count);
+	s25fl128->read(S25FL128_PAGE_SIZE, rd_buffer, 4);
+	MEMCMP_EQUAL(wr_buffer, rd_buffer, 4);
+	CHECK_EQUAL(SPI_FLASH_NO_ERROR, s25fl128->set_write_combining(NULL));
+}
+
+static volatile unsigned int chase_addr;
+static volatile bool chase_idle;
+static unsigned int chase_reads;
+static uint8_t chase_buffer[4];
+
+static void chase_read_done(int result, void *context)
+{
+	chase_reads++;
+	chase_idle = true;
+}
+
+/* Reads the page being combined from interrupt context, which queues
+ * whatever is pending of it.
+ */
+static void chase_callback(int result, void *context)
+{
+	if (s25fl128->read_async(chase_addr, chase_buffer, sizeof(chase_buffer),
+			chase_read_done, NULL))
+		chase_idle = true;
+}
+
+TEST(SpiFlash, WriteCombiningWhilstCallbacksIssueReads)
+{
+	static uint8_t combine[S25FL128_PAGE_SIZE];
+	const unsigned int num_pages = 16;
+
+	CHECK_EQUAL(SPI_FLASH_NO_ERROR, s25fl128->set_write_combining(combine));
+	s25fl128->reset_stats();
+	chase_idle = true;
+	chase_reads = 0;
+
+	/* Every byte merged into the pending page must be programmed, however
+	 * the callbacks' reads fall between the writes.
+	 */
+	for (unsigned int page = 0; page < num_pages; page++)
+	{
+		chase_addr = page * S25FL128_PAGE_SIZE;
+		for (unsigned int offset = 0; offset < S25FL128_PAGE_SIZE; offset += 4)
+		{
+			if (chase_idle)
+			{
+				chase_idle = false;
+				CHECK_EQUAL(SPI_FLASH_NO_ERROR, s25fl128->read_async(S25FL128_BLOCK_SIZE,
+						chase_buffer, sizeof(chase_buffer), chase_callback, NULL));
+			}
+			s25fl128->write(chase_addr + offset, &wr_buffer[offset], 4);
+		}
+	}
+	while (!chase_idle);
+	CHECK_EQUAL(SPI_FLASH_NO_ERROR, s25fl128->set_write_combining(NULL));
+	CHECK(s25fl128->get_stats().program_count > num_pages);
+
+	for (unsigned int page = 0; page < num_pages; page++)
+	{
+		s25fl128->read(page * S25FL128_PAGE_SIZE, rd_buffer, S25FL128_PAGE_SIZE);
+		MEMCMP_EQUAL(wr_buffer, rd_buffer, S25FL128_PAGE_SIZE);
+	}
+}
+
+TEST(SpiFlash, WriteCombiningDroppedByErase)
+{
+	static uint8_t combine[S25FL128_PAGE_SIZE];
+	uint32_t rd = 0;
+
+	CHECK_EQUAL(SPI_FLASH_NO_ERROR, s25fl128->set_write_combining(combine));
+	s25fl128->reset_stats();
+
+	/* An erase of the page makes the pending program redundant */
+	s25fl128->write(0, wr_buffer, 4);
+	s25fl128->erase_block(0);
+	CHECK_EQUAL(0, s25fl128->get_stats().program_count);
+	s25fl128->read(0, (uint8_t *)&rd, sizeof(rd));
+	CHECK_EQUAL(0xFFFFFFFF, rd);
+
+	/* An erase elsewhere is ordered after it */
+	s25fl128->write(0, wr_buffer, 4);
+	s25fl128->erase_block(S25FL128_BLOCK_SIZE);
+	CHECK_EQUAL(1, s25fl128->get_stats().program_count);
+
+	CHECK_EQUAL(SPI_FLASH_NO_ERROR, s25fl128->set_write_combining(NULL));
+	s25fl128->write(4, wr_buffer, 4);
+	CHECK_EQUAL(2, s25fl128->get_stats().program_count);
+}
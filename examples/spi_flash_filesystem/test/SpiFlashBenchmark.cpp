@@ -0,0 +1,314 @@
+#include "CppUTest/TestHarness.h"
+#include "S25FL128.h"
+#include "StripedSpiFlash.h"
+#include "SpiFlashStandIn.h"
+#include "cycle_counter.h"
+
+extern "C" {
+#include <stdio.h>
+#include <string.h>
+
+	static const nrf_drv_spi_t spi = NRF_DRV_SPI_INSTANCE(0);
+
+	static nrf_drv_spi_config_t spi_config =
+	{
+		    .sck_pin      = SPI_SCK_PIN,
+		    .mosi_pin     = SPI_MOSI_PIN,
+		    .miso_pin     = SPI_MISO_PIN,
+		    .ss_pin       = SPI_SS_PIN,
+		    .irq_priority = SPI_DEFAULT_CONFIG_IRQ_PRIORITY,
+		    .orc          = 0xFF,
+		    .frequency    = NRF_DRV_SPI_FREQ_4M,
+		    .mode         = NRF_DRV_SPI_MODE_0,
+		    .bit_order    = NRF_DRV_SPI_BIT_ORDER_MSB_FIRST,
+	};
+}
+
+static S25FL128 *s25fl128;
+static uint8_t wr_buffer[S25FL128_PAGE_SIZE];
+static uint8_t rd_buffer[S25FL128_PAGE_SIZE];
+static volatile bool erase_done;
+static volatile bool read_done;
+static unsigned int read_done_bytes;
+
+static void erase_callback(int result, void *context)
+{
+	erase_done = true;
+}
+
+static void read_callback(int result, void *context)
+{
+	read_done_bytes = s25fl128->get_stats().xfer_bytes;
+	read_done = true;
+}
+
+/* Bus time in microseconds for a number of bytes at the 4MHz test clock */
+static unsigned int bus_time_us(unsigned int bytes)
+{
+	return bytes * 2;
+}
+
+/* Bus bytes clocked whilst a page read is outstanding behind a sector erase */
+static unsigned int read_latency_during_erase(unsigned int read_addr)
+{
+	unsigned int start;
+
+	erase_done = false;
+	read_done = false;
+	s25fl128->erase_async(0, erase_callback, NULL);
+	start = s25fl128->get_stats().xfer_bytes;
+	s25fl128->read_async(read_addr, rd_buffer, sizeof(rd_buffer), read_callback, NULL);
+	while (!read_done || !erase_done);
+
+	return read_done_bytes - start;
+}
+
+/* Number of page programs the original 251-byte split issued per write */
+static unsigned int legacy_programs(unsigned int sz)
+{
+	return (sz + 250) / 251;
+}
+
+/* Print programs per KB as a fixed point number with two decimal places */
+static void report_programs_per_kb(const char *name, unsigned int programs,
+		unsigned int legacy, unsigned int bytes)
+{
+	unsigned int now = (programs * 1024 * 100) / bytes;
+	unsigned int before = (legacy * 1024 * 100) / bytes;
+
+	printf("%s: %u.%02u programs/KB (before: %u.%02u)\n", name,
+			now / 100, now % 100, before / 100, before % 100);
+}
+
+TEST_GROUP(SpiFlashBenchmark)
+{
+	void setup() {
+		s25fl128 = new S25FL128(spi, spi_config);
+		s25fl128->erase_all();
+		for (unsigned int i = 0; i < sizeof(wr_buffer); i++)
+			wr_buffer[i] = i;
+	}
+
+	void teardown() {
+		delete s25fl128;
+	}
+};
+
+TEST(SpiFlashBenchmark, ProgramsPerKB)
+{
+	const unsigned int num_writes = 16;
+	unsigned int legacy;
+
+	/* Page aligned FileSystem page flushes */
+	s25fl128->reset_stats();
+	for (unsigned int i = 0; i < num_writes; i++)
+		s25fl128->write(i * S25FL128_PAGE_SIZE, wr_buffer, S25FL128_PAGE_SIZE);
+	legacy = num_writes * legacy_programs(S25FL128_PAGE_SIZE);
+	report_programs_per_kb("Aligned page writes", s25fl128->get_stats().program_count,
+			legacy, num_writes * S25FL128_PAGE_SIZE);
+	CHECK_EQUAL(num_writes, s25fl128->get_stats().program_count);
+
+	/* Unaligned page sized writes each straddle a device page boundary */
+	const unsigned int base = S25FL128_BLOCK_SIZE + 100;
+	s25fl128->reset_stats();
+	for (unsigned int i = 0; i < num_writes; i++)
+		s25fl128->write(base + i * S25FL128_PAGE_SIZE, wr_buffer, S25FL128_PAGE_SIZE);
+	report_programs_per_kb("Unaligned page writes", s25fl128->get_stats().program_count,
+			legacy, num_writes * S25FL128_PAGE_SIZE);
+	CHECK_EQUAL(2 * num_writes, s25fl128->get_stats().program_count);
+
+	/* A single large unaligned write programs whole pages after the first */
+	static uint8_t big_buffer[num_writes * S25FL128_PAGE_SIZE];
+	s25fl128->reset_stats();
+	s25fl128->write(2 * S25FL128_BLOCK_SIZE + 100, big_buffer, sizeof(big_buffer));
+	report_programs_per_kb("Unaligned bulk write", s25fl128->get_stats().program_count,
+			legacy_programs(sizeof(big_buffer)), sizeof(big_buffer));
+	CHECK_EQUAL(num_writes + 1, s25fl128->get_stats().program_count);
+}
+
+TEST(SpiFlashBenchmark, RecordReadsWithReadCache)
+{
+	static uint8_t cache[4 * S25FL128_PAGE_SIZE];
+	const unsigned int record_size = 16;
+	const unsigned int total = 4 * S25FL128_PAGE_SIZE;
+	unsigned int uncached, cached;
+	uint8_t record[record_size];
+
+	/* Record by record reads of a file spanning four pages */
+	s25fl128->reset_stats();
+	for (unsigned int addr = 0; addr < total; addr += record_size)
+		s25fl128->read(addr, record, record_size);
+	uncached = s25fl128->get_stats().xfer_bytes;
+
+	s25fl128->set_read_cache(cache, 4);
+	s25fl128->reset_stats();
+	for (unsigned int addr = 0; addr < total; addr += record_size)
+		s25fl128->read(addr, record, record_size);
+	cached = s25fl128->get_stats().xfer_bytes;
+
+	printf("Record reads of %u bytes: %u bus bytes uncached, %u cached, %u hits %u misses\n",
+			record_size, uncached, cached, s25fl128->get_stats().read_cache_hits,
+			s25fl128->get_stats().read_cache_misses);
+	CHECK_EQUAL(4, s25fl128->get_stats().read_cache_misses);
+	CHECK(cached < uncached);
+}
+
+TEST(SpiFlashBenchmark, EraseRangePlannedOperations)
+{
+	static const struct
+	{
+		const char *name;
+		unsigned int addr;
+		unsigned int len;
+		unsigned int expected;
+	} ranges[] =
+	{
+		{ "One sector",   S25FL128_BLOCK_SIZE, S25FL128_BLOCK_SIZE, 1 },
+		{ "Four sectors", 0, 4 * S25FL128_BLOCK_SIZE, 4 },
+		{ "Whole device", 0, S25FL128_NUM_PAGES * S25FL128_PAGE_SIZE, 1 },
+	};
+
+	for (unsigned int i = 0; i < sizeof(ranges) / sizeof(ranges[0]); i++)
+	{
+		unsigned int num_ops;
+		CHECK_EQUAL(SPI_FLASH_NO_ERROR, s25fl128->plan_erase_range(ranges[i].addr, ranges[i].len, &num_ops));
+		printf("%s: %u erase operations planned (%u block erases)\n", ranges[i].name,
+				num_ops, ranges[i].len / S25FL128_BLOCK_SIZE);
+		CHECK_EQUAL(ranges[i].expected, num_ops);
+	}
+}
+
+TEST(SpiFlashBenchmark, ReadLatencyDuringErase)
+{
+	unsigned int blocked, suspended;
+
+	/* Reading the sector being erased has to wait for the whole erase */
+	blocked = read_latency_during_erase(0);
+
+	/* Reading elsewhere suspends the erase */
+	suspended = read_latency_during_erase(S25FL128_BLOCK_SIZE);
+
+	printf("Read latency during erase: %u us suspended, %u us blocked\n",
+			bus_time_us(suspended), bus_time_us(blocked));
+	CHECK(suspended < blocked);
+}
+
+TEST(SpiFlashBenchmark, PollingPolicies)
+{
+	static const struct
+	{
+		const char *name;
+		spi_flash_poll_policy_t policy;
+	} policies[] =
+	{
+		{ "continuous", { SPI_FLASH_POLL_CONTINUOUS, 0,   0,    0 } },
+		{ "fixed",      { SPI_FLASH_POLL_FIXED,      500, 500,  0 } },
+		{ "backoff",    { SPI_FLASH_POLL_BACKOFF,    20,  5000, 0 } },
+	};
+
+	for (unsigned int i = 0; i < sizeof(policies) / sizeof(policies[0]); i++)
+	{
+		spi_flash_poll_stats_t poll;
+
+		CHECK_EQUAL(SPI_FLASH_NO_ERROR, s25fl128->set_poll_policy(policies[i].policy));
+		s25fl128->reset_stats();
+		CHECK_EQUAL(SPI_FLASH_NO_ERROR, s25fl128->write(0, wr_buffer, sizeof(wr_buffer)));
+		CHECK_EQUAL(SPI_FLASH_NO_ERROR, s25fl128->erase_block(0));
+
+		poll = s25fl128->get_stats().poll[policies[i].policy.type];
+		printf("Program and erase polling (%s): %u polls, %u us waiting\n",
+				policies[i].name, poll.poll_count, poll.wait_us);
+		CHECK(poll.poll_count > 0);
+	}
+}
+
+/* Print the latency of an operation and its throughput */
+static void report_latency(const char *name, uint32_t cycles, unsigned int bytes)
+{
+	printf("%s: %u us (%u KB/s)\n", name, cycle_counter_us(cycles),
+			cycle_counter_kb_per_s(bytes, cycles));
+}
+
+TEST(SpiFlashBenchmark, OperationLatency)
+{
+	uint32_t start, program, read, erase;
+
+	cycle_counter_start();
+
+	start = cycle_counter_read();
+	CHECK_EQUAL(SPI_FLASH_NO_ERROR, s25fl128->write(0, wr_buffer, S25FL128_PAGE_SIZE));
+	program = cycle_counter_read() - start;
+
+	start = cycle_counter_read();
+	CHECK_EQUAL(SPI_FLASH_NO_ERROR, s25fl128->read(0, rd_buffer, S25FL128_PAGE_SIZE));
+	read = cycle_counter_read() - start;
+
+	start = cycle_counter_read();
+	CHECK_EQUAL(SPI_FLASH_NO_ERROR, s25fl128->erase_block(0));
+	erase = cycle_counter_read() - start;
+
+	report_latency("Page program", program, S25FL128_PAGE_SIZE);
+	report_latency("Page read", read, S25FL128_PAGE_SIZE);
+	report_latency("Sector erase", erase, S25FL128_BLOCK_SIZE);
+	CHECK(read < program);
+	CHECK(program < erase);
+}
+
+/* Cycles taken to write then read back sz bytes in xfer_size transfers */
+static void time_transfers(SpiFlash &flash, uint8_t *buffer, unsigned int xfer_size,
+		unsigned int sz, uint32_t &write_cycles, uint32_t &read_cycles)
+{
+	uint32_t start;
+
+	start = cycle_counter_read();
+	for (unsigned int addr = 0; addr < sz; addr += xfer_size)
+		CHECK_EQUAL(SPI_FLASH_NO_ERROR, flash.write(addr, buffer, xfer_size));
+	write_cycles = cycle_counter_read() - start;
+
+	start = cycle_counter_read();
+	for (unsigned int addr = 0; addr < sz; addr += xfer_size)
+		CHECK_EQUAL(SPI_FLASH_NO_ERROR, flash.read(addr, buffer, xfer_size));
+	read_cycles = cycle_counter_read() - start;
+}
+
+TEST(SpiFlashBenchmark, StripedThroughput)
+{
+	static uint8_t buffer[4 * SPI_FLASH_STAND_IN_PAGE_SIZE];
+	SpiFlashStandIn *stand_in[SPI_FLASH_STAND_IN_DEVICES];
+	SpiFlash *devices[SPI_FLASH_STAND_IN_DEVICES];
+	uint32_t single_write, single_read, striped_write, striped_read;
+
+	for (unsigned int i = 0; i < SPI_FLASH_STAND_IN_DEVICES; i++)
+	{
+		stand_in[i] = new SpiFlashStandIn(i);
+		devices[i] = stand_in[i];
+	}
+	memset(buffer, 0xA5, sizeof(buffer));
+	cycle_counter_start();
+
+	{
+		StripedSpiFlash striped(devices, SPI_FLASH_STAND_IN_DEVICES,
+				SPI_FLASH_STAND_IN_PAGE_SIZE);
+
+		/* Same amount of data through one device and through the stripe set */
+		striped.erase_all();
+		time_transfers(*stand_in[0], buffer, sizeof(buffer),
+				SPI_FLASH_STAND_IN_BLOCK_SIZE, single_write, single_read);
+
+		striped.erase_all();
+		time_transfers(striped, buffer, sizeof(buffer),
+				SPI_FLASH_STAND_IN_BLOCK_SIZE, striped_write, striped_read);
+	}
+
+	printf("Striped write: %lu cycles, %lu cycles for one device (%lu%% throughput)\n",
+			(unsigned long)striped_write, (unsigned long)single_write,
+			(unsigned long)((100ULL * single_write) / striped_write));
+	printf("Striped read: %lu cycles, %lu cycles for one device (%lu%% throughput)\n",
+			(unsigned long)striped_read, (unsigned long)single_read,
+			(unsigned long)((100ULL * single_read) / striped_read));
+	CHECK(striped_write < single_write);
+	CHECK(striped_read < single_read);
+
+	for (unsigned int i = 0; i < SPI_FLASH_STAND_IN_DEVICES; i++)
+		delete stand_in[i];
+}
@@ -0,0 +1,212 @@
+#include <algorithm>
+#include "SpiFlashStandIn.h"
+
+extern "C" {
+
+#include <string.h>
+#include "app_util_platform.h"
+
+static uint8_t stand_in_mem[SPI_FLASH_STAND_IN_DEVICES]
+						   [SPI_FLASH_STAND_IN_BLOCK_SIZE * SPI_FLASH_STAND_IN_NUM_BLOCKS];
+
+static void timer_handler(void * p_context)
+{
+	struct SpiFlashStandIn *p = (struct SpiFlashStandIn *)p_context;
+	p->_timer_handler();
+}
+
+typedef struct
+{
+	volatile bool done;
+	int result;
+} sync_t;
+
+static void sync_callback(int result, void *context)
+{
+	sync_t *sync = (sync_t *)context;
+	sync->result = result;
+	sync->done = true;
+}
+
+}
+
+/* Bus time for a command with a 4 byte header and sz bytes of data */
+static unsigned int bus_time_us(unsigned int sz)
+{
+	return ((4 + sz) * 8 * 1000000ULL) / SPI_FLASH_STAND_IN_CLOCK_HZ;
+}
+
+SpiFlashStandIn::SpiFlashStandIn(unsigned int device) : SpiFlash()
+{
+	mem = stand_in_mem[device];
+	set_geometry<Geometry>();
+
+	queue_head = 0;
+	queue_count = 0;
+	memset(&timer_data, 0, sizeof(timer_data));
+	timer = &timer_data;
+	app_timer_create(&timer, APP_TIMER_MODE_SINGLE_SHOT, timer_handler);
+}
+
+SpiFlashStandIn::~SpiFlashStandIn()
+{
+	sync();
+}
+
+void SpiFlashStandIn::start()
+{
+	spi_flash_cmd_t *cmd = &queue[queue_head];
+	unsigned int duration_us = 0;
+
+	/* Apply the command straight away and complete it once the modelled
+	 * time has passed.
+	 */
+	switch (cmd->op)
+	{
+	case SPI_FLASH_OP_READ:
+		memcpy(cmd->data, &mem[cmd->addr], cmd->sz);
+		duration_us = bus_time_us(cmd->sz);
+		break;
+	case SPI_FLASH_OP_WRITE:
+		for (unsigned int i = 0; i < cmd->sz; i++)
+			mem[cmd->addr + i] &= cmd->data[i];
+		for (unsigned int addr = cmd->addr, sz = cmd->sz; sz > 0;)
+		{
+			unsigned int chunk = std::min(sz, page_size - (addr & page_mask));
+			duration_us += bus_time_us(chunk) + SPI_FLASH_STAND_IN_PROGRAM_US;
+			addr += chunk;
+			sz -= chunk;
+		}
+		break;
+	case SPI_FLASH_OP_ERASE:
+		memset(&mem[cmd->addr & ~block_mask], 0xFF, block_size);
+		duration_us = bus_time_us(0) + SPI_FLASH_STAND_IN_ERASE_US;
+		break;
+	case SPI_FLASH_OP_ERASE_ALL:
+		memset(mem, 0xFF, get_capacity());
+		duration_us = bus_time_us(0) + SPI_FLASH_STAND_IN_ERASE_US * SPI_FLASH_STAND_IN_NUM_BLOCKS;
+		break;
+	default:
+		break;
+	}
+
+	app_timer_start(timer, std::max((uint32_t)APP_TIMER_MIN_TIMEOUT_TICKS,
+			(uint32_t)ROUNDED_DIV(duration_us * (uint64_t)APP_TIMER_CLOCK_FREQ,
+					1000000 * (APP_TIMER_CONFIG_RTC_FREQUENCY + 1))), this);
+}
+
+void SpiFlashStandIn::_timer_handler()
+{
+	spi_flash_cmd_t cmd = queue[queue_head];
+
+	queue_head = (queue_head + 1) % SPI_FLASH_QUEUE_SIZE;
+	queue_count--;
+	if (queue_count)
+		start();
+
+	if (cmd.callback)
+		cmd.callback(SPI_FLASH_NO_ERROR, cmd.context);
+}
+
+int SpiFlashStandIn::submit(const spi_flash_cmd_t &cmd)
+{
+	int ret = SPI_FLASH_NO_ERROR;
+
+	if (cmd.op != SPI_FLASH_OP_ERASE_ALL && cmd.addr + cmd.sz > get_capacity())
+		return SPI_FLASH_ERROR_INVALID_RANGE;
+
+	CRITICAL_REGION_ENTER();
+	if (queue_count == SPI_FLASH_QUEUE_SIZE)
+	{
+		ret = SPI_FLASH_ERROR_QUEUE_FULL;
+	}
+	else
+	{
+		queue[(queue_head + queue_count) % SPI_FLASH_QUEUE_SIZE] = cmd;
+		if (queue_count++ == 0)
+			start();
+	}
+	CRITICAL_REGION_EXIT();
+
+	return ret;
+}
+
+int SpiFlashStandIn::wait(const spi_flash_cmd_t &cmd)
+{
+	spi_flash_cmd_t c = cmd;
+	sync_t sync;
+	int ret;
+
+	sync.done = false;
+	c.callback = sync_callback;
+	c.context = &sync;
+
+	while ((ret = submit(c)) == SPI_FLASH_ERROR_QUEUE_FULL);
+	if (ret)
+		return ret;
+
+	while (!sync.done);
+
+	return sync.result;
+}
+
+int SpiFlashStandIn::write(unsigned int addr, const uint8_t *data, unsigned int sz)
+{
+	spi_flash_cmd_t cmd = { SPI_FLASH_OP_WRITE, 0, addr, const_cast<uint8_t *>(data), sz, NULL, NULL };
+	return wait(cmd);
+}
+
+int SpiFlashStandIn::read(unsigned int addr, uint8_t *data, unsigned int sz)
+{
+	spi_flash_cmd_t cmd = { SPI_FLASH_OP_READ, 0, addr, data, sz, NULL, NULL };
+	return wait(cmd);
+}
+
+int SpiFlashStandIn::erase_block(unsigned int addr)
+{
+	spi_flash_cmd_t cmd = { SPI_FLASH_OP_ERASE, 0, addr, NULL, 0, NULL, NULL };
+	return wait(cmd);
+}
+
+int SpiFlashStandIn::erase_all()
+{
+	spi_flash_cmd_t cmd = { SPI_FLASH_OP_ERASE_ALL, 0, 0, NULL, 0, NULL, NULL };
+	return wait(cmd);
+}
+
+int SpiFlashStandIn::read_async(unsigned int addr, uint8_t *data, unsigned int sz,
+		spi_flash_callback_t callback, void *context)
+{
+	spi_flash_cmd_t cmd = { SPI_FLASH_OP_READ, 0, addr, data, sz, callback, context };
+	return submit(cmd);
+}
+
+int SpiFlashStandIn::write_async(unsigned int addr, const uint8_t *data, unsigned int sz,
+		spi_flash_callback_t callback, void *context)
+{
+	spi_flash_cmd_t cmd = { SPI_FLASH_OP_WRITE, 0, addr, const_cast<uint8_t *>(data), sz, callback, context };
+	return submit(cmd);
+}
+
+int SpiFlashStandIn::erase_async(unsigned int addr, spi_flash_callback_t callback, void *context)
+{
+	spi_flash_cmd_t cmd = { SPI_FLASH_OP_ERASE, 0, addr, NULL, 0, callback, context };
+	return submit(cmd);
+}
+
+int SpiFlashStandIn::erase_all_async(spi_flash_callback_t callback, void *context)
+{
+	spi_flash_cmd_t cmd = { SPI_FLASH_OP_ERASE_ALL, 0, 0, NULL, 0, callback, context };
+	return submit(cmd);
+}
+
+bool SpiFlashStandIn::is_busy()
+{
+	return queue_count > 0;
+}
+
+int SpiFlashStandIn::sync()
+{
+	while (is_busy());
+	return SPI_FLASH_NO_ERROR;
+}
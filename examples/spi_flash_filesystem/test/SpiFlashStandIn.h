@@ -0,0 +1,58 @@
+#pragma once
+
+#include "SpiFlash.h"
+
+/* Small RAM backed devices that stand in for flash chips on SPIM instances
+ * the test board doesn't have.  Commands complete from an app_timer after
+ * the time the bus transfer and program/erase would take, so that several
+ * stand-ins really do run concurrently.
+ */
+#define SPI_FLASH_STAND_IN_DEVICES		2
+#define SPI_FLASH_STAND_IN_PAGE_SIZE	0x200
+#define SPI_FLASH_STAND_IN_BLOCK_SIZE	0x1000
+#define SPI_FLASH_STAND_IN_NUM_BLOCKS	2
+
+typedef FlashGeometry<SPI_FLASH_STAND_IN_PAGE_SIZE, SPI_FLASH_STAND_IN_BLOCK_SIZE,
+		(SPI_FLASH_STAND_IN_BLOCK_SIZE / SPI_FLASH_STAND_IN_PAGE_SIZE) *
+		SPI_FLASH_STAND_IN_NUM_BLOCKS> SpiFlashStandInGeometry;
+
+/* Modelled timings: a 4MHz bus and S25FL128S typical program time */
+#define SPI_FLASH_STAND_IN_CLOCK_HZ		4000000
+#define SPI_FLASH_STAND_IN_PROGRAM_US	340
+#define SPI_FLASH_STAND_IN_ERASE_US		20000
+
+class SpiFlashStandIn : public SpiFlash
+{
+private:
+	uint8_t *mem;
+	spi_flash_cmd_t queue[SPI_FLASH_QUEUE_SIZE];
+	volatile unsigned int queue_head;
+	volatile unsigned int queue_count;
+	app_timer_t timer_data;
+	app_timer_id_t timer;
+
+	int submit(const spi_flash_cmd_t &cmd);
+	int wait(const spi_flash_cmd_t &cmd);
+	void start();
+
+public:
+	typedef SpiFlashStandInGeometry Geometry;
+
+	/* Device selects one of the SPI_FLASH_STAND_IN_DEVICES memories */
+	SpiFlashStandIn(unsigned int device);
+	~SpiFlashStandIn();
+	int write(unsigned int addr, const uint8_t *data, unsigned int sz);
+	int read(unsigned int addr, uint8_t *data, unsigned int sz);
+	int erase_block(unsigned int addr);
+	int erase_all();
+	int read_async(unsigned int addr, uint8_t *data, unsigned int sz,
+			spi_flash_callback_t callback, void *context);
+	int write_async(unsigned int addr, const uint8_t *data, unsigned int sz,
+			spi_flash_callback_t callback, void *context);
+	int erase_async(unsigned int addr, spi_flash_callback_t callback, void *context);
+	int erase_all_async(spi_flash_callback_t callback, void *context);
+	bool is_busy();
+	int sync();
+
+	void _timer_handler();
+};
@@ -0,0 +1,142 @@
+#include "CppUTest/TestHarness.h"
+#include "StripedSpiFlash.h"
+#include "SpiFlashStandIn.h"
+
+#define STRIPE_UNIT		SPI_FLASH_STAND_IN_PAGE_SIZE
+
+static SpiFlashStandIn *stand_in[SPI_FLASH_STAND_IN_DEVICES];
+static SpiFlash *devices[SPI_FLASH_STAND_IN_DEVICES];
+static StripedSpiFlash *striped;
+static uint8_t wr_buffer[4 * STRIPE_UNIT];
+static uint8_t rd_buffer[4 * STRIPE_UNIT];
+
+TEST_GROUP(StripedSpiFlash)
+{
+	void setup() {
+		for (unsigned int i = 0; i < SPI_FLASH_STAND_IN_DEVICES; i++)
+		{
+			stand_in[i] = new SpiFlashStandIn(i);
+			devices[i] = stand_in[i];
+		}
+		striped = new StripedSpiFlash(devices, SPI_FLASH_STAND_IN_DEVICES, STRIPE_UNIT);
+		striped->erase_all();
+		for (unsigned int i = 0; i < sizeof(wr_buffer); i++)
+		{
+			wr_buffer[i] = i + (i / 256);
+			rd_buffer[i] = 0;
+		}
+	}
+
+	void teardown() {
+		delete striped;
+		for (unsigned int i = 0; i < SPI_FLASH_STAND_IN_DEVICES; i++)
+			delete stand_in[i];
+	}
+};
+
+TEST(StripedSpiFlash, Geometry)
+{
+	CHECK_EQUAL(SPI_FLASH_STAND_IN_DEVICES * stand_in[0]->get_capacity(), striped->get_capacity());
+	CHECK_EQUAL(SPI_FLASH_STAND_IN_DEVICES * SPI_FLASH_STAND_IN_BLOCK_SIZE, striped->get_block_size());
+	CHECK_EQUAL(SPI_FLASH_STAND_IN_PAGE_SIZE, striped->get_page_size());
+}
+
+TEST(StripedSpiFlash, WriteInterleavesStripeUnits)
+{
+	CHECK_EQUAL(SPI_FLASH_NO_ERROR, striped->write(0, wr_buffer, sizeof(wr_buffer)));
+
+	/* Alternate stripe units land on alternate devices */
+	for (unsigned int i = 0; i < 4; i++)
+	{
+		stand_in[i % 2]->read((i / 2) * STRIPE_UNIT, rd_buffer, STRIPE_UNIT);
+		MEMCMP_EQUAL(&wr_buffer[i * STRIPE_UNIT], rd_buffer, STRIPE_UNIT);
+	}
+}
+
+TEST(StripedSpiFlash, UnalignedWriteWithReadBack)
+{
+	unsigned int addr = STRIPE_UNIT / 2 + 3;
+
+	CHECK_EQUAL(SPI_FLASH_NO_ERROR, striped->write(addr, wr_buffer, sizeof(wr_buffer) - STRIPE_UNIT));
+	CHECK_EQUAL(SPI_FLASH_NO_ERROR, striped->read(addr, rd_buffer, sizeof(rd_buffer) - STRIPE_UNIT));
+	MEMCMP_EQUAL(wr_buffer, rd_buffer, sizeof(wr_buffer) - STRIPE_UNIT);
+}
+
+TEST(StripedSpiFlash, EraseBlockErasesEveryDevice)
+{
+	unsigned int block = striped->get_block_size();
+
+	striped->write(block, wr_buffer, sizeof(wr_buffer));
+	striped->write(0, wr_buffer, sizeof(wr_buffer));
+	CHECK_EQUAL(SPI_FLASH_NO_ERROR, striped->erase_block(block));
+
+	striped->read(block, rd_buffer, sizeof(rd_buffer));
+	for (unsigned int i = 0; i < sizeof(rd_buffer); i++)
+		CHECK_EQUAL(0xFF, rd_buffer[i]);
+
+	/* The neighbouring block is untouched */
+	striped->read(0, rd_buffer, sizeof(rd_buffer));
+	MEMCMP_EQUAL(wr_buffer, rd_buffer, sizeof(wr_buffer));
+}
+
+TEST(StripedSpiFlash, EraseRangeInWholeBlocks)
+{
+	unsigned int block = striped->get_block_size();
+	unsigned int num_ops;
+
+	CHECK_EQUAL(SPI_FLASH_ERROR_INVALID_RANGE, striped->erase_range(0, block / 2, &num_ops));
+	CHECK_EQUAL(SPI_FLASH_NO_ERROR, striped->erase_range(0, 2 * block, &num_ops));
+	CHECK_EQUAL(2, num_ops);
+}
+
+TEST(StripedSpiFlash, InvalidRangeAndAsync)
+{
+	CHECK_EQUAL(SPI_FLASH_ERROR_INVALID_RANGE, striped->write(striped->get_capacity() - 1, wr_buffer, 2));
+	CHECK_EQUAL(SPI_FLASH_ERROR_INVALID_RANGE, striped->read(striped->get_capacity(), rd_buffer, 1));
+	CHECK_EQUAL(SPI_FLASH_ERROR_NOT_SUPPORTED, striped->read_async(0, rd_buffer, 1, NULL, NULL));
+}
+
+TEST(StripedSpiFlash, InvalidStripeUnit)
+{
+	static const unsigned int stripe_units[] =
+	{
+		0,
+		SPI_FLASH_STAND_IN_PAGE_SIZE / 2,		/* Splits a page */
+		3 * SPI_FLASH_STAND_IN_PAGE_SIZE,		/* Doesn't divide the block */
+		2 * SPI_FLASH_STAND_IN_BLOCK_SIZE,		/* Larger than the block */
+	};
+
+	for (unsigned int i = 0; i < sizeof(stripe_units) / sizeof(stripe_units[0]); i++)
+	{
+		StripedSpiFlash invalid(devices, SPI_FLASH_STAND_IN_DEVICES, stripe_units[i]);
+
+		CHECK_EQUAL(0, invalid.get_capacity());
+		CHECK_EQUAL(SPI_FLASH_ERROR_INVALID_RANGE, invalid.write(0, wr_buffer, 1));
+		CHECK_EQUAL(SPI_FLASH_ERROR_INVALID_RANGE, invalid.read(0, rd_buffer, 1));
+		CHECK_EQUAL(SPI_FLASH_ERROR_INVALID_RANGE, invalid.erase_block(0));
+	}
+}
+
+TEST(StripedSpiFlash, InvalidNumberOfDevices)
+{
+	SpiFlash *too_many[2 * STRIPED_FLASH_MAX_DEVICES];
+	static const unsigned int num_devices[] =
+	{
+		0,
+		3,								/* Not a power of two */
+		2 * STRIPED_FLASH_MAX_DEVICES,	/* More than there is room for */
+	};
+
+	for (unsigned int i = 0; i < sizeof(too_many) / sizeof(too_many[0]); i++)
+		too_many[i] = devices[i % SPI_FLASH_STAND_IN_DEVICES];
+
+	for (unsigned int i = 0; i < sizeof(num_devices) / sizeof(num_devices[0]); i++)
+	{
+		StripedSpiFlash invalid(too_many, num_devices[i], STRIPE_UNIT);
+
+		CHECK_EQUAL(0, invalid.get_capacity());
+		CHECK_EQUAL(0, invalid.get_block_size());
+		CHECK_EQUAL(SPI_FLASH_ERROR_INVALID_RANGE, invalid.write(0, wr_buffer, 1));
+		CHECK_EQUAL(SPI_FLASH_ERROR_INVALID_RANGE, invalid.read(0, rd_buffer, 1));
+	}
+}
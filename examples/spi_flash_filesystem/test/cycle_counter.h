@@ -0,0 +1,31 @@
+#pragma once
+
+extern "C" {
+#include "nrf.h"
+}
+
+/* Cortex-M4 DWT cycle counter used by the benchmarks */
+static inline void cycle_counter_start()
+{
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CYCCNT = 0;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+static inline uint32_t cycle_counter_read()
+{
+	return DWT->CYCCNT;
+}
+
+static inline unsigned int cycle_counter_us(uint32_t cycles)
+{
+	return cycles / (SystemCoreClock / 1000000);
+}
+
+/* Throughput for a number of bytes moved in a number of cycles */
+static inline unsigned int cycle_counter_kb_per_s(unsigned int bytes, uint32_t cycles)
+{
+	unsigned int us = cycle_counter_us(cycles);
+
+	return us ? (unsigned int)((bytes * 1000000ULL) / (us * 1024ULL)) : 0;
+}